@@ -0,0 +1,108 @@
+// Scanner throughput in MB/s. Scans the given Lox scripts, or generated source if none are given.
+//
+//   cmake --build build --target cpplox-scanner-bench
+//   ./build/bench/cpplox-scanner-bench [path...]
+
+import std;
+import cpplox;
+
+namespace {
+
+constexpr const std::size_t GENERATED_SIZE = 16 * 1024 * 1024;
+constexpr const std::size_t RUNS = 5;
+
+// Mix of everything the scanner skips in blocks: indentation, comments, long names and strings
+constexpr const std::string_view GENERATED_CHUNK = R"(// Generated for the scanner benchmark
+class Accumulator < Base {
+    init(initial_value) {
+        this.current_value = initial_value; // running total
+        this.description = "an accumulator with a fairly long description string";
+    }
+
+    add(amount_to_add) {
+        if (amount_to_add >= 0 and amount_to_add <= 1000000) {
+            this.current_value = this.current_value + amount_to_add * 1.5;
+        }
+        return this.current_value;
+    }
+}
+
+fun run_accumulator(iterations) {
+    var accumulator = Accumulator(0);
+    for (var index = 0; index < iterations; index = index + 1) {
+        accumulator.add(index);
+    }
+    print accumulator.current_value;
+}
+)";
+
+auto generate_source() -> std::string
+{
+    std::string source;
+    source.reserve(GENERATED_SIZE + GENERATED_CHUNK.size());
+    while (source.size() < GENERATED_SIZE) {
+        source += GENERATED_CHUNK;
+    }
+    return source;
+}
+
+auto read_file(const std::filesystem::path & filename) -> std::string
+{
+    std::ifstream script(filename);
+    if (!script.is_open()) {
+        std::println("Failed to open {}", filename.native());
+        cpplox::exit_program(cpplox::ExitCode::IOError);
+    }
+
+    std::stringstream buffer;
+    buffer << script.rdbuf();
+    return buffer.str();
+}
+
+auto scan_all(std::string_view source) -> std::size_t
+{
+    cpplox::init_scanner(source);
+    std::size_t tokens = 1;
+    while (cpplox::scan_token().type != cpplox::TokenType::EndOfFile) {
+        tokens++;
+    }
+    return tokens;
+}
+
+auto bench(std::string_view name, std::string_view source) -> void
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::size_t tokens = 0;
+    auto best = Clock::duration::max();
+    for (auto _ : std::views::iota(0UZ, RUNS)) {
+        auto start = Clock::now();
+        tokens = scan_all(source);
+        best = std::min(best, Clock::now() - start);
+    }
+
+    auto seconds = std::chrono::duration<double>(best).count();
+    auto megabytes = static_cast<double>(source.size()) / (1024.0 * 1024.0);
+    std::println(
+            "{}: {:.1f} MB, {} tokens, {:.1f} MB/s, {:.1f} Mtokens/s",
+            name,
+            megabytes,
+            tokens,
+            megabytes / seconds,
+            static_cast<double>(tokens) / seconds / 1e6
+    );
+}
+
+} // namespace
+
+auto main(int argc, char ** argv) -> int
+{
+    auto paths = std::span(argv, static_cast<std::size_t>(argc)) | std::views::drop(1);
+
+    if (paths.empty()) {
+        bench("<generated>", generate_source());
+    }
+    for (const char * path : paths) {
+        bench(path, read_file(path));
+    }
+}
@@ -1,8 +1,19 @@
 export module cpplox;
 
+export import :Aot;
+export import :Bytecode;
 export import :Chunk;
 export import :Debug;
+export import :Embedding;
+export import :MappedFile;
+export import :Obj;
+export import :OpCode;
+export import :Runtime;
+export import :Scanner;
 export import :SourceLocation;
+export import :Token;
+export import :Value;
+export import :Verifier;
 export import :VirtualMachine;
 
 export import :exits;
@@ -0,0 +1,224 @@
+module cpplox;
+
+import std;
+
+import :Aot;
+import :Chunk;
+import :Compiler;
+import :Object;
+import :OpCode;
+import :Runtime;
+import :VirtualMachine;
+import :exits;
+
+namespace cpplox {
+
+namespace {
+
+// FNV-1a, stable between the run translating the script and the program running it. Operands are
+// hashed along with opcodes, functions differing in constants only do not match either.
+auto hash_code(std::span<const Byte> code) -> std::uint64_t
+{
+    constexpr std::uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+    constexpr std::uint64_t FNV_PRIME = 0x100000001b3;
+
+    std::uint64_t hash = FNV_OFFSET_BASIS;
+    for (Byte byte : code) {
+        hash ^= byte;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+auto is_translatable(const Chunk & chunk) -> bool
+{
+    for (std::size_t offset = 0; offset < chunk.code.size();
+         offset += instruction_size(chunk, offset)) {
+        switch (auto op = static_cast<OpCode>(chunk.code[offset])) {
+        case OpCode::Jump:
+        case OpCode::JumpIfFalse:
+        case OpCode::Loop: break;
+        default:
+            if (!runtime_entry(op).has_value()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Source is split into one literal per line to keep the generated code readable
+auto emit_string_literal(std::ostream & out, std::string_view str) -> void
+{
+    std::print(out, "\"");
+    for (char c : str) {
+        if (c == '\n') {
+            std::print(out, "\\n\"\n        \"");
+        }
+        else if (c == '\\' || c == '"') {
+            std::print(out, "\\{}", c);
+        }
+        else if (c >= ' ' && c <= '~') {
+            std::print(out, "{}", c);
+        }
+        else {
+            std::print(out, "\\{:03o}", static_cast<unsigned char>(c));
+        }
+    }
+    std::print(out, "\"");
+}
+
+auto emit_function(std::ostream & out, const ObjFunction & function, std::size_t index) -> void
+{
+    const auto & chunk = function.get_chunk();
+    const auto code_size = chunk.code.size();
+
+    auto name = function.get_name();
+    std::println(out, "// {}", name.empty() ? std::string_view{"script"} : name);
+    std::println(
+            out, "auto fn_{}(cpplox::ObjFunction & function, const Byte * ip) -> RunStatus", index
+    );
+    std::println(out, "{{");
+    std::println(out, "    const Byte * code = code_start(function);");
+
+    // Frames are resumed at any instruction, e.g. after a call has returned
+    std::println(out, "    switch (ip - code) {{");
+    for (std::size_t offset = 0; offset < code_size; offset += instruction_size(chunk, offset)) {
+        std::println(out, "    case {0}: goto L{0};", offset);
+    }
+    std::println(out, "    default: std::unreachable();");
+    std::println(out, "    }}");
+
+    for (std::size_t offset = 0; offset < code_size; offset += instruction_size(chunk, offset)) {
+        switch (auto op = static_cast<OpCode>(chunk.code[offset])) {
+        case OpCode::Jump:
+        case OpCode::Loop: {
+            std::println(out, "L{}: goto L{};", offset, jump_target(chunk, offset).value());
+            break;
+        }
+        case OpCode::JumpIfFalse: {
+            std::println(
+                    out,
+                    "L{0}: if (branch_if_false(code + {0}) == RunStatus::Branch) {{ goto L{1}; }}",
+                    offset,
+                    jump_target(chunk, offset).value()
+            );
+            break;
+        }
+        default: {
+            std::println(
+                    out,
+                    "L{0}: if (auto s = {1}(code + {0}); s != RunStatus::Next) {{ return s; }}",
+                    offset,
+                    runtime_entry(op)->name
+            );
+        }
+        }
+    }
+
+    std::println(out, "    std::unreachable();");
+    std::println(out, "}}");
+    std::println(out);
+}
+
+} // namespace
+
+auto emit_cpp(std::string_view source, std::ostream & out) -> bool
+{
+    auto * script = compile(source);
+    if (script == nullptr) {
+        return false;
+    }
+
+    auto functions = collect_functions(*script);
+
+    std::println(out, "// Generated by `cpplox --emit-cpp`, do not edit");
+    std::println(out, "import std;");
+    std::println(out, "import cpplox;");
+    std::println(out);
+    std::println(out, "namespace {{");
+    std::println(out);
+    std::println(out, "using cpplox::Byte;");
+    std::println(out, "using cpplox::RunStatus;");
+    std::println(out, "using namespace cpplox::runtime;");
+    std::println(out);
+
+    // The program compiles the source once again at startup: bytecode keeps constants, line
+    // information for errors and operands read by runtime entry points
+    std::print(out, "constexpr std::string_view SOURCE = ");
+    emit_string_literal(out, source);
+    std::println(out, ";");
+    std::println(out);
+
+    std::vector<bool> translated;
+    for (const auto [index, function] : std::views::enumerate(functions)) {
+        translated.push_back(is_translatable(function->get_chunk()));
+        if (translated.back()) {
+            emit_function(out, *function, static_cast<std::size_t>(index));
+        }
+    }
+
+    std::println(
+            out, "constexpr std::array<cpplox::AotFunction, {}> FUNCTIONS{{{{", functions.size()
+    );
+    for (const auto [index, function] : std::views::enumerate(functions)) {
+        std::println(
+                out,
+                "    {{.code_hash = {:#x}, .compiled = {}}},",
+                hash_code(function->get_chunk().code),
+                translated[static_cast<std::size_t>(index)] ? std::format("fn_{}", index) : "nullptr"
+        );
+    }
+    std::println(out, "}}}};");
+    std::println(out);
+    std::println(out, "}} // namespace");
+    std::println(out);
+    std::println(out, "auto main() -> int {{ return cpplox::aot_main(SOURCE, FUNCTIONS); }}");
+
+    return true;
+}
+
+auto interpret_aot(std::string_view source, std::span<const AotFunction> functions)
+        -> InterpretResult
+{
+    auto * script = compile(source);
+    if (script == nullptr) {
+        return InterpretResult::CompileError;
+    }
+
+    auto script_functions = collect_functions(*script);
+    auto matches = std::ranges::equal(
+            script_functions,
+            functions,
+            std::equal_to{},
+            [](const ObjFunction * function) { return hash_code(function->get_chunk().code); },
+            &AotFunction::code_hash
+    );
+    if (!matches) {
+        std::println(std::cerr, "Native code does not match the script.");
+        exit_program(ExitCode::SoftwareError);
+    }
+
+    for (const auto & [function, aot] : std::views::zip(script_functions, functions)) {
+        function->set_compiled(aot.compiled);
+    }
+
+    return interpret(*script);
+}
+
+auto aot_main(std::string_view source, std::span<const AotFunction> functions) -> int
+{
+    init_vm();
+    auto result = interpret_aot(source, functions);
+    free_vm();
+
+    if (result == InterpretResult::CompileError) {
+        exit_program(ExitCode::IncorrectInput);
+    }
+    if (result == InterpretResult::RuntimeError) {
+        exit_program(ExitCode::SoftwareError);
+    }
+    return static_cast<int>(ExitCode::Ok);
+}
+
+} // namespace cpplox
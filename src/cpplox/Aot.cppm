@@ -0,0 +1,29 @@
+export module cpplox:Aot;
+
+import std;
+
+import :Runtime;
+import :VirtualMachine;
+
+namespace cpplox {
+
+// Native body of a function, generated by `emit_cpp()`
+export struct AotFunction
+{
+    std::uint64_t code_hash; // of the bytecode it was generated from, see `interpret_aot()`
+    CompiledFn compiled;
+};
+
+// Translates the script into C++ source of a standalone program (see `aot_main()`). Every function
+// of the script becomes a C++ function calling runtime entry points, jumps become gotos.
+// Returns false if the script has compile errors.
+export auto emit_cpp(std::string_view source, std::ostream & out) -> bool;
+
+// Runs the script with native bodies generated by `emit_cpp()`, in the order they were emitted
+export auto interpret_aot(std::string_view source, std::span<const AotFunction> functions)
+        -> InterpretResult;
+
+// Entry point of a program generated by `emit_cpp()`
+export auto aot_main(std::string_view source, std::span<const AotFunction> functions) -> int;
+
+} // namespace cpplox
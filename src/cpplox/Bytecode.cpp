@@ -0,0 +1,307 @@
+module cpplox;
+
+import std;
+
+import :Bytecode;
+import :Chunk;
+import :Compiler;
+import :MappedFile;
+import :Object;
+import :OpCode;
+import :SourceLocation;
+import :Value;
+import :Verifier;
+import :VirtualMachine;
+
+namespace cpplox {
+
+namespace {
+
+// Layout of a bytecode file (integers in native byte order, bytecode files are caches for the
+// machine that wrote them, not a distribution format):
+//   header:     magic, version, hash of the source
+//   function:   name, arity, upvalue count, captures locals flag, code, location runs (see
+//               LineTable), constants
+//   constant:   tag followed by value, functions are nested in place
+// Bump the version whenever the layout or the instruction set changes.
+constexpr const std::array<char, 4> BYTECODE_MAGIC = {'L', 'O', 'X', 'C'};
+constexpr const std::uint32_t BYTECODE_VERSION = 7;
+
+struct Header
+{
+    std::array<char, 4> magic;
+    std::uint32_t version;
+    std::uint64_t source_hash;
+};
+
+enum class ConstantTag : std::uint8_t {
+    Nil,
+    Boolean,
+    Number,
+    String,
+    Function,
+};
+
+// FNV-1a, unlike std::hash it is stable between runs and builds
+auto hash_source(std::string_view source) -> std::uint64_t
+{
+    constexpr std::uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+    constexpr std::uint64_t FNV_PRIME = 0x100000001b3;
+
+    std::uint64_t hash = FNV_OFFSET_BASIS;
+    for (char c : source) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// *** Writing ***
+
+template <class T>
+    requires std::is_trivially_copyable_v<T>
+auto write_raw(std::ostream & out, const T & value) -> void
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T)); // NOLINT
+}
+
+auto write_size(std::ostream & out, std::size_t size) -> void
+{
+    write_raw(out, static_cast<std::uint32_t>(size));
+}
+
+auto write_bytes(std::ostream & out, std::span<const Byte> bytes) -> void
+{
+    write_size(out, bytes.size());
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const auto * data = reinterpret_cast<const char *>(bytes.data());
+    out.write(data, static_cast<std::streamsize>(bytes.size()));
+}
+
+auto write_string(std::ostream & out, std::string_view str) -> void
+{
+    write_size(out, str.size());
+    out.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+auto write_constant(std::ostream & out, const Value & value) -> void;
+
+auto write_function(std::ostream & out, const ObjFunction & function) -> void
+{
+    const auto & chunk = function.get_chunk();
+
+    write_string(out, function.get_name());
+    write_size(out, function.arity());
+    write_size(out, function.upvalue_count());
+    write_raw(out, static_cast<std::uint8_t>(function.captures_locals()));
+
+    write_bytes(out, chunk.code);
+
+    auto runs = chunk.locations.runs();
+    write_size(out, runs.size());
+    for (const auto & run : runs) {
+        write_size(out, run.length);
+        write_size(out, run.sloc.line);
+        write_size(out, run.sloc.column);
+    }
+
+    write_size(out, chunk.constants.size());
+    for (const auto & constant : chunk.constants) {
+        write_constant(out, constant);
+    }
+}
+
+auto write_constant(std::ostream & out, const Value & value) -> void
+{
+    if (value.is_nil()) {
+        write_raw(out, ConstantTag::Nil);
+    }
+    else if (value.is_boolean()) {
+        write_raw(out, ConstantTag::Boolean);
+        write_raw(out, static_cast<std::uint8_t>(value.as_boolean()));
+    }
+    else if (value.is_number()) {
+        write_raw(out, ConstantTag::Number);
+        write_raw(out, value.as_number());
+    }
+    else if (value.is_string()) {
+        write_raw(out, ConstantTag::String);
+        write_string(out, value.as_string());
+    }
+    else if (value.is_function()) {
+        write_raw(out, ConstantTag::Function);
+        write_function(out, *value.as_objfunction());
+    }
+    else {
+        std::unreachable(); // compiler does not put other objects into constants
+    }
+}
+
+// *** Reading ***
+
+// Reads data written above. Once any read fails (i.e. data has ended), all further reads fail too
+// and return empty values.
+class Reader
+{
+public:
+    explicit Reader(std::span<const std::byte> data)
+        : m_data(data)
+    {
+    }
+
+    [[nodiscard]] auto failed() const -> bool { return m_failed; }
+    [[nodiscard]] auto at_end() const -> bool { return m_data.empty(); }
+
+    auto fail() -> void { m_failed = true; }
+
+    auto read_bytes(std::size_t size) -> std::span<const std::byte>
+    {
+        if (m_failed || size > m_data.size()) {
+            fail();
+            return {};
+        }
+        auto bytes = m_data.first(size);
+        m_data = m_data.subspan(size);
+        return bytes;
+    }
+
+    template <class T>
+        requires std::is_trivially_copyable_v<T>
+    auto read_raw() -> T
+    {
+        T value{};
+        auto bytes = read_bytes(sizeof(T));
+        if (!bytes.empty()) {
+            std::memcpy(&value, bytes.data(), sizeof(T));
+        }
+        return value;
+    }
+
+    auto read_size() -> std::size_t { return read_raw<std::uint32_t>(); }
+
+    auto read_string() -> std::string_view
+    {
+        auto bytes = read_bytes(read_size());
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        return {reinterpret_cast<const char *>(bytes.data()), bytes.size()};
+    }
+
+private:
+    std::span<const std::byte> m_data;
+    bool m_failed = false;
+};
+
+auto read_constant(Reader & reader) -> Value;
+
+auto read_function(Reader & reader) -> ObjFunction *
+{
+    auto * function = ObjFunction::create(std::string{reader.read_string()});
+    // keep the function reachable for GC while its constants are being allocated
+    reserve_stack(1);
+    g_vm->stack.push(Value::obj(function));
+
+    function->arity() = reader.read_size();
+    function->upvalue_count() = reader.read_size();
+    function->captures_locals() = reader.read_raw<std::uint8_t>() != 0;
+
+    auto & chunk = function->get_chunk();
+
+    auto code = reader.read_bytes(reader.read_size());
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const auto * code_start = reinterpret_cast<const Byte *>(code.data());
+    chunk.code.assign(code_start, std::next(code_start, static_cast<std::ptrdiff_t>(code.size())));
+
+    auto run_count = reader.read_size();
+    for (std::size_t i = 0; i < run_count && !reader.failed(); i++) {
+        auto length = reader.read_size();
+        auto line = reader.read_size();
+        auto column = reader.read_size();
+        chunk.locations.add({.line = line, .column = column}, length);
+    }
+    if (chunk.locations.size() != chunk.code.size()) {
+        reader.fail();
+    }
+
+    auto constant_count = reader.read_size();
+    while (chunk.constants.size() < constant_count && !reader.failed()) {
+        chunk.constants.push_back(read_constant(reader));
+    }
+    // the cache might be damaged, the VM trusts bytecode to be well-formed
+    if (!reader.failed() && !verify_function(*function)) {
+        reader.fail();
+    }
+
+    g_vm->stack.pop();
+    return function;
+}
+
+auto read_constant(Reader & reader) -> Value
+{
+    switch (reader.read_raw<ConstantTag>()) {
+    case ConstantTag::Nil: return Value::nil();
+    case ConstantTag::Boolean: return Value::boolean(reader.read_raw<std::uint8_t>() != 0);
+    case ConstantTag::Number: return Value::number(reader.read_raw<double>());
+    case ConstantTag::String: return Value::string(reader.read_string());
+    case ConstantTag::Function: return Value::obj(read_function(reader));
+    }
+    reader.fail();
+    return Value::nil();
+}
+
+auto load_bytecode(std::span<const std::byte> data, std::optional<std::string_view> source)
+        -> ObjFunction *
+{
+    Reader reader{data};
+
+    auto header = reader.read_raw<Header>();
+    if (reader.failed() || header.magic != BYTECODE_MAGIC || header.version != BYTECODE_VERSION) {
+        return nullptr;
+    }
+    if (source.has_value() && header.source_hash != hash_source(source.value())) {
+        return nullptr;
+    }
+
+    auto * script = read_function(reader);
+    if (reader.failed() || !reader.at_end()) {
+        return nullptr;
+    }
+    return script;
+}
+
+} // namespace
+
+auto write_bytecode(std::string_view source, std::ostream & out) -> bool
+{
+    auto * script = compile(source);
+    if (script == nullptr) {
+        return false;
+    }
+
+    write_raw(
+            out,
+            Header{
+                    .magic = BYTECODE_MAGIC,
+                    .version = BYTECODE_VERSION,
+                    .source_hash = hash_source(source),
+            }
+    );
+    write_function(out, *script);
+    return true;
+}
+
+auto interpret_bytecode(const std::filesystem::path & path, std::optional<std::string_view> source)
+        -> std::optional<InterpretResult>
+{
+    ObjFunction * script = nullptr;
+    if (auto file = MappedFile::open(path); file.has_value()) {
+        // everything is copied out of the mapping, no need to keep it while running
+        script = load_bytecode(file->bytes(), source);
+    }
+
+    if (script == nullptr) {
+        return std::nullopt;
+    }
+    return interpret(*script);
+}
+
+} // namespace cpplox
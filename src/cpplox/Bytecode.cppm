@@ -0,0 +1,20 @@
+export module cpplox:Bytecode;
+
+import std;
+
+import :VirtualMachine;
+
+namespace cpplox {
+
+// Compiles the script and writes its bytecode, so that later runs can skip compilation. Returns
+// false if the script has compile errors.
+export auto write_bytecode(std::string_view source, std::ostream & out) -> bool;
+
+// Runs bytecode file written by `write_bytecode()`. If `source` is given, the file is only used if
+// it was compiled from exactly this source. Returns empty result if the file cannot be used, i.e. it
+// is missing, malformed, written by another version of cpplox or compiled from other source.
+export auto interpret_bytecode(
+        const std::filesystem::path & path, std::optional<std::string_view> source = std::nullopt
+) -> std::optional<InterpretResult>;
+
+} // namespace cpplox
@@ -1,6 +1,8 @@
 module cpplox;
 
 import :Chunk;
+import :CodeArena;
+import :Object;
 import :OpCode;
 import :Value;
 
@@ -9,7 +11,7 @@ namespace cpplox {
 auto write_chunk(Chunk & chunk, Byte data, SourceLocation sloc) -> void
 {
     chunk.code.push_back(data);
-    chunk.locations.push_back(sloc);
+    chunk.locations.add(sloc);
 }
 
 auto write_chunk(Chunk & chunk, OpCode op, SourceLocation sloc) -> void
@@ -23,4 +25,150 @@ auto add_constant(Chunk & chunk, Value value) -> std::size_t
     return chunk.constants.size() - 1;
 }
 
+auto relocate_chunk(Chunk & chunk, std::pmr::memory_resource & resource) -> void
+{
+    relocate(chunk.code, resource);
+    chunk.locations.relocate(resource);
+    relocate(chunk.constants, resource);
+}
+
+auto relocated_chunk_size(const Chunk & chunk) -> std::size_t
+{
+    constexpr std::size_t ALIGNMENT_SLACK = alignof(std::max_align_t);
+    return chunk.code.size() + chunk.locations.relocated_size()
+            + (chunk.constants.size() * sizeof(Value)) + (3 * ALIGNMENT_SLACK);
+}
+
+auto instruction_size(const Chunk & chunk, std::size_t offset) -> std::size_t
+{
+    using enum OpCode;
+
+    switch (static_cast<OpCode>(chunk.code[offset])) {
+    case Nil:
+    case True:
+    case False:
+    case Pop:
+    case GetIndex:
+    case SetIndex:
+    case Equal:
+    case Greater:
+    case Less:
+    case Add:
+    case Substract:
+    case Multiply:
+    case Divide:
+    case Not:
+    case Negate:
+    case Print:
+    case CloseUpvalue:
+    case Return:
+    case Inherit: return 1;
+    case Constant:
+    case List:
+    case DefineGlobal:
+    case GetGlobal:
+    case GetLocal:
+    case GetProperty:
+    case GetMethod:
+    case GetSuper:
+    case GetSuperMethod:
+    case GetUpvalue:
+    case SetGlobal:
+    case SetLocal:
+    case SetProperty:
+    case SetUpvalue:
+    case Concat:
+    case Call:
+    case CallMethod:
+    case TailCall:
+    case Class:
+    case Method: return 2;
+    case Jump:
+    case JumpIfFalse:
+    case Loop:
+    case Invoke:
+    case SuperInvoke: return 3;
+    case Closure: {
+        const auto * function = chunk.constants[chunk.code[offset + 1]].as_objfunction();
+        return 2 + (2 * function->upvalue_count());
+    }
+    }
+    std::unreachable();
+}
+
+auto jump_target(const Chunk & chunk, std::size_t offset) -> std::optional<std::size_t>
+{
+    auto op = static_cast<OpCode>(chunk.code[offset]);
+    auto length = static_cast<std::size_t>(
+            static_cast<DoubleByte>(chunk.code[offset + 1] << BYTE_DIGITS) | chunk.code[offset + 2]
+    );
+
+    std::size_t next = offset + 3;
+    if (op == OpCode::Loop) {
+        if (length > next) {
+            return std::nullopt;
+        }
+        return next - length;
+    }
+    return next + length;
+}
+
+auto stack_effect(const Chunk & chunk, std::size_t offset) -> StackEffect
+{
+    using enum OpCode;
+
+    auto operand = [&chunk, offset](std::size_t index) -> std::size_t {
+        return chunk.code[offset + index];
+    };
+
+    switch (static_cast<OpCode>(chunk.code[offset])) {
+    case Constant:
+    case Nil:
+    case True:
+    case False:
+    case GetGlobal:
+    case GetLocal:
+    case GetUpvalue:
+    case Closure:
+    case Class: return {.pops = 0, .pushes = 1};
+    case Pop:
+    case DefineGlobal:
+    case Print:
+    case CloseUpvalue:
+    case Return: return {.pops = 1, .pushes = 0};
+    case GetProperty:
+    case SetGlobal:
+    case SetLocal:
+    case SetUpvalue:
+    case Not:
+    case Negate:
+    case JumpIfFalse: return {.pops = 1, .pushes = 1};
+    case GetMethod: return {.pops = 1, .pushes = 2};
+    case GetIndex:
+    case GetSuper:
+    case SetProperty:
+    case Equal:
+    case Greater:
+    case Less:
+    case Add:
+    case Substract:
+    case Multiply:
+    case Divide:
+    case Inherit:
+    case Method: return {.pops = 2, .pushes = 1};
+    case GetSuperMethod: return {.pops = 2, .pushes = 2};
+    case SetIndex: return {.pops = 3, .pushes = 1};
+    case List:
+    case Concat: return {.pops = operand(1), .pushes = 1};
+    case Jump:
+    case Loop: return {.pops = 0, .pushes = 0};
+    case Call:
+    case TailCall: return {.pops = operand(1) + 1, .pushes = 1};
+    case CallMethod: return {.pops = operand(1) + 2, .pushes = 1};
+    case Invoke: return {.pops = operand(2) + 1, .pushes = 1};
+    case SuperInvoke: return {.pops = operand(2) + 2, .pushes = 1};
+    }
+    std::unreachable();
+}
+
 } // namespace cpplox
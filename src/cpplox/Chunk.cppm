@@ -6,6 +6,8 @@ export module cpplox:Chunk;
 
 import std;
 
+import :CodeArena;
+import :LineTable;
 import :OpCode;
 import :SourceLocation;
 import :Value;
@@ -14,13 +16,36 @@ namespace cpplox {
 
 export struct Chunk
 {
-    std::vector<Byte> code;
-    std::vector<SourceLocation> locations;
-    std::vector<Value> constants;
+    std::pmr::vector<Byte> code;
+    LineTable locations;
+    std::pmr::vector<Value> constants;
 };
 
 export auto write_chunk(Chunk & chunk, Byte data, SourceLocation sloc) -> void;
 export auto write_chunk(Chunk & chunk, OpCode op, SourceLocation sloc) -> void;
 export auto add_constant(Chunk & chunk, Value value) -> std::size_t;
 
+// Moves the chunk into `resource` (see CodeArena), the chunk must not change afterwards
+auto relocate_chunk(Chunk & chunk, std::pmr::memory_resource & resource) -> void;
+
+// Upper bound of memory needed by relocate_chunk()
+auto relocated_chunk_size(const Chunk & chunk) -> std::size_t;
+
+// Size of the instruction at `offset`, including its operands
+export auto instruction_size(const Chunk & chunk, std::size_t offset) -> std::size_t;
+
+// Destination of the Jump, JumpIfFalse or Loop instruction at `offset`. Empty if a loop jumps before
+// the start of the chunk.
+export auto jump_target(const Chunk & chunk, std::size_t offset) -> std::optional<std::size_t>;
+
+// Values the instruction at `offset` takes off the stack and puts back. Calls count their callee
+// and arguments, the frame of the callee has room of its own.
+export struct StackEffect
+{
+    std::size_t pops;
+    std::size_t pushes;
+};
+
+export auto stack_effect(const Chunk & chunk, std::size_t offset) -> StackEffect;
+
 } // namespace cpplox
@@ -0,0 +1,42 @@
+module;
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+module cpplox;
+
+import std;
+
+import :CodeArena;
+
+namespace cpplox {
+
+namespace {
+constexpr const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+} // namespace
+
+auto CodeArena::create(std::size_t size, bool huge_pages) -> std::unique_ptr<CodeArena>
+{
+    // Huge pages only pay off if the arena fills at least one of them
+    auto page_size = huge_pages && size >= HUGE_PAGE_SIZE
+            ? HUGE_PAGE_SIZE
+            : static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    size = (size + page_size - 1) / page_size * page_size;
+
+    void * memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { // NOLINT(cppcoreguidelines-pro-type-cstyle-cast)
+        return nullptr;
+    }
+    if (page_size == HUGE_PAGE_SIZE) {
+        ::madvise(memory, size, MADV_HUGEPAGE); // only a hint, fine if not supported
+    }
+
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory,modernize-make-unique)
+    return std::unique_ptr<CodeArena>(new CodeArena(memory, size));
+}
+
+CodeArena::~CodeArena() { ::munmap(m_memory, m_size); }
+
+auto CodeArena::protect() -> void { ::mprotect(m_memory, m_size, PROT_READ); }
+
+} // namespace cpplox
@@ -0,0 +1,49 @@
+export module cpplox:CodeArena;
+
+import std;
+
+namespace cpplox {
+
+// Contiguous memory for code, constants and metadata of functions that are done compiling, so that
+// functions of a script share cache lines and pages instead of being scattered across the heap.
+class CodeArena
+{
+public:
+    static auto create(std::size_t size, bool huge_pages) -> std::unique_ptr<CodeArena>;
+
+    CodeArena(const CodeArena &) = delete;
+    CodeArena(CodeArena &&) = delete;
+    auto operator=(const CodeArena &) -> CodeArena & = delete;
+    auto operator=(CodeArena &&) -> CodeArena & = delete;
+    ~CodeArena();
+
+    // Falls back to the heap if the arena is exhausted
+    [[nodiscard]] auto resource() -> std::pmr::memory_resource & { return m_resource; }
+
+    // Makes the arena read-only. Containers placed in it must not change afterwards.
+    auto protect() -> void;
+
+private:
+    CodeArena(void * memory, std::size_t size)
+        : m_memory(memory)
+        , m_size(size)
+        , m_resource(memory, size)
+    {
+    }
+
+    void * m_memory;
+    std::size_t m_size;
+    std::pmr::monotonic_buffer_resource m_resource;
+};
+
+// Moves contents of a pmr container into `resource`. Assignment cannot do that, as containers keep
+// their memory resource on assignment.
+template <class Container>
+auto relocate(Container & container, std::pmr::memory_resource & resource) -> void
+{
+    Container relocated(container, &resource);
+    std::destroy_at(&container);
+    std::construct_at(&container, std::move(relocated));
+}
+
+} // namespace cpplox
@@ -12,6 +12,7 @@ import :Debug;
 import :Object;
 import :OpCode;
 import :Scanner;
+import :Verifier;
 
 import magic_enum;
 
@@ -30,6 +31,8 @@ struct Parser
     bool had_error = false;
     // TODO: prevents cascading errors, see error_at. Is there a better way to achieve this?
     bool panic_mode = false;
+    // Set if function bodies are compiled lazily, each lazy function keeps the source alive
+    std::optional<LazySource> lazy_source;
 };
 
 enum class Precedence : std::uint8_t
@@ -43,7 +46,7 @@ enum class Precedence : std::uint8_t
     Term,       // + -
     Factor,     // * /
     Unary,      // ! -
-    Call,       // . ()
+    Call,       // . () []
     Primary,
 };
 
@@ -68,10 +71,10 @@ struct ClassCompiler
     bool has_superclass = false;
 };
 
-// FIXME: get rid of singleton instance
-Parser g_parser; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// State of the compilation running on the current thread
+thread_local Parser g_parser; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-ClassCompiler * g_current_class = nullptr;
+constinit thread_local ClassCompiler * g_current_class = nullptr;
 
 namespace {
 
@@ -206,6 +209,7 @@ auto patch_jump(std::size_t offset) -> void
 
     current_chunk().code[offset] = (jump_length >> BYTE_DIGITS) & BYTE_MAX;
     current_chunk().code[offset + 1] = jump_length & BYTE_MAX;
+    g_current_compiler->jump_target = current_chunk().code.size();
 }
 
 auto make_constant(Value value) -> Byte
@@ -232,6 +236,8 @@ auto emit_return() -> void
     emit_byte(OpCode::Return);
 }
 
+auto reserve_receiver_slot(Compiler & compiler) -> void;
+
 auto init_compiler(Compiler & compiler, Compiler::FunctionType type) -> void
 {
     compiler.enclosing = g_current_compiler;
@@ -247,23 +253,32 @@ auto init_compiler(Compiler & compiler, Compiler::FunctionType type) -> void
 
     compiler.function = ObjFunction::create(std::move(name));
     compiler.type = type;
+    reserve_receiver_slot(compiler);
+
+    g_current_compiler = &compiler;
+}
+
+auto reserve_receiver_slot(Compiler & compiler) -> void
+{
     compiler.locals.push_back({
             .name = {
                 .type = TokenType::EndOfFile,
-                .lexeme = type == Compiler::FunctionType::Function ? "" : "this",
+                .lexeme = compiler.type == Compiler::FunctionType::Function ? "" : "this",
                 .sloc = {},
             },
             .depth = 0,
             .is_captured = false,
     });
-
-    g_current_compiler = &compiler;
 }
 
 auto end_compiler() -> ObjFunction *
 {
     emit_return();
     auto * function = g_current_compiler->function;
+    if (!g_parser.had_error) {
+        [[maybe_unused]] bool verified = verify_function(*function);
+        assert(verified && "Compiler produced malformed bytecode");
+    }
     if constexpr (DEBUG_PRINT_CODE) {
         if (!g_parser.had_error) {
             auto name = function->get_name();
@@ -296,7 +311,7 @@ auto end_scope() -> void
 
 auto identifier_constant(const Token & name) -> Byte
 {
-    return make_constant(Value::string(std::string{name.lexeme}));
+    return make_constant(Value::string(name.lexeme));
 }
 
 auto synthetic_token(std::string_view name) -> Token
@@ -354,12 +369,20 @@ auto add_upvalue(Compiler * compiler, Byte index, bool is_local) -> std::size_t
 auto resolve_upvalue(Compiler * compiler, const Token & name) -> std::optional<std::size_t>
 {
     if (compiler->enclosing == nullptr) {
-        return std::nullopt;
+        if (compiler->captured == nullptr) {
+            return std::nullopt;
+        }
+        auto captured = std::ranges::find(*compiler->captured, name.lexeme);
+        if (captured == compiler->captured->end()) {
+            return std::nullopt;
+        }
+        return static_cast<std::size_t>(std::distance(compiler->captured->begin(), captured));
     }
 
     auto local = resolve_local(compiler->enclosing, name);
     if (local.has_value()) {
         compiler->enclosing->locals[local.value()].is_captured = true;
+        compiler->enclosing->function->captures_locals() = true;
         return add_upvalue(compiler, static_cast<Byte>(local.value()), /* is_local = */ true);
     }
 
@@ -423,6 +446,7 @@ auto define_variable(Byte global) -> void
 // *** Expression Parser ***
 
 auto parse_precedence(Precedence precedence) -> void;
+auto continue_precedence(Precedence precedence) -> void;
 auto get_rule(TokenType type) -> const ParseRule &;
 
 auto next_precedence(Precedence precedence) -> Precedence
@@ -463,6 +487,79 @@ auto unary(ParseContext /* ctx */) -> void
     }
 }
 
+// Whether `name` is a local or an upvalue that can be read without an error. Unlike resolving the
+// name, this reports no errors and adds no upvalues.
+auto is_readable_local(const Token & name) -> bool
+{
+    for (const Compiler * compiler = g_current_compiler; compiler != nullptr;
+         compiler = compiler->enclosing) {
+        for (const auto & local : std::ranges::reverse_view{compiler->locals}) {
+            if (local.name.lexeme == name.lexeme) {
+                return local.depth != -1;
+            }
+        }
+        if (compiler->enclosing == nullptr && compiler->captured != nullptr) {
+            return std::ranges::contains(*compiler->captured, name.lexeme);
+        }
+    }
+    return false;
+}
+
+// Whether the operand starting with `token` is a literal or a local variable, i.e. evaluating it
+// can neither fail nor have side effects, unless the token after it binds tighter than '+'
+auto is_pure_operand(const Token & token) -> bool
+{
+    switch (token.type) {
+    case TokenType::Number:
+    case TokenType::String: return true;
+    case TokenType::Identifier: return is_readable_local(token);
+    default: return false;
+    }
+}
+
+auto is_operand_end(TokenType type) -> bool
+{
+    switch (type) {
+    case TokenType::Dot:
+    case TokenType::LeftParenthesis:
+    case TokenType::LeftBracket:
+    case TokenType::Star:
+    case TokenType::Slash:
+    case TokenType::Equal: return false;
+    default: return true;
+    }
+}
+
+auto emit_addition(std::size_t operand_count) -> void
+{
+    if (operand_count == 2) {
+        emit_byte(OpCode::Add);
+    }
+    else {
+        emit_bytes(OpCode::Concat, static_cast<Byte>(operand_count));
+    }
+}
+
+// `a + b + c` adds `a + b` before evaluating `c`. While the following operands are pure, the chain
+// is added by a single Concat instead: the order of errors and side effects stays the same, but
+// no intermediate strings are allocated. An operand is known to be pure once the token after it
+// has been scanned, the chain so far is added before the code of the first one which is not.
+auto addition() -> void
+{
+    std::size_t operand_count = 2;
+    while (operand_count < BYTE_MAX && match(TokenType::Plus)) {
+        bool pure = is_pure_operand(g_parser.current);
+        advance();
+        if (!pure || !is_operand_end(g_parser.current.type)) {
+            emit_addition(operand_count);
+            operand_count = 1;
+        }
+        continue_precedence(Precedence::Factor);
+        operand_count++;
+    }
+    emit_addition(operand_count);
+}
+
 auto binary(ParseContext /* ctx */) -> void
 {
     TokenType operator_type = g_parser.previous.type;
@@ -477,7 +574,7 @@ auto binary(ParseContext /* ctx */) -> void
     case TokenType::Less: emit_byte(OpCode::Less); break;
     case TokenType::LessEqual: emit_bytes(OpCode::Greater, OpCode::Not); break;
 
-    case TokenType::Plus: emit_byte(OpCode::Add); break;
+    case TokenType::Plus: addition(); break;
     case TokenType::Minus: emit_byte(OpCode::Substract); break;
     case TokenType::Star: emit_byte(OpCode::Multiply); break;
     case TokenType::Slash: emit_byte(OpCode::Divide); break;
@@ -498,7 +595,23 @@ auto literal(ParseContext /* ctx */) -> void
 auto string(ParseContext /* ctx */) -> void
 {
     auto lexeme = g_parser.previous.lexeme;
-    emit_constant(Value::string(std::string{lexeme.substr(1, lexeme.length() - 2)}));
+    emit_constant(Value::string(lexeme.substr(1, lexeme.length() - 2)));
+}
+
+auto list(ParseContext /* ctx */) -> void
+{
+    std::size_t count = 0;
+    if (!check(TokenType::RightBracket)) {
+        do {
+            expression();
+            count++;
+            if (count > BYTE_MAX) {
+                error("Cannot have more than 255 elements in a list literal.");
+            }
+        } while (match(TokenType::Comma));
+    }
+    consume(TokenType::RightBracket, "Expect ']' after list elements.");
+    emit_bytes(OpCode::List, static_cast<Byte>(count));
 }
 
 auto and_ex(ParseContext /* ctx */) -> void
@@ -584,8 +697,25 @@ auto argument_list() -> Byte
 
 auto call(ParseContext /* ctx */) -> void
 {
+    // The callee is a property access like `(obj.method)`, unless something was emitted after it
+    // or a jump lands right after it, e.g. `(obj or other.method)`. Only such calls skip the bound
+    // method: `var m = obj.method; m();` still allocates one when the property is read.
+    auto & code = current_chunk().code;
+    bool is_method = g_current_compiler->property_end == code.size()
+                  && g_current_compiler->jump_target != code.size();
+    if (is_method) {
+        auto & op = code[code.size() - 2];
+        op = static_cast<Byte>(
+                static_cast<OpCode>(op) == OpCode::GetProperty ? OpCode::GetMethod
+                                                               : OpCode::GetSuperMethod
+        );
+    }
+
     Byte arg_count = argument_list();
-    emit_bytes(OpCode::Call, arg_count);
+    emit_bytes(is_method ? OpCode::CallMethod : OpCode::Call, arg_count);
+    if (!is_method) {
+        g_current_compiler->call_end = code.size();
+    }
 }
 
 auto super_ex(ParseContext /* ctx */) -> void
@@ -617,6 +747,7 @@ auto super_ex(ParseContext /* ctx */) -> void
     else {
         named_variable(synthetic_token("super"), {.can_assign = false});
         emit_bytes(OpCode::GetSuper, name);
+        g_current_compiler->property_end = current_chunk().code.size();
     }
 
     g_parser.op_sloc = prev_op_sloc;
@@ -641,6 +772,26 @@ auto dot(ParseContext ctx) -> void
     }
     else {
         emit_bytes(OpCode::GetProperty, name);
+        g_current_compiler->property_end = current_chunk().code.size();
+    }
+
+    g_parser.op_sloc = prev_op_sloc;
+}
+
+auto index(ParseContext ctx) -> void
+{
+    SourceLocation prev_op_sloc = g_parser.op_sloc;
+    g_parser.op_sloc = g_parser.current.sloc;
+
+    expression();
+    consume(TokenType::RightBracket, "Expect ']' after index.");
+
+    if (ctx.can_assign && match(TokenType::Equal)) {
+        expression();
+        emit_byte(OpCode::SetIndex);
+    }
+    else {
+        emit_byte(OpCode::GetIndex);
     }
 
     g_parser.op_sloc = prev_op_sloc;
@@ -691,6 +842,13 @@ auto return_statement() -> void
 
         expression();
         consume(TokenType::Semicolon, "Expect ';' after return value.");
+
+        // `return f(...)`, unless a jump lands after the call, e.g. `return a or f(...)`
+        auto & code = current_chunk().code;
+        if (g_current_compiler->call_end == code.size()
+            && g_current_compiler->jump_target != code.size()) {
+            code[code.size() - 2] = static_cast<Byte>(OpCode::TailCall);
+        }
         emit_byte(OpCode::Return);
     }
 }
@@ -711,11 +869,8 @@ auto block() -> void
     consume(TokenType::RightBrace, "Expect '}' after block.");
 }
 
-auto function(Compiler::FunctionType type) -> void
+auto parameters() -> void
 {
-    Compiler compiler;
-    init_compiler(compiler, type);
-
     begin_scope();
 
     consume(TokenType::LeftParenthesis, "Expect '(' after function name.");
@@ -731,9 +886,112 @@ auto function(Compiler::FunctionType type) -> void
     }
     consume(TokenType::RightParenthesis, "Expect ')' after parameters.");
     consume(TokenType::LeftBrace, "Expect '{' before function body.");
-    block();
+}
+
+// Resolves a name used in a skimmed body, so that the function captures everything it may need.
+// Names which only look like such uses (e.g. methods of classes declared in the body) capture more
+// than needed, extra upvalues only keep some variables alive for longer.
+auto capture_lazy(const Token & name, std::vector<std::string> & captured) -> void
+{
+    if (resolve_local(g_current_compiler, name).has_value()) {
+        return;
+    }
+    auto upvalue = resolve_upvalue(g_current_compiler, name);
+    if (upvalue.has_value() && upvalue.value() == captured.size()) {
+        captured.emplace_back(name.lexeme);
+    }
+}
+
+// Parses parameters but only skims the body, it is compiled by compile_lazy_function(). Names after
+// '.' are properties and names declared in the body are its own, neither is captured.
+auto skim_function(Compiler::FunctionType type) -> void
+{
+    auto source = g_parser.lazy_source->text;
+    auto lazy = std::make_unique<LazyFunction>(LazyFunction{
+            .source = *g_parser.lazy_source,
+            .start = static_cast<std::size_t>(g_parser.current.lexeme.data() - source.data()),
+            .sloc = g_parser.current.sloc,
+            .type = type,
+            .in_class = g_current_class != nullptr,
+            .has_superclass = g_current_class != nullptr && g_current_class->has_superclass,
+            .captured = {},
+    });
+
+    parameters();
+
+    // Names declared in the body by the depth of their block, parameters of nested functions are in
+    // the block of their body. Variables of for loops are not, their scope does not end at a brace.
+    std::vector<std::pair<std::string_view, std::size_t>> declared;
+    std::size_t parentheses = 0;
+    bool function_named = false;   // parameters follow
+    bool in_parameters = false;
+    auto before = TokenType::LeftBrace;
+
+    for (std::size_t depth = 1; depth > 0;) {
+        if (check(TokenType::EndOfFile)) {
+            error_at_current("Expect '}' after block.");
+            break;
+        }
+        advance();
+
+        const auto & token = g_parser.previous;
+        switch (token.type) {
+        case TokenType::LeftBrace: depth++; break;
+        case TokenType::RightBrace:
+            depth--;
+            std::erase_if(declared, [depth](const auto & name) { return name.second > depth; });
+            break;
+        case TokenType::LeftParenthesis:
+            parentheses++;
+            in_parameters = std::exchange(function_named, false);
+            break;
+        case TokenType::RightParenthesis:
+            parentheses--;
+            in_parameters = false;
+            break;
+        case TokenType::Identifier:
+            if (before == TokenType::Dot) {
+                break;
+            }
+            if (in_parameters) {
+                declared.emplace_back(token.lexeme, depth + 1);
+            }
+            else if (before == TokenType::Fun || before == TokenType::Class
+                     || (before == TokenType::Var && parentheses == 0)) {
+                declared.emplace_back(token.lexeme, depth);
+                function_named = before == TokenType::Fun;
+            }
+            else if (!std::ranges::contains(declared | std::views::keys, token.lexeme)) {
+                capture_lazy(token, lazy->captured);
+            }
+            break;
+        case TokenType::This:
+        case TokenType::Super: capture_lazy(token, lazy->captured); break;
+        default: break;
+        }
+        before = token.type;
+    }
+
+    g_current_compiler->function->set_lazy(std::move(lazy));
+}
+
+auto function(Compiler::FunctionType type) -> void
+{
+    Compiler compiler;
+    init_compiler(compiler, type);
+
+    ObjFunction * function = nullptr;
+    if (g_parser.lazy_source.has_value()) {
+        skim_function(type);
+        function = compiler.function;
+        g_current_compiler = compiler.enclosing;
+    }
+    else {
+        parameters();
+        block();
+        function = end_compiler();
+    }
 
-    auto * function = end_compiler();
     emit_bytes(OpCode::Closure, make_constant(Value::obj(function)));
 
     for (const auto & upvalue : compiler.upvalues) {
@@ -989,6 +1247,7 @@ consteval auto generate_rule_table() noexcept
     rules[to_idx(TokenType::Greater)]         = {.prefix = nullptr,  .infix = binary,  .precedence = Comparison};
     rules[to_idx(TokenType::GreaterEqual)]    = {.prefix = nullptr,  .infix = binary,  .precedence = Comparison};
     rules[to_idx(TokenType::Identifier)]      = {.prefix = variable, .infix = nullptr, .precedence = None};
+    rules[to_idx(TokenType::LeftBracket)]     = {.prefix = list,     .infix = index,   .precedence = Call};
     rules[to_idx(TokenType::LeftParenthesis)] = {.prefix = grouping, .infix = call,    .precedence = Call};
     rules[to_idx(TokenType::Less)]            = {.prefix = nullptr,  .infix = binary,  .precedence = Comparison};
     rules[to_idx(TokenType::LessEqual)]       = {.prefix = nullptr,  .infix = binary,  .precedence = Comparison};
@@ -1018,11 +1277,17 @@ auto get_rule(TokenType type) -> const ParseRule &
 }
 
 auto parse_precedence(Precedence precedence) -> void
+{
+    advance();
+    continue_precedence(precedence);
+}
+
+// Same as parse_precedence(), once the first token of the expression has been consumed
+auto continue_precedence(Precedence precedence) -> void
 {
     SourceLocation prev_op_sloc = g_parser.op_sloc;
-    g_parser.op_sloc = g_parser.current.sloc;
+    g_parser.op_sloc = g_parser.previous.sloc;
 
-    advance();
     auto prefix_rule = get_rule(g_parser.previous.type).prefix;
     if (prefix_rule == nullptr) {
         error("Expect expression.");
@@ -1049,8 +1314,19 @@ auto parse_precedence(Precedence precedence) -> void
 } // namespace
 
 // TODO: should denote failure, replace with std::expected
-auto compile(std::string_view source) -> ObjFunction *
+auto compile(std::string_view source, bool lazy, std::shared_ptr<const void> owner) -> ObjFunction *
 {
+    g_parser.lazy_source.reset();
+    if (lazy && owner == nullptr) {
+        // skimmed bodies are scanned again later, possibly after the caller has freed the source
+        auto copy = std::make_shared<const std::string>(source);
+        source = *copy;
+        owner = std::move(copy);
+    }
+    if (lazy) {
+        g_parser.lazy_source = LazySource{.owner = std::move(owner), .text = source};
+    }
+
     Compiler compiler;
     init_compiler(compiler, Compiler::FunctionType::Script);
 
@@ -1062,7 +1338,54 @@ auto compile(std::string_view source) -> ObjFunction *
     }
 
     auto * function = end_compiler();
+    g_parser.lazy_source.reset();
     return g_parser.had_error ? nullptr : function;
 }
 
+auto compile_lazy_function(ObjFunction & function) -> bool
+{
+    auto lazy = function.take_lazy();
+
+    g_parser.had_error = false;
+    g_parser.panic_mode = false;
+    g_parser.lazy_source = lazy->source; // nested functions are lazy too
+
+    // Enclosing compilers are gone, upvalues are resolved by captured names instead
+    Compiler compiler{
+            .enclosing = nullptr,
+            .function = &function,
+            .type = lazy->type,
+            .captured = &lazy->captured,
+    };
+    reserve_receiver_slot(compiler);
+    g_current_compiler = &compiler;
+
+    ClassCompiler class_compiler{
+            .name = {},
+            .enclosing = nullptr,
+            .has_superclass = lazy->has_superclass,
+    };
+    g_current_class = lazy->in_class ? &class_compiler : nullptr;
+
+    init_scanner(lazy->source.text, lazy->start, lazy->sloc);
+    advance();
+
+    function.arity() = 0; // counted again while parsing parameters
+    parameters();
+    block();
+    end_compiler();
+
+    g_current_class = nullptr;
+    g_parser.lazy_source.reset();
+
+    if (g_parser.had_error) {
+        // stays lazy, every call reports the errors instead of running half of the body
+        function.get_chunk() = Chunk{};
+        function.captures_locals() = false;
+        function.set_lazy(std::move(lazy));
+        return false;
+    }
+    return true;
+}
+
 } // namespace cpplox
\ No newline at end of file
@@ -37,12 +37,51 @@ struct Compiler
     std::vector<Local> locals;
     std::vector<Upvalue> upvalues;
     int scope_depth = 0;
+
+    // Code offsets right after the last GetProperty or GetSuper, the last Call and where the last
+    // patched jump lands. A call right after the property access calls the method without binding
+    // it, a return right after the call is a tail call.
+    std::size_t property_end = 0;
+    std::size_t call_end = 0;
+    std::size_t jump_target = 0;
+
+    // Upvalues of a lazily compiled function, captured by name when its body was skimmed. Enclosing
+    // compilers are long gone by the time it is compiled, so its upvalues are resolved by these.
+    const std::vector<std::string> * captured = nullptr;
+};
+
+// Source of a script compiled lazily, skimmed bodies are scanned again when they are compiled.
+// `owner` keeps `text` alive until then, e.g. the mapped file or a copy of the source.
+struct LazySource
+{
+    std::shared_ptr<const void> owner;
+    std::string_view text;
 };
 
-// FIXME: get rid of singleton instance
+// Function which body was only skimmed, it is compiled by compile_lazy_function() on the first call
+struct LazyFunction
+{
+    LazySource source;
+    std::size_t start; // offset of the parameter list
+    SourceLocation sloc;
+    Compiler::FunctionType type;
+    bool in_class;
+    bool has_superclass;
+    std::vector<std::string> captured; // names of upvalues, by upvalue index
+};
+
+// Innermost function being compiled on the current thread
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-Compiler * g_current_compiler = nullptr;
+constinit thread_local Compiler * g_current_compiler = nullptr;
+
+// Bodies of functions are only skimmed if `lazy` is set, see LazyFunction. Lazy functions share
+// `owner` if given, it has to keep `source` alive, otherwise they share a copy of the source.
+export auto compile(
+        std::string_view source, bool lazy = false, std::shared_ptr<const void> owner = nullptr
+) -> ObjFunction *;
 
-export auto compile(std::string_view source) -> ObjFunction *;
+// Reports compile errors the same way as compile() and returns false if there are any, the function
+// is left lazy then
+auto compile_lazy_function(ObjFunction & function) -> bool;
 
 } // namespace cpplox
\ No newline at end of file
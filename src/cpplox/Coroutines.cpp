@@ -0,0 +1,68 @@
+module cpplox;
+
+import std;
+
+import :Coroutines;
+import :Object;
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+namespace {
+
+auto coroutine(std::span<const Value> args) -> Value
+{
+    if (args.empty()) {
+        return Value::nil();
+    }
+    return Value::obj(ObjCoroutine::create(args));
+}
+
+auto resume(std::span<const Value> args) -> Value
+{
+    if (args.empty() || !args.front().is_coroutine()) {
+        return Value::nil();
+    }
+
+    auto result = resume_coroutine(
+            *args.front().as_objcoroutine(), args.size() > 1 ? args[1] : Value::nil()
+    );
+    if (!result.has_value()) {
+        g_vm->native_signal = NativeSignal::Error;
+        return Value::nil();
+    }
+    return result.value();
+}
+
+auto yield(std::span<const Value> args) -> Value
+{
+    suspend_coroutine();
+    return args.empty() ? Value::nil() : args.front();
+}
+
+auto running(std::span<const Value> /* args */) -> Value
+{
+    return g_vm->coroutine != nullptr ? Value::obj(g_vm->coroutine) : Value::nil();
+}
+
+auto done(std::span<const Value> args) -> Value
+{
+    if (args.empty() || !args.front().is_coroutine()) {
+        return Value::boolean(false);
+    }
+    return Value::boolean(args.front().as_objcoroutine()->get_state() == ObjCoroutine::State::Done);
+}
+
+} // namespace
+
+auto define_coroutine_natives() -> void
+{
+    define_native("coroutine", coroutine);
+    define_native("resume", resume);
+    define_native("yield", yield);
+    define_native("running", running);
+    define_native("done", done);
+}
+
+} // namespace cpplox
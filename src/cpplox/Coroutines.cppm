@@ -0,0 +1,19 @@
+export module cpplox:Coroutines;
+
+namespace cpplox {
+
+// Natives running calls as coroutines, on stacks of their own within the VM of the thread:
+//   coroutine(function, args...)  returns a coroutine which calls the function once resumed
+//   resume(coroutine, value)      runs it until it yields or returns, returns the value yielded or
+//                                 returned. `value` is the result of the yield() it is suspended
+//                                 in, the first resume ignores it. Nil once it is done.
+//   yield(value)                  suspends the running coroutine, its resume() returns the value.
+//                                 Returns the value right away outside of coroutines.
+//   running()                     returns the running coroutine, nil outside of coroutines. It can
+//                                 be passed as callback of I/O natives, see define_event_natives().
+//   done(coroutine)               true once it has returned or failed
+//
+// Runtime errors in a coroutine unwind the code which has resumed it as well.
+auto define_coroutine_natives() -> void;
+
+} // namespace cpplox
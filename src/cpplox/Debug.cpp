@@ -85,8 +85,8 @@ auto disassemble_instruction(const Chunk & chunk, std::size_t offset) -> std::si
     using enum OpCode;
 
     std::print("{:04} ", offset);
-    auto sloc = chunk.locations[offset];
-    if (offset > 0 && sloc.line == chunk.locations[offset - 1].line) {
+    auto sloc = chunk.locations.at(offset);
+    if (offset > 0 && sloc.line == chunk.locations.at(offset - 1).line) {
         std::print("{:>4}:{:<4} ", '|', sloc.column);
     }
     else {
@@ -101,15 +101,20 @@ auto disassemble_instruction(const Chunk & chunk, std::size_t offset) -> std::si
     case Nil: return simple("OP_NIL", offset);
     case True: return simple("OP_TRUE", offset);
     case False: return simple("OP_FALSE", offset);
+    case List: return byte("OP_LIST", chunk, offset);
     // Value manipulators
     case Pop: return simple("OP_POP", offset);
     case DefineGlobal: return constant("OP_DEFINE_GLOBAL", chunk, offset);
     case GetGlobal: return constant("OP_GET_GLOBAL", chunk, offset);
+    case GetIndex: return simple("OP_GET_INDEX", offset);
     case GetLocal: return byte("OP_GET_LOCAL", chunk, offset);
     case GetProperty: return constant("OP_GET_PROPERTY", chunk, offset);
+    case GetMethod: return constant("OP_GET_METHOD", chunk, offset);
     case GetSuper: return constant("OP_GET_SUPER", chunk, offset);
+    case GetSuperMethod: return constant("OP_GET_SUPER_METHOD", chunk, offset);
     case GetUpvalue: return byte("OP_GET_UPVALUE", chunk, offset);
     case SetGlobal: return constant("OP_SET_GLOBAL", chunk, offset);
+    case SetIndex: return simple("OP_SET_INDEX", offset);
     case SetLocal: return byte("OP_SET_LOCAL", chunk, offset);
     case SetProperty: return constant("OP_SET_PROPERTY", chunk, offset);
     case SetUpvalue: return byte("OP_SET_UPVALUE", chunk, offset);
@@ -119,6 +124,7 @@ auto disassemble_instruction(const Chunk & chunk, std::size_t offset) -> std::si
     case Greater: return simple("OP_GREATER", offset);
     // Binary ops
     case Add: return simple("OP_ADD", offset);
+    case Concat: return byte("OP_CONCAT", chunk, offset);
     case Substract: return simple("OP_SUBSTRACT", offset);
     case Multiply: return simple("OP_MULTIPLY", offset);
     case Divide: return simple("OP_DIVIDE", offset);
@@ -131,6 +137,8 @@ auto disassemble_instruction(const Chunk & chunk, std::size_t offset) -> std::si
     case JumpIfFalse: return jump("OP_JUMP_IF_FALSE", /* forward = */ true, chunk, offset);
     case Loop: return jump("OP_LOOP", /* forward = */ false, chunk, offset);
     case Call: return byte("OP_CALL", chunk, offset);
+    case CallMethod: return byte("OP_CALL_METHOD", chunk, offset);
+    case TailCall: return byte("OP_TAIL_CALL", chunk, offset);
     case Invoke: return invoke("OP_INVOKE", chunk, offset);
     case SuperInvoke: return invoke("OP_SUPER_INVOKE", chunk, offset);
     case Closure: {
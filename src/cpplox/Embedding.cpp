@@ -0,0 +1,161 @@
+module cpplox;
+
+import std;
+
+import :Compiler;
+import :Embedding;
+import :Events;
+import :Object;
+import :Snapshot;
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+// *** Root ***
+
+Root::Root(VirtualMachine & vm, Value value)
+    : m_vm(&vm)
+    , m_value(value)
+{
+    if (m_value.is_obj()) {
+        m_vm->host_roots.insert(m_value.as_obj());
+    }
+}
+
+Root::~Root()
+{
+    if (m_vm != nullptr && m_value.is_obj()) {
+        m_vm->host_roots.erase(m_vm->host_roots.find(m_value.as_obj()));
+    }
+}
+
+Root::Root(Root && other) noexcept
+    : m_vm(std::exchange(other.m_vm, nullptr))
+    , m_value(other.m_value)
+{
+}
+
+auto Root::operator=(Root && other) noexcept -> Root &
+{
+    if (this != &other) {
+        std::swap(m_vm, other.m_vm);
+        std::swap(m_value, other.m_value);
+    }
+    return *this;
+}
+
+// *** Vm ***
+
+Vm::Vm(VmOptions options)
+{
+    CurrentVm current{nullptr};
+    init_vm(options);
+    m_vm = g_vm;
+}
+
+Vm::Vm(const Snapshot & snapshot)
+    : Vm(options_of(*snapshot.m_image->m_vm))
+{
+    CurrentVm current{m_vm};
+    copy_globals(*snapshot.m_image->m_vm);
+}
+
+Vm::~Vm()
+{
+    CurrentVm current{m_vm};
+    free_vm();
+}
+
+auto Vm::compile(std::string_view source) -> std::optional<Script>
+{
+    CurrentVm current{m_vm};
+
+    auto * function = cpplox::compile(source, m_vm->lazy_compile);
+    if (function == nullptr) {
+        return std::nullopt;
+    }
+    freeze_script(*function);
+    return Script{root(Value::obj(function))};
+}
+
+auto Vm::run(const Script & script) -> InterpretResult
+{
+    CurrentVm current{m_vm};
+    auto result = run_script(*script.m_function.value().as_objfunction());
+    if (result != InterpretResult::Ok) {
+        return result;
+    }
+    return run_event_loop() ? InterpretResult::Ok : InterpretResult::RuntimeError;
+}
+
+auto Vm::call(std::string_view function, std::span<const Argument> args) -> std::optional<Value>
+{
+    CurrentVm current{m_vm};
+
+    std::vector<Root> roots;
+    std::vector<Value> values;
+    values.reserve(args.size());
+    for (const auto & arg : args) {
+        values.push_back(materialize(arg, roots));
+    }
+    return call_global(function, values).transform([this](Value result) {
+        return flattened(result);
+    });
+}
+
+auto Vm::get_global(std::string_view name) -> std::optional<Value>
+{
+    CurrentVm current{m_vm};
+
+    auto it = m_vm->globals.find(name);
+    if (it == m_vm->globals.end()) {
+        return std::nullopt;
+    }
+    return flattened(it->second);
+}
+
+auto Vm::set_global(std::string_view name, const Argument & value) -> void
+{
+    CurrentVm current{m_vm};
+
+    std::vector<Root> roots;
+    auto new_value = materialize(value, roots);
+    if (auto it = m_vm->globals.find(name); it != m_vm->globals.end()) {
+        it->second = new_value;
+        return;
+    }
+    auto key = materialize(name, roots);
+    m_vm->globals.insert_or_assign(key.as_objstring(), new_value);
+}
+
+auto Vm::root(Value value) -> Root { return Root{*m_vm, value}; }
+
+auto Vm::snapshot() -> Snapshot
+{
+    auto image = std::make_unique<Vm>(options_of(*m_vm));
+    CurrentVm current{image->m_vm};
+    copy_globals(*m_vm);
+    return Snapshot{std::move(image)};
+}
+
+auto Vm::materialize(const Argument & argument, std::vector<Root> & roots) -> Value
+{
+    const auto * string = std::get_if<std::string_view>(&argument.m_value);
+    if (string == nullptr) {
+        return std::get<Value>(argument.m_value);
+    }
+    roots.push_back(root(Value::string(*string)));
+    return roots.back().value();
+}
+
+auto Vm::flattened(Value value) -> Value
+{
+    if (!value.is_rope()) {
+        return value;
+    }
+    auto rope = root(value); // its characters are copied by the allocation of the string
+    return Value::string(rope.value().as_string());
+}
+
+} // namespace cpplox
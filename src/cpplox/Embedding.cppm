@@ -0,0 +1,160 @@
+export module cpplox:Embedding;
+
+import std;
+
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+// Keeps a value alive while the host holds it. Other objects are collected once no Lox code or
+// global refers to them. Must not outlive the Vm it was created by.
+export class Root
+{
+public:
+    ~Root();
+
+    Root(const Root &) = delete;
+    Root(Root && other) noexcept;
+    auto operator=(const Root &) -> Root & = delete;
+    auto operator=(Root && other) noexcept -> Root &;
+
+    [[nodiscard]] auto value() const -> Value { return m_value; }
+
+private:
+    friend class Vm;
+
+    Root(VirtualMachine & vm, Value value);
+
+    VirtualMachine * m_vm; // null once moved from
+    Value m_value;
+};
+
+// Compiled script, run as many times as needed with `Vm::run()`
+export class Script
+{
+private:
+    friend class Vm;
+
+    explicit Script(Root function)
+        : m_function(std::move(function))
+    {
+    }
+
+    Root m_function;
+};
+
+// Value passed from C++, strings are copied into the VM when it is used
+export class Argument
+{
+public:
+    // NOLINTBEGIN(*-explicit-conversions,*-explicit-constructor)
+    Argument(Value value)
+        : m_value(value)
+    {
+    }
+    Argument(bool boolean)
+        : m_value(Value::boolean(boolean))
+    {
+    }
+    Argument(double number)
+        : m_value(Value::number(number))
+    {
+    }
+    template <std::integral T>
+        requires(!std::same_as<T, bool>)
+    Argument(T number)
+        : m_value(Value::number(static_cast<double>(number)))
+    {
+    }
+    Argument(std::string_view string)
+        : m_value(string)
+    {
+    }
+    Argument(const char * string)
+        : m_value(std::string_view{string})
+    {
+    }
+    // NOLINTEND(*-explicit-conversions,*-explicit-constructor)
+
+private:
+    friend class Vm;
+
+    std::variant<Value, std::string_view> m_value;
+};
+
+export class Snapshot;
+
+// VM for embedding Lox into a C++ program: scripts are compiled once, then their functions are
+// called with C++ arguments. The VM is made the current VM of the thread only while one of its
+// methods runs, so several of them can be used in turn on the same thread. Methods must not be
+// called from natives of the same VM.
+//
+// Values returned to the host are not rooted: objects in them are only kept alive until the next
+// call into the VM, unless they are rooted with `root()` or stored in a global.
+export class Vm
+{
+public:
+    explicit Vm(VmOptions options = {});
+    // Starts with a copy of the snapshot's globals and with its options, see snapshot()
+    explicit Vm(const Snapshot & snapshot);
+    ~Vm();
+
+    Vm(const Vm &) = delete;
+    Vm(Vm &&) = delete;
+    auto operator=(const Vm &) -> Vm & = delete;
+    auto operator=(Vm &&) -> Vm & = delete;
+
+    // Returns empty result if the source has compile errors, they are reported as by interpret()
+    auto compile(std::string_view source) -> std::optional<Script>;
+
+    // Runs top-level code of the script, e.g. to define its functions and classes, then the
+    // callbacks of I/O and timers it has started
+    auto run(const Script & script) -> InterpretResult;
+
+    // Calls a global function, class or native. Returns empty result if the call fails with a
+    // runtime error, it is reported as by interpret().
+    auto call(std::string_view function, std::span<const Argument> args) -> std::optional<Value>;
+
+    template <class... Args>
+        requires(std::constructible_from<Argument, const Args &> && ...)
+    auto call(std::string_view function, const Args &... args) -> std::optional<Value>
+    {
+        const std::array<Argument, sizeof...(Args)> arguments{Argument{args}...};
+        return call(function, std::span<const Argument>{arguments});
+    }
+
+    [[nodiscard]] auto get_global(std::string_view name) -> std::optional<Value>;
+    auto set_global(std::string_view name, const Argument & value) -> void;
+
+    [[nodiscard]] auto root(Value value) -> Root;
+
+    // Copies globals and everything reachable from them, e.g. once a prelude has set them up
+    [[nodiscard]] auto snapshot() -> Snapshot;
+
+private:
+    // Value of the argument, rooted if it is a newly allocated object
+    auto materialize(const Argument & argument, std::vector<Root> & roots) -> Value;
+    // Ropes are handed out as strings, flattening them later would account to no VM
+    auto flattened(Value value) -> Value;
+
+    VirtualMachine * m_vm = nullptr;
+};
+
+// Heap of a VM frozen at one point. VMs started from a snapshot get a copy of it instead of running
+// the code which has built it. Snapshots never run, so VMs on several threads may start from the
+// same one at once.
+export class Snapshot
+{
+private:
+    friend class Vm;
+
+    explicit Snapshot(std::unique_ptr<Vm> image)
+        : m_image(std::move(image))
+    {
+    }
+
+    std::unique_ptr<Vm> m_image;
+};
+
+} // namespace cpplox
@@ -0,0 +1,687 @@
+module;
+
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+module cpplox;
+
+import std;
+
+import :Events;
+import :Object;
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+namespace {
+constexpr const std::uint64_t WAKE_ID = 0; // epoll data of the completion event, never a stream
+constexpr const std::size_t MAX_EVENTS = 64;
+constexpr const std::size_t READ_SIZE = 64 * 1024;
+constexpr const int LISTEN_BACKLOG = 128;
+constexpr const std::size_t FILE_THREADS = 4; // file operations running at once
+
+auto localhost(std::uint16_t port) -> ::sockaddr_in
+{
+    ::sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+auto tcp_socket() -> int
+{
+    return ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+} // namespace
+
+EventLoop::~EventLoop()
+{
+    drop_all();
+    if (m_epoll >= 0) {
+        ::close(m_epoll);
+        ::close(m_wake);
+    }
+}
+
+auto EventLoop::add_timer(std::chrono::milliseconds delay, Value callback) -> void
+{
+    m_timers.push({std::chrono::steady_clock::now() + delay, add_callback(callback)});
+}
+
+auto EventLoop::read_file(std::string path, Value callback) -> void
+{
+    start_file_operation(callback, [path = std::move(path)] {
+        Completion completion{.reading = true};
+        std::ifstream file{path, std::ios::binary};
+        if (file) {
+            completion.contents.assign(std::istreambuf_iterator<char>{file}, {});
+            completion.ok = !file.bad();
+        }
+        return completion;
+    });
+}
+
+auto EventLoop::write_file(std::string path, std::string data, Value callback) -> void
+{
+    start_file_operation(callback, [path = std::move(path), data = std::move(data)] {
+        std::ofstream file{path, std::ios::binary | std::ios::trunc};
+        file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        file.close();
+        return Completion{.ok = !file.fail()};
+    });
+}
+
+auto EventLoop::listen(std::uint16_t port, Value callback) -> std::optional<std::uint64_t>
+{
+    int fd = tcp_socket();
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    int reuse = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    auto address = localhost(port);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    if (::bind(fd, reinterpret_cast<const ::sockaddr *>(&address), sizeof(address)) != 0
+        || ::listen(fd, LISTEN_BACKLOG) != 0) {
+        ::close(fd);
+        return std::nullopt;
+    }
+
+    auto id = add_stream(fd, /* listening = */ true, /* connecting = */ false);
+    if (id.has_value()) {
+        m_streams.at(*id).on_read = add_callback(callback);
+        watch(*id, m_streams.at(*id));
+    }
+    return id;
+}
+
+auto EventLoop::connect(std::uint16_t port, Value callback) -> std::optional<std::uint64_t>
+{
+    int fd = tcp_socket();
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    auto address = localhost(port);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    if (::connect(fd, reinterpret_cast<const ::sockaddr *>(&address), sizeof(address)) != 0
+        && errno != EINPROGRESS) {
+        ::close(fd);
+        return std::nullopt;
+    }
+
+    // completes once writable, even if it has connected right away
+    auto id = add_stream(fd, /* listening = */ false, /* connecting = */ true);
+    if (id.has_value()) {
+        m_streams.at(*id).on_connect = add_callback(callback);
+        watch(*id, m_streams.at(*id));
+    }
+    return id;
+}
+
+auto EventLoop::read(std::uint64_t stream, Value callback) -> bool
+{
+    auto it = m_streams.find(stream);
+    if (it == m_streams.end() || it->second.listening) {
+        return false;
+    }
+    take_callback(it->second.on_read); // replaced
+    it->second.on_read = add_callback(callback);
+    watch(stream, it->second);
+    return true;
+}
+
+auto EventLoop::write(std::uint64_t stream, std::string data, Value callback) -> bool
+{
+    auto it = m_streams.find(stream);
+    if (it == m_streams.end() || it->second.listening) {
+        return false;
+    }
+    it->second.writes.push_back({.data = std::move(data), .callback = add_callback(callback)});
+    watch(stream, it->second);
+    return true;
+}
+
+auto EventLoop::close(std::uint64_t stream) -> bool
+{
+    auto node = m_streams.extract(stream);
+    if (node.empty()) {
+        return false;
+    }
+    auto & closed = node.mapped();
+    take_callback(closed.on_read);
+    take_callback(closed.on_connect);
+    for (const auto & write : closed.writes) {
+        take_callback(write.callback);
+    }
+    ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, closed.fd, nullptr);
+    ::close(closed.fd);
+    return true;
+}
+
+auto EventLoop::local_port(std::uint64_t stream) const -> std::optional<std::uint16_t>
+{
+    auto it = m_streams.find(stream);
+    if (it == m_streams.end()) {
+        return std::nullopt;
+    }
+    ::sockaddr_in address{};
+    ::socklen_t length = sizeof(address);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    if (::getsockname(it->second.fd, reinterpret_cast<::sockaddr *>(&address), &length) != 0) {
+        return std::nullopt;
+    }
+    return ntohs(address.sin_port);
+}
+
+auto EventLoop::run() -> bool
+{
+    while (has_work()) {
+        auto ready = wait();
+        for (auto [id, events] : ready) {
+            // NOLINTNEXTLINE(hicpp-signed-bitwise)
+            bool readable = (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+            bool writable = (events & (EPOLLOUT | EPOLLERR)) != 0; // NOLINT(hicpp-signed-bitwise)
+            // callbacks may have closed the stream in the meantime, handlers check for it
+            if ((readable && !on_readable(id)) || (writable && !on_writable(id))) {
+                drop_all();
+                return false;
+            }
+        }
+        if (!fire_timers() || !deliver_completions()) {
+            drop_all();
+            return false;
+        }
+    }
+    return true;
+}
+
+auto EventLoop::start() -> bool
+{
+    if (m_epoll >= 0) {
+        return true;
+    }
+    m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0) {
+        return false;
+    }
+    m_wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ::epoll_event event{.events = EPOLLIN, .data = {.u64 = WAKE_ID}};
+    ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event);
+    return true;
+}
+
+auto EventLoop::add_callback(Value callback) -> std::uint64_t
+{
+    if (callback.is_nil()) {
+        return 0;
+    }
+    auto id = m_next_id++;
+    m_callbacks.emplace(id, callback);
+    return id;
+}
+
+auto EventLoop::take_callback(std::uint64_t id) -> Value
+{
+    auto node = m_callbacks.extract(id);
+    return node.empty() ? Value::nil() : node.mapped();
+}
+
+// The callback is not rooted anymore once taken, calling it puts it on the stack before anything
+// is allocated
+auto EventLoop::call(Value callback, std::span<const Value> args) -> bool
+{
+    if (callback.is_nil()) {
+        return true;
+    }
+    if (callback.is_coroutine()) {
+        auto value = args.empty() ? Value::nil() : args.front();
+        return resume_coroutine(*callback.as_objcoroutine(), value).has_value();
+    }
+    return call_function(callback, args).has_value();
+}
+
+auto EventLoop::add_stream(int fd, bool listening, bool connecting) -> std::optional<std::uint64_t>
+{
+    if (!start()) {
+        ::close(fd);
+        return std::nullopt;
+    }
+    auto id = m_next_id++;
+    m_streams.emplace(id, Stream{.fd = fd, .listening = listening, .connecting = connecting});
+    return id;
+}
+
+// Waits only for what the stream has callbacks for. Idle streams are not registered at all, epoll
+// would report hangups of them otherwise.
+auto EventLoop::watch(std::uint64_t id, Stream & stream) -> void
+{
+    std::uint32_t events = 0;
+    if (stream.on_read != 0) {
+        events |= EPOLLIN;
+    }
+    if (stream.connecting || !stream.writes.empty()) {
+        events |= EPOLLOUT;
+    }
+
+    if (events == 0) {
+        if (stream.watched) {
+            ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, stream.fd, nullptr);
+            stream.watched = false;
+        }
+        return;
+    }
+    ::epoll_event event{.events = events, .data = {.u64 = id}};
+    ::epoll_ctl(m_epoll, stream.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, stream.fd, &event);
+    stream.watched = true;
+}
+
+auto EventLoop::complete(Completion completion) -> void
+{
+    {
+        std::scoped_lock lock{m_mutex};
+        m_completions.push_back(std::move(completion));
+    }
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(m_wake, &one, sizeof(one));
+}
+
+auto EventLoop::start_file_operation(
+        Value callback, std::move_only_function<Completion()> operation
+) -> void
+{
+    if (!start()) {
+        return; // never completes, as if it took forever
+    }
+    auto id = add_callback(callback);
+    {
+        std::scoped_lock lock{m_mutex};
+        m_file_queue.emplace_back([this, id, operation = std::move(operation)] mutable {
+            auto completion = operation();
+            completion.callback = id;
+            complete(std::move(completion));
+        });
+    }
+    m_files++;
+    if (m_file_threads.size() < std::min(m_files, FILE_THREADS)) {
+        m_file_threads.emplace_back([this] { work_on_files(); });
+    }
+    else {
+        m_queued.notify_one();
+    }
+}
+
+auto EventLoop::work_on_files() -> void
+{
+    for (;;) {
+        std::move_only_function<void()> operation;
+        {
+            std::unique_lock lock{m_mutex};
+            m_queued.wait(lock, [this] { return m_stopping || !m_file_queue.empty(); });
+            if (m_stopping) {
+                return;
+            }
+            operation = std::move(m_file_queue.front());
+            m_file_queue.pop_front();
+        }
+        operation();
+    }
+}
+
+auto EventLoop::stop_files() -> void
+{
+    {
+        std::scoped_lock lock{m_mutex};
+        m_stopping = true;
+        m_file_queue.clear();
+    }
+    m_queued.notify_all();
+    m_file_threads.clear(); // joins them, operations running are finished first
+
+    std::scoped_lock lock{m_mutex};
+    m_stopping = false;
+    m_completions.clear();
+    m_files = 0;
+}
+
+auto EventLoop::has_work() const -> bool
+{
+    return !m_timers.empty() || m_files != 0
+           || std::ranges::any_of(m_streams, [](const auto & entry) {
+                  const auto & stream = entry.second;
+                  return stream.on_read != 0 || stream.connecting || !stream.writes.empty();
+              });
+}
+
+auto EventLoop::wait() -> std::vector<std::pair<std::uint64_t, std::uint32_t>>
+{
+    int timeout = -1;
+    if (!m_timers.empty()) {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+                m_timers.top().deadline - std::chrono::steady_clock::now()
+        );
+        timeout = static_cast<int>(std::clamp<std::int64_t>(
+                left.count(), 0, std::numeric_limits<int>::max()
+        ));
+    }
+
+    std::array<::epoll_event, MAX_EVENTS> events{};
+    // interrupted waits return no events, the loop waits again
+    auto count = std::max(
+            ::epoll_wait(m_epoll, events.data(), static_cast<int>(events.size()), timeout), 0
+    );
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> ready;
+    for (const auto & event : std::span{events}.first(static_cast<std::size_t>(count))) {
+        if (event.data.u64 == WAKE_ID) {
+            std::uint64_t signaled = 0;
+            [[maybe_unused]] auto drained = ::read(m_wake, &signaled, sizeof(signaled));
+            continue;
+        }
+        ready.emplace_back(event.data.u64, event.events);
+    }
+    return ready;
+}
+
+auto EventLoop::on_readable(std::uint64_t id) -> bool
+{
+    auto it = m_streams.find(id);
+    if (it == m_streams.end() || it->second.on_read == 0) {
+        return true;
+    }
+
+    if (it->second.listening) {
+        // the callback stays for further connections, it is rooted while it runs
+        auto callback = m_callbacks.at(it->second.on_read);
+        int listener = it->second.fd;
+        for (;;) {
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return true;
+            }
+            auto stream = add_stream(fd, /* listening = */ false, /* connecting = */ false);
+            if (!stream.has_value()) {
+                continue;
+            }
+            auto arg = Value::number(static_cast<double>(*stream));
+            if (!call(callback, std::span{&arg, 1})) {
+                return false;
+            }
+            if (!m_streams.contains(id)) {
+                return true; // closed by the callback
+            }
+        }
+    }
+
+    std::string data(READ_SIZE, '\0');
+    auto received = ::recv(it->second.fd, data.data(), data.size(), 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+
+    // nil at the end of the stream or on errors
+    auto arg = Value::nil();
+    if (received > 0) {
+        data.resize(static_cast<std::size_t>(received));
+        arg = Value::string(data);
+    }
+    auto callback = take_callback(std::exchange(it->second.on_read, 0));
+    watch(id, it->second);
+    return call(callback, std::span{&arg, 1});
+}
+
+auto EventLoop::on_writable(std::uint64_t id) -> bool
+{
+    auto it = m_streams.find(id);
+    if (it == m_streams.end()) {
+        return true;
+    }
+    auto & stream = it->second;
+
+    if (stream.connecting) {
+        int error = 0;
+        ::socklen_t length = sizeof(error);
+        ::getsockopt(stream.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        stream.connecting = false;
+        auto callback = take_callback(std::exchange(stream.on_connect, 0));
+        auto arg = error == 0 ? Value::number(static_cast<double>(id)) : Value::nil();
+        if (error != 0) {
+            close(id);
+        }
+        else {
+            watch(id, stream);
+        }
+        return call(callback, std::span{&arg, 1});
+    }
+
+    // callbacks run once the stream is not touched anymore, they may close it
+    std::vector<std::pair<std::uint64_t, bool>> finished;
+    while (!stream.writes.empty()) {
+        auto & write = stream.writes.front();
+        auto left = std::string_view{write.data}.substr(write.written);
+        auto sent = ::send(stream.fd, left.data(), left.size(), MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (sent < 0) { // the other end is gone, nothing more can be sent
+            for (const auto & failed : stream.writes) {
+                finished.emplace_back(failed.callback, false);
+            }
+            stream.writes.clear();
+            break;
+        }
+        write.written += static_cast<std::size_t>(sent);
+        if (write.written == write.data.size()) {
+            finished.emplace_back(write.callback, true);
+            stream.writes.pop_front();
+        }
+    }
+    watch(id, stream);
+
+    for (auto [callback, ok] : finished) {
+        auto arg = Value::boolean(ok);
+        if (!call(take_callback(callback), std::span{&arg, 1})) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto EventLoop::fire_timers() -> bool
+{
+    // timers added by the callbacks wait for the next round, even without delay
+    auto now = std::chrono::steady_clock::now();
+    while (!m_timers.empty() && m_timers.top().deadline <= now) {
+        auto callback = take_callback(m_timers.top().callback);
+        m_timers.pop();
+        if (!call(callback, {})) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto EventLoop::deliver_completions() -> bool
+{
+    std::vector<Completion> completions;
+    {
+        std::scoped_lock lock{m_mutex};
+        completions = std::exchange(m_completions, {});
+    }
+
+    // all before any callback, which may fail and leave the rest
+    m_files -= completions.size();
+
+    for (auto & completion : completions) {
+        // the result is allocated while the callback is still rooted, nil for unreadable files
+        auto arg = Value::boolean(completion.ok);
+        if (completion.reading) {
+            arg = completion.ok ? Value::string(completion.contents) : Value::nil();
+        }
+        if (!call(take_callback(completion.callback), std::span{&arg, 1})) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto EventLoop::drop_all() -> void
+{
+    while (!m_streams.empty()) {
+        close(m_streams.begin()->first);
+    }
+    m_timers = {};
+
+    // completions of file operations are dropped with their callbacks
+    stop_files();
+    m_callbacks.clear();
+}
+
+namespace {
+
+// Non-negative integer arguments, e.g. ports and ids
+template <std::unsigned_integral T> auto integer_arg(Value value) -> std::optional<T>
+{
+    if (!value.is_number() || value.as_number() < 0
+        || value.as_number() > static_cast<double>(std::numeric_limits<T>::max())
+        || value.as_number() != std::floor(value.as_number())) {
+        return std::nullopt;
+    }
+    return static_cast<T>(value.as_number());
+}
+
+auto is_callback(Value value) -> bool
+{
+    return value.is_closure() || value.is_native() || value.is_class() || value.is_bound_method()
+           || value.is_coroutine();
+}
+
+// Callback at `index`, which may be left out or nil if `optional`
+auto callback_arg(std::span<const Value> args, std::size_t index, bool optional)
+        -> std::optional<Value>
+{
+    auto callback = index < args.size() ? args[index] : Value::nil();
+    if (callback.is_nil() ? optional : is_callback(callback)) {
+        return callback;
+    }
+    return std::nullopt;
+}
+
+auto stream_result(std::optional<std::uint64_t> stream) -> Value
+{
+    return stream.has_value() ? Value::number(static_cast<double>(*stream)) : Value::nil();
+}
+
+auto timer(std::span<const Value> args) -> Value
+{
+    auto delay = args.empty() ? std::nullopt : integer_arg<std::uint32_t>(args[0]);
+    auto callback = callback_arg(args, 1, /* optional = */ false);
+    if (!delay.has_value() || !callback.has_value()) {
+        return Value::boolean(false);
+    }
+    g_vm->events.add_timer(std::chrono::milliseconds{*delay}, *callback);
+    return Value::boolean(true);
+}
+
+auto read_file(std::span<const Value> args) -> Value
+{
+    auto callback = callback_arg(args, 1, /* optional = */ false);
+    if (args.empty() || !args[0].is_string() || !callback.has_value()) {
+        return Value::boolean(false);
+    }
+    g_vm->events.read_file(std::string{args[0].as_string()}, *callback);
+    return Value::boolean(true);
+}
+
+auto write_file(std::span<const Value> args) -> Value
+{
+    auto callback = callback_arg(args, 2, /* optional = */ true);
+    if (args.size() < 2 || !args[0].is_string() || !args[1].is_string() || !callback.has_value()) {
+        return Value::boolean(false);
+    }
+    g_vm->events.write_file(
+            std::string{args[0].as_string()}, std::string{args[1].as_string()}, *callback
+    );
+    return Value::boolean(true);
+}
+
+auto listen(std::span<const Value> args) -> Value
+{
+    auto port = args.empty() ? std::nullopt : integer_arg<std::uint16_t>(args[0]);
+    auto callback = callback_arg(args, 1, /* optional = */ false);
+    if (!port.has_value() || !callback.has_value()) {
+        return Value::nil();
+    }
+    return stream_result(g_vm->events.listen(*port, *callback));
+}
+
+auto connect(std::span<const Value> args) -> Value
+{
+    auto port = args.empty() ? std::nullopt : integer_arg<std::uint16_t>(args[0]);
+    auto callback = callback_arg(args, 1, /* optional = */ false);
+    if (!port.has_value() || !callback.has_value()) {
+        return Value::nil();
+    }
+    return stream_result(g_vm->events.connect(*port, *callback));
+}
+
+auto read(std::span<const Value> args) -> Value
+{
+    auto stream = args.empty() ? std::nullopt : integer_arg<std::uint64_t>(args[0]);
+    auto callback = callback_arg(args, 1, /* optional = */ false);
+    if (!stream.has_value() || !callback.has_value()) {
+        return Value::boolean(false);
+    }
+    return Value::boolean(g_vm->events.read(*stream, *callback));
+}
+
+auto write(std::span<const Value> args) -> Value
+{
+    auto stream = args.empty() ? std::nullopt : integer_arg<std::uint64_t>(args[0]);
+    auto callback = callback_arg(args, 2, /* optional = */ true);
+    if (!stream.has_value() || args.size() < 2 || !args[1].is_string() || !callback.has_value()) {
+        return Value::boolean(false);
+    }
+    return Value::boolean(
+            g_vm->events.write(*stream, std::string{args[1].as_string()}, *callback)
+    );
+}
+
+auto close(std::span<const Value> args) -> Value
+{
+    auto stream = args.empty() ? std::nullopt : integer_arg<std::uint64_t>(args[0]);
+    return Value::boolean(stream.has_value() && g_vm->events.close(*stream));
+}
+
+auto port(std::span<const Value> args) -> Value
+{
+    auto stream = args.empty() ? std::nullopt : integer_arg<std::uint64_t>(args[0]);
+    auto port = stream.has_value() ? g_vm->events.local_port(*stream) : std::nullopt;
+    return port.has_value() ? Value::number(*port) : Value::nil();
+}
+
+} // namespace
+
+auto define_event_natives() -> void
+{
+    define_native("timer", timer);
+    define_native("read_file", read_file);
+    define_native("write_file", write_file);
+    define_native("listen", listen);
+    define_native("connect", connect);
+    define_native("read", read);
+    define_native("write", write);
+    define_native("close", close);
+    define_native("port", port);
+}
+
+auto run_event_loop() -> bool { return g_vm->events.run(); }
+
+} // namespace cpplox
@@ -0,0 +1,146 @@
+export module cpplox:Events;
+
+import std;
+
+import :Value;
+
+namespace cpplox {
+
+// Non-blocking I/O and timers of a VM, waited for with epoll. Operations are started by natives
+// (see define_event_natives()), the loop runs once the script has finished and calls a callback for
+// every completed operation. Callbacks which are coroutines are resumed with the result instead.
+//
+// Files are read and written on a few helper threads, epoll does not wait for regular files.
+// Operations beyond what the threads can take wait in a queue. Streams are TCP sockets on
+// localhost.
+class EventLoop
+{
+public:
+    EventLoop() = default;
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop(EventLoop &&) = delete;
+    auto operator=(const EventLoop &) -> EventLoop & = delete;
+    auto operator=(EventLoop &&) -> EventLoop & = delete;
+
+    // Callbacks of pending operations by their ids, roots for GC
+    [[nodiscard]] auto callbacks() const -> const std::unordered_map<std::uint64_t, Value> &
+    {
+        return m_callbacks;
+    }
+
+    auto add_timer(std::chrono::milliseconds delay, Value callback) -> void;
+
+    auto read_file(std::string path, Value callback) -> void;
+    auto write_file(std::string path, std::string data, Value callback) -> void;
+
+    // Return id of the new stream, empty if the socket could not be set up
+    auto listen(std::uint16_t port, Value callback) -> std::optional<std::uint64_t>;
+    auto connect(std::uint16_t port, Value callback) -> std::optional<std::uint64_t>;
+
+    // Return false for unknown streams
+    auto read(std::uint64_t stream, Value callback) -> bool;
+    auto write(std::uint64_t stream, std::string data, Value callback) -> bool;
+    auto close(std::uint64_t stream) -> bool;
+    [[nodiscard]] auto local_port(std::uint64_t stream) const -> std::optional<std::uint16_t>;
+
+    // Calls callbacks until no operation is pending. Returns false once a callback has failed with
+    // a runtime error, pending operations are dropped then.
+    auto run() -> bool;
+
+private:
+    struct Timer
+    {
+        std::chrono::steady_clock::time_point deadline;
+        std::uint64_t callback;
+
+        auto operator>(const Timer & other) const -> bool { return deadline > other.deadline; }
+    };
+
+    struct Write
+    {
+        std::string data;
+        std::size_t written = 0;
+        std::uint64_t callback = 0;
+    };
+
+    struct Stream
+    {
+        int fd = -1;
+        bool listening = false;    // reading accepts connections then
+        bool connecting = false;   // `on_connect` is called once writable
+        bool watched = false;      // registered with epoll, only while there is something to do
+        std::uint64_t on_read = 0; // called once, or for every connection of listening streams
+        std::uint64_t on_connect = 0;
+        std::deque<Write> writes;
+    };
+
+    // Result of a file operation, handed over by the helper thread running it
+    struct Completion
+    {
+        std::uint64_t callback = 0;
+        bool reading = false;
+        bool ok = false;
+        std::string contents; // of read files
+    };
+
+    // Creates epoll and the event used to wake it on completions
+    auto start() -> bool;
+    auto add_callback(Value callback) -> std::uint64_t; // 0 for nil, i.e. no callback
+    auto take_callback(std::uint64_t id) -> Value;
+    auto call(Value callback, std::span<const Value> args) -> bool;
+
+    auto add_stream(int fd, bool listening, bool connecting) -> std::optional<std::uint64_t>;
+    auto watch(std::uint64_t id, Stream & stream) -> void;
+    auto complete(Completion completion) -> void;
+    auto start_file_operation(Value callback, std::move_only_function<Completion()> operation)
+            -> void;
+    auto work_on_files() -> void; // loop of the helper threads
+    auto stop_files() -> void;    // joins the helper threads, queued operations are dropped
+
+    [[nodiscard]] auto has_work() const -> bool;
+    auto wait() -> std::vector<std::pair<std::uint64_t, std::uint32_t>>;
+    auto on_readable(std::uint64_t id) -> bool;
+    auto on_writable(std::uint64_t id) -> bool;
+    auto fire_timers() -> bool;
+    auto deliver_completions() -> bool;
+    auto drop_all() -> void;
+
+    int m_epoll = -1;
+    int m_wake = -1; // eventfd
+    std::uint64_t m_next_id = 1;
+    std::unordered_map<std::uint64_t, Value> m_callbacks;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> m_timers;
+    std::unordered_map<std::uint64_t, Stream> m_streams;
+
+    std::size_t m_files = 0; // file operations started and not delivered yet
+
+    std::mutex m_mutex;
+    std::condition_variable m_queued;
+    std::deque<std::move_only_function<void()>> m_file_queue; // guarded by m_mutex
+    std::vector<Completion> m_completions;                    // guarded by m_mutex
+    bool m_stopping = false;                                  // guarded by m_mutex
+    std::vector<std::jthread> m_file_threads; // started as needed, last, they use the above
+};
+
+// Natives starting operations of the event loop of the current VM:
+//   timer(ms, callback)                calls callback() after `ms` milliseconds
+//   read_file(path, callback)          calls callback(contents), nil if the file cannot be read
+//   write_file(path, data, callback)   calls callback(ok) once written, the callback may be nil
+//   listen(port, callback)             returns id of a stream accepting connections on localhost
+//                                      (any free port for 0), calls callback(stream) for each
+//   connect(port, callback)            returns id of a stream connecting to localhost, calls
+//                                      callback(stream) once connected or callback(nil)
+//   read(stream, callback)             calls callback(data) once data is received, nil at the end
+//   write(stream, data, callback)      calls callback(ok) once sent, the callback may be nil
+//   close(stream)                      closes the stream, its callbacks are not called anymore
+//   port(stream)                       returns the local port of a stream
+//
+// Natives starting an operation return false or nil if the arguments are wrong.
+auto define_event_natives() -> void;
+
+// Runs the event loop of the current VM, e.g. once a script has finished
+auto run_event_loop() -> bool;
+
+} // namespace cpplox
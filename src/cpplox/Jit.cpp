@@ -0,0 +1,431 @@
+module;
+
+#include <cassert>
+#include <sys/mman.h>
+#include <unistd.h>
+
+module cpplox;
+
+import std;
+
+import :Chunk;
+import :Jit;
+import :Object;
+import :OpCode;
+import :Runtime;
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+namespace {
+
+using EntryFn = RunStatus (*)(const std::uint8_t * target, Value ** stack_top, Value ** slots);
+
+} // namespace
+
+auto JitCode::create(std::span<const std::uint8_t> machine_code, std::vector<std::uint32_t> offsets)
+        -> std::unique_ptr<JitCode>
+{
+    auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    auto size = (machine_code.size() + page_size - 1) / page_size * page_size;
+
+    void * memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { // NOLINT(cppcoreguidelines-pro-type-cstyle-cast)
+        return nullptr;
+    }
+
+    std::ranges::copy(machine_code, static_cast<std::uint8_t *>(memory));
+
+    // W^X: never keep the code writable and executable at the same time
+    if (::mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        ::munmap(memory, size);
+        return nullptr;
+    }
+
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory,modernize-make-unique)
+    return std::unique_ptr<JitCode>(new JitCode(memory, size, std::move(offsets)));
+}
+
+JitCode::~JitCode() { ::munmap(m_memory, m_size); }
+
+auto JitCode::run(std::size_t bytecode_offset, Value ** stack_top, Value ** slots) const
+        -> RunStatus
+{
+    const auto * base = static_cast<const std::uint8_t *>(m_memory);
+    auto entry = std::bit_cast<EntryFn>(m_memory);
+    return entry(std::next(base, m_offsets[bytecode_offset]), stack_top, slots);
+}
+
+#if defined(__x86_64__)
+
+namespace {
+
+constexpr const bool DEBUG_LOG_JIT = false;
+
+constexpr const std::uint32_t NO_OFFSET = std::numeric_limits<std::uint32_t>::max();
+
+// Values are copied around as 16 bytes through xmm0, whatever they hold
+constexpr const std::int32_t VALUE_SIZE = 16;
+static_assert(sizeof(Value) == VALUE_SIZE);
+
+// Pushed by Nil, True and False, copied from here like constants
+const Value NIL_VALUE = Value::nil();
+const Value TRUE_VALUE = Value::boolean(true);
+const Value FALSE_VALUE = Value::boolean(false);
+
+// Registers held across instructions, callee-saved so that calls into the runtime keep them:
+//   rbx  address of the frame's slots pointer, see CallFrame::slots
+//   r12  address of the VM's stack top pointer, see ValueStack::top_address()
+//   r13  stack top, stored to [r12] before calls into the runtime and loaded after them
+//   r14  frame slots, loaded after calls into the runtime as they may move the stack
+class Assembler
+{
+public:
+    [[nodiscard]] auto code() const -> std::span<const std::uint8_t> { return m_code; }
+    [[nodiscard]] auto size() const -> std::uint32_t
+    {
+        return static_cast<std::uint32_t>(m_code.size());
+    }
+
+    auto push_callee_saved() -> void
+    {
+        emit(0x53);       // push rbx
+        emit(0x41, 0x54); // push r12
+        emit(0x41, 0x55); // push r13
+        emit(0x41, 0x56); // push r14
+        emit(0x41, 0x57); // push r15, unused: keeps the stack 16-byte aligned for calls
+    }
+
+    auto pop_callee_saved() -> void
+    {
+        emit(0x41, 0x5F); // pop r15
+        emit(0x41, 0x5E); // pop r14
+        emit(0x41, 0x5D); // pop r13
+        emit(0x41, 0x5C); // pop r12
+        emit(0x5B);       // pop rbx
+    }
+
+    auto ret() -> void { emit(0xC3); }
+    auto jmp_rdi() -> void { emit(0xFF, 0xE7); }
+    auto mov_r12_rsi() -> void { emit(0x49, 0x89, 0xF4); }
+    auto mov_rbx_rdx() -> void { emit(0x48, 0x89, 0xD3); }
+
+    auto load_top() -> void { emit(0x4D, 0x8B, 0x2C, 0x24); }  // mov r13, [r12]
+    auto store_top() -> void { emit(0x4D, 0x89, 0x2C, 0x24); } // mov [r12], r13
+    auto load_slots() -> void { emit(0x4C, 0x8B, 0x33); }      // mov r14, [rbx]
+
+    auto mov_rdi(std::uint64_t imm) -> void
+    {
+        emit(0x48, 0xBF);
+        emit_le(imm);
+    }
+
+    auto mov_rax(std::uint64_t imm) -> void
+    {
+        emit(0x48, 0xB8);
+        emit_le(imm);
+    }
+
+    auto call_rax() -> void { emit(0xFF, 0xD0); }
+    auto test_eax_eax() -> void { emit(0x85, 0xC0); }
+
+    // movups xmm0, [rax]
+    auto load_value_rax() -> void { emit(0x0F, 0x10, 0x00); }
+
+    // movups [r13], xmm0; add r13, 16
+    auto push_value() -> void
+    {
+        emit(0x41, 0x0F, 0x11, 0x45, 0x00);
+        emit(0x49, 0x83, 0xC5, VALUE_SIZE);
+    }
+
+    // sub r13, 16
+    auto drop_value() -> void { emit(0x49, 0x83, 0xED, VALUE_SIZE); }
+
+    // movups xmm0, [r13 - 16]
+    auto load_value_top() -> void { emit(0x41, 0x0F, 0x10, 0x45, -VALUE_SIZE & 0xFF); }
+
+    // movups xmm0, [r14 + slot * 16]
+    auto load_value_slot(Byte slot) -> void
+    {
+        emit(0x41, 0x0F, 0x10, 0x86);
+        emit_le(static_cast<std::uint32_t>(slot * VALUE_SIZE));
+    }
+
+    // movups [r14 + slot * 16], xmm0
+    auto store_value_slot(Byte slot) -> void
+    {
+        emit(0x41, 0x0F, 0x11, 0x86);
+        emit_le(static_cast<std::uint32_t>(slot * VALUE_SIZE));
+    }
+
+    // movzx eax, byte [r13 - 16 + offset]
+    auto load_top_byte(std::size_t offset) -> void
+    {
+        emit(0x41, 0x0F, 0xB6, 0x45, top_displacement(offset));
+    }
+
+    // cmp byte [r13 - 16 + offset], 0
+    auto test_top_byte(std::size_t offset) -> void
+    {
+        emit(0x41, 0x80, 0x7D, top_displacement(offset), 0x00);
+    }
+
+    auto cmp_al(std::uint8_t imm) -> void { emit(0x3C, imm); }
+
+    auto jnz(std::uint32_t target) -> void
+    {
+        emit(0x0F, 0x85);
+        emit_rel32(target);
+    }
+
+    auto je(std::uint32_t target) -> void
+    {
+        emit(0x0F, 0x84);
+        emit_rel32(target);
+    }
+
+    auto jne_short(std::uint8_t skipped) -> void { emit(0x75, skipped); }
+
+    auto jmp(std::uint32_t target) -> void
+    {
+        emit(0xE9);
+        emit_rel32(target);
+    }
+
+private:
+    auto emit(std::integral auto... bytes) -> void
+    {
+        (m_code.push_back(static_cast<std::uint8_t>(bytes)), ...);
+    }
+
+    template <std::unsigned_integral T> auto emit_le(T value) -> void
+    {
+        for (auto _ : std::views::iota(0UZ, sizeof(T))) {
+            m_code.push_back(static_cast<std::uint8_t>(value & 0xFF));
+            value >>= 8; // NOLINT(hicpp-signed-bitwise)
+        }
+    }
+
+    // Displacement is relative to the end of the jump instruction
+    auto emit_rel32(std::uint32_t target) -> void
+    {
+        auto next = static_cast<std::int64_t>(m_code.size()) + 4;
+        auto rel = static_cast<std::int32_t>(static_cast<std::int64_t>(target) - next);
+        emit_le(static_cast<std::uint32_t>(rel));
+    }
+
+    static auto top_displacement(std::size_t offset) -> std::uint8_t
+    {
+        return static_cast<std::uint8_t>(static_cast<std::int32_t>(offset) - VALUE_SIZE);
+    }
+
+    std::vector<std::uint8_t> m_code;
+};
+
+// Layout of the machine code:
+//   entry:  push callee-saved registers
+//           load registers from the frame and the stack (rsi: stack top address, rdx: slots
+//           address)
+//           jmp rdi           ; continue from the requested instruction
+//   exit:   pop callee-saved registers
+//           ret               ; eax holds RunStatus of the last runtime call
+//   instructions...
+// Returns the offset of the exit.
+auto emit_prologue(Assembler & as) -> std::uint32_t
+{
+    as.push_callee_saved();
+    as.mov_r12_rsi();
+    as.mov_rbx_rdx();
+    as.load_top();
+    as.load_slots();
+    as.jmp_rdi();
+
+    auto exit = as.size();
+    as.pop_callee_saved();
+    as.ret();
+    return exit;
+}
+
+// JumpIfFalse leaves the condition on the stack, it jumps for nil and false
+auto emit_branch_if_false(Assembler & as, std::uint32_t target) -> void
+{
+    // cmp byte [r13 - 16 + payload], 0 and je rel32, skipped for values other than booleans
+    constexpr const std::uint8_t BOOLEAN_TEST_SIZE = 11;
+
+    as.load_top_byte(Value::type_offset());
+    as.cmp_al(std::to_underlying(Value::ValueType::Nil));
+    as.je(target);
+    as.cmp_al(std::to_underlying(Value::ValueType::Boolean));
+    as.jne_short(BOOLEAN_TEST_SIZE);
+    as.test_top_byte(Value::payload_offset());
+    as.je(target);
+}
+
+auto emit_push_from(Assembler & as, const Value & value) -> void
+{
+    as.mov_rax(reinterpret_cast<std::uintptr_t>(&value)); // NOLINT
+    as.load_value_rax();
+    as.push_value();
+}
+
+// Instructions which only move values around are inlined, others call their runtime entry point.
+// `target` gives the machine code offset of a jump's target, if the jump is valid. Returns false
+// for instructions which cannot be compiled.
+auto emit_instruction(
+        Assembler & as,
+        const Chunk & chunk,
+        std::size_t offset,
+        std::uint32_t exit,
+        const std::function<std::optional<std::uint32_t>(std::size_t)> & target
+) -> bool
+{
+    using enum OpCode;
+
+    const auto * ip = &chunk.code[offset];
+    auto op = static_cast<OpCode>(*ip);
+
+    switch (op) {
+    case Jump:
+    case Loop:
+    case JumpIfFalse: {
+        auto native_target = target(offset);
+        if (!native_target.has_value()) {
+            return false;
+        }
+        if (op == JumpIfFalse) {
+            emit_branch_if_false(as, native_target.value());
+        }
+        else {
+            as.jmp(native_target.value());
+        }
+        return true;
+    }
+    case Constant: emit_push_from(as, chunk.constants[ip[1]]); return true;
+    case Nil: emit_push_from(as, NIL_VALUE); return true;
+    case True: emit_push_from(as, TRUE_VALUE); return true;
+    case False: emit_push_from(as, FALSE_VALUE); return true;
+    case Pop: as.drop_value(); return true;
+    case GetLocal: {
+        as.load_value_slot(ip[1]);
+        as.push_value();
+        return true;
+    }
+    case SetLocal: {
+        as.load_value_top();
+        as.store_value_slot(ip[1]);
+        return true;
+    }
+    default: break;
+    }
+
+    auto entry = runtime_entry(op);
+    if (!entry.has_value()) {
+        return false;
+    }
+    as.store_top();
+    as.mov_rdi(reinterpret_cast<std::uintptr_t>(ip)); // NOLINT
+    as.mov_rax(std::bit_cast<std::uintptr_t>(entry->fn));
+    as.call_rax();
+    as.test_eax_eax();
+    as.jnz(exit); // the frame may be gone, registers are not loaded again then
+    as.load_top();
+    as.load_slots();
+    return true;
+}
+
+auto function_display_name(const ObjFunction & function) -> std::string
+{
+    auto name = function.get_name();
+    return name.empty() ? std::string{"<script>"} : std::string{name};
+}
+
+// Lets `perf` symbolize JIT frames, see tools/perf/Documentation/jit-interface.txt in Linux sources
+auto write_perf_map_entry(const JitCode & code, std::string_view name) -> void
+{
+    // one map per process, shared by VMs running on other threads
+    static std::mutex perf_map_mutex;
+    static std::ofstream perf_map{std::format("/tmp/perf-{}.map", ::getpid())};
+    if (!perf_map.is_open()) {
+        return;
+    }
+    std::scoped_lock lock{perf_map_mutex};
+    std::println(
+            perf_map,
+            "{:x} {:x} lox:{}",
+            reinterpret_cast<std::uintptr_t>(code.address()), // NOLINT
+            code.size(),
+            name
+    );
+    perf_map.flush();
+}
+
+auto jit_enter(ObjFunction & function, const Byte * ip) -> RunStatus
+{
+    const auto * code_start = function.get_chunk().code.data();
+    auto offset = static_cast<std::size_t>(std::distance(code_start, ip));
+    return function.get_jit_code()->run(
+            offset, g_vm->stack.top_address(), &g_vm->frames.back().slots
+    );
+}
+
+} // namespace
+
+auto jit_compile(ObjFunction & function) -> bool
+{
+    const auto & chunk = function.get_chunk();
+    const auto code_size = chunk.code.size();
+
+    // First pass lays out machine code, instructions have the same size whatever their jump targets
+    std::vector<std::uint32_t> offsets(code_size, NO_OFFSET);
+    Assembler layout;
+    auto exit = emit_prologue(layout);
+    for (std::size_t offset = 0; offset < code_size; offset += instruction_size(chunk, offset)) {
+        offsets[offset] = layout.size();
+        if (!emit_instruction(layout, chunk, offset, exit, [](std::size_t) { return 0U; })) {
+            return false;
+        }
+    }
+
+    const auto native_target = [&](std::size_t offset) -> std::optional<std::uint32_t> {
+        auto target = jump_target(chunk, offset);
+        if (!target.has_value() || target.value() >= code_size || offsets[*target] == NO_OFFSET) {
+            return std::nullopt;
+        }
+        return offsets[*target];
+    };
+
+    // Second pass emits machine code
+    Assembler as;
+    emit_prologue(as);
+    for (std::size_t offset = 0; offset < code_size; offset += instruction_size(chunk, offset)) {
+        assert(as.size() == offsets[offset] && "Instruction size depends on its jump target");
+        if (!emit_instruction(as, chunk, offset, exit, native_target)) {
+            return false;
+        }
+    }
+
+    auto jit_code = JitCode::create(as.code(), std::move(offsets));
+    if (jit_code == nullptr) {
+        return false;
+    }
+
+    auto name = function_display_name(function);
+    write_perf_map_entry(*jit_code, name);
+    if constexpr (DEBUG_LOG_JIT) {
+        std::println("JIT compiled {} into {} bytes", name, as.code().size());
+    }
+
+    function.set_jit_code(std::move(jit_code));
+    function.set_compiled(jit_enter);
+    return true;
+}
+
+#else
+
+auto jit_compile(ObjFunction & /* function */) -> bool { return false; }
+
+#endif
+
+} // namespace cpplox
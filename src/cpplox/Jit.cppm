@@ -0,0 +1,52 @@
+export module cpplox:Jit;
+
+import std;
+
+import :Obj;
+import :OpCode;
+import :Runtime;
+import :Value;
+
+namespace cpplox {
+
+// Machine code of a JIT-compiled function. Instructions which only move values (constants, locals,
+// pops) and jumps are translated into machine code of their own, others into calls to their runtime
+// entry points (see Runtime).
+class JitCode
+{
+public:
+    static auto create(std::span<const std::uint8_t> machine_code, std::vector<std::uint32_t> offsets)
+            -> std::unique_ptr<JitCode>;
+
+    JitCode(const JitCode &) = delete;
+    JitCode(JitCode &&) = delete;
+    auto operator=(const JitCode &) -> JitCode & = delete;
+    auto operator=(JitCode &&) -> JitCode & = delete;
+    ~JitCode();
+
+    // Runs machine code from the instruction at `bytecode_offset`, on the stack with the given top
+    // pointer in the frame with the given slots pointer. Both are updated as the code runs.
+    [[nodiscard]] auto run(std::size_t bytecode_offset, Value ** stack_top, Value ** slots) const
+            -> RunStatus;
+
+    [[nodiscard]] auto address() const -> const void * { return m_memory; }
+    [[nodiscard]] auto size() const -> std::size_t { return m_size; }
+
+private:
+    JitCode(void * memory, std::size_t size, std::vector<std::uint32_t> offsets)
+        : m_memory(memory)
+        , m_size(size)
+        , m_offsets(std::move(offsets))
+    {
+    }
+
+    void * m_memory;
+    std::size_t m_size;
+    std::vector<std::uint32_t> m_offsets; // bytecode offset -> machine code offset
+};
+
+// Translates the function into machine code and makes it the function's compiled body. Returns
+// false if the function (or the platform) is not supported, so the interpreter keeps running it.
+auto jit_compile(ObjFunction & function) -> bool;
+
+} // namespace cpplox
@@ -0,0 +1,131 @@
+module;
+
+#include <cassert>
+
+module cpplox;
+
+import std;
+
+import :CodeArena;
+import :LineTable;
+import :OpCode;
+import :SourceLocation;
+
+namespace cpplox {
+
+namespace {
+
+constexpr const unsigned int VARINT_DIGITS = 7;
+constexpr const Byte VARINT_MASK = 0x7F;
+constexpr const Byte VARINT_CONTINUE = 0x80;
+// Run length, line delta and column delta
+constexpr const std::size_t MAX_VARINT_SIZE
+        = (std::numeric_limits<std::uint64_t>::digits + VARINT_DIGITS - 1) / VARINT_DIGITS;
+constexpr const std::size_t MAX_RUN_SIZE = 3 * MAX_VARINT_SIZE;
+
+auto write_varint(std::pmr::vector<Byte> & out, std::uint64_t value) -> void
+{
+    while (value > VARINT_MASK) {
+        out.push_back(static_cast<Byte>((value & VARINT_MASK) | VARINT_CONTINUE));
+        value >>= VARINT_DIGITS;
+    }
+    out.push_back(static_cast<Byte>(value));
+}
+
+auto read_varint(std::span<const Byte> in, std::size_t & pos) -> std::uint64_t
+{
+    std::uint64_t value = 0;
+    for (unsigned int shift = 0;; shift += VARINT_DIGITS) {
+        Byte b = in[pos++];
+        value |= static_cast<std::uint64_t>(b & VARINT_MASK) << shift;
+        if ((b & VARINT_CONTINUE) == 0) {
+            return value;
+        }
+    }
+}
+
+// Zigzag encoding keeps small negative deltas small, e.g. for a `for` loop increment which is
+// emitted after the loop body
+auto write_delta(std::pmr::vector<Byte> & out, std::size_t from, std::size_t to) -> void
+{
+    auto delta = static_cast<std::int64_t>(to) - static_cast<std::int64_t>(from);
+    auto sign = static_cast<std::uint64_t>(delta >> 63); // all ones for negative deltas
+    write_varint(out, (static_cast<std::uint64_t>(delta) << 1U) ^ sign);
+}
+
+auto read_delta(std::span<const Byte> in, std::size_t & pos, std::size_t from) -> std::size_t
+{
+    auto zigzag = read_varint(in, pos);
+    auto delta = static_cast<std::int64_t>(zigzag >> 1U) ^ -static_cast<std::int64_t>(zigzag & 1U);
+    return static_cast<std::size_t>(static_cast<std::int64_t>(from) + delta);
+}
+
+} // namespace
+
+auto LineTable::add(SourceLocation sloc, std::size_t count) -> void
+{
+    if (count == 0) {
+        return;
+    }
+    if (m_open.length == 0 || m_open.sloc != sloc) {
+        flush();
+        m_open.sloc = sloc;
+    }
+    m_open.length += count;
+    m_size += count;
+}
+
+auto LineTable::flush() -> void
+{
+    if (m_open.length == 0) {
+        return;
+    }
+    write_varint(m_encoded, m_open.length);
+    write_delta(m_encoded, m_encoded_last.line, m_open.sloc.line);
+    write_delta(m_encoded, m_encoded_last.column, m_open.sloc.column);
+    m_encoded_last = m_open.sloc;
+    m_open.length = 0;
+}
+
+auto LineTable::at(std::size_t offset) const -> SourceLocation
+{
+    assert(offset < m_size && "Code offset is out of the line table");
+
+    std::size_t run_start = 0;
+    SourceLocation sloc = {};
+    for (std::size_t pos = 0; pos < m_encoded.size();) {
+        run_start += read_varint(m_encoded, pos);
+        sloc.line = read_delta(m_encoded, pos, sloc.line);
+        sloc.column = read_delta(m_encoded, pos, sloc.column);
+        if (offset < run_start) {
+            return sloc;
+        }
+    }
+    return m_open.sloc;
+}
+
+auto LineTable::runs() const -> std::vector<Run>
+{
+    std::vector<Run> runs;
+    SourceLocation sloc = {};
+    for (std::size_t pos = 0; pos < m_encoded.size();) {
+        auto length = static_cast<std::size_t>(read_varint(m_encoded, pos));
+        sloc.line = read_delta(m_encoded, pos, sloc.line);
+        sloc.column = read_delta(m_encoded, pos, sloc.column);
+        runs.push_back({.length = length, .sloc = sloc});
+    }
+    if (m_open.length != 0) {
+        runs.push_back(m_open);
+    }
+    return runs;
+}
+
+auto LineTable::relocate(std::pmr::memory_resource & resource) -> void
+{
+    flush();
+    cpplox::relocate(m_encoded, resource);
+}
+
+auto LineTable::relocated_size() const -> std::size_t { return m_encoded.size() + MAX_RUN_SIZE; }
+
+} // namespace cpplox
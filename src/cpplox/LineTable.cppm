@@ -0,0 +1,49 @@
+export module cpplox:LineTable;
+
+import std;
+
+import :CodeArena;
+import :OpCode;
+import :SourceLocation;
+
+namespace cpplox {
+
+// Source locations of code bytes. Consecutive bytes usually come from the same token, so locations
+// are stored as runs: run length and line/column deltas from the previous run, packed as varints.
+// Locations are only needed for error messages and disassembly, so lookup is a linear scan.
+export class LineTable
+{
+public:
+    struct Run
+    {
+        std::size_t length;
+        SourceLocation sloc;
+    };
+
+    // Appends `count` code bytes located at `sloc`
+    auto add(SourceLocation sloc, std::size_t count = 1) -> void;
+
+    // Location of the code byte at `offset`
+    [[nodiscard]] auto at(std::size_t offset) const -> SourceLocation;
+
+    // Number of code bytes covered
+    [[nodiscard]] auto size() const -> std::size_t { return m_size; }
+
+    [[nodiscard]] auto runs() const -> std::vector<Run>;
+
+    // Moves encoded runs into `resource` (see CodeArena), the table must not change afterwards
+    auto relocate(std::pmr::memory_resource & resource) -> void;
+
+    // Upper bound of memory needed by relocate()
+    [[nodiscard]] auto relocated_size() const -> std::size_t;
+
+private:
+    auto flush() -> void;
+
+    std::pmr::vector<Byte> m_encoded;
+    SourceLocation m_encoded_last = {}; // location of the last encoded run, base for the next delta
+    Run m_open = {}; // last run is kept decoded while it can still grow
+    std::size_t m_size = 0;
+};
+
+} // namespace cpplox
@@ -0,0 +1,53 @@
+module;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+module cpplox;
+
+import std;
+
+import :MappedFile;
+
+namespace cpplox {
+
+auto MappedFile::open(const std::filesystem::path & path) -> std::optional<MappedFile>
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC); // NOLINT(cppcoreguidelines-pro-type-vararg)
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    struct ::stat info = {};
+    if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) { // NOLINT(hicpp-signed-bitwise)
+        ::close(fd);
+        return std::nullopt;
+    }
+
+    auto size = static_cast<std::size_t>(info.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return MappedFile{nullptr, 0};
+    }
+
+    void * memory = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // mapping stays valid
+    if (memory == MAP_FAILED) { // NOLINT(cppcoreguidelines-pro-type-cstyle-cast)
+        return std::nullopt;
+    }
+    // both scripts and bytecode are read once, front to back
+    ::madvise(memory, size, MADV_SEQUENTIAL);
+
+    return MappedFile{memory, size};
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_memory != nullptr) {
+        ::munmap(m_memory, m_size);
+    }
+}
+
+} // namespace cpplox
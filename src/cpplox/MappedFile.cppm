@@ -0,0 +1,49 @@
+export module cpplox:MappedFile;
+
+import std;
+
+namespace cpplox {
+
+// Read-only memory mapping of a whole file
+export class MappedFile
+{
+public:
+    static auto open(const std::filesystem::path & path) -> std::optional<MappedFile>;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile(MappedFile && other) noexcept
+        : m_memory(std::exchange(other.m_memory, nullptr))
+        , m_size(std::exchange(other.m_size, 0))
+    {
+    }
+    auto operator=(const MappedFile &) -> MappedFile & = delete;
+    auto operator=(MappedFile && other) noexcept -> MappedFile &
+    {
+        std::swap(m_memory, other.m_memory);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+    ~MappedFile();
+
+    [[nodiscard]] auto bytes() const -> std::span<const std::byte>
+    {
+        return {static_cast<const std::byte *>(m_memory), m_size};
+    }
+
+    [[nodiscard]] auto text() const -> std::string_view
+    {
+        return {static_cast<const char *>(m_memory), m_size};
+    }
+
+private:
+    MappedFile(void * memory, std::size_t size)
+        : m_memory(memory)
+        , m_size(size)
+    {
+    }
+
+    void * m_memory; // nullptr for empty files, they cannot be mapped
+    std::size_t m_size;
+};
+
+} // namespace cpplox
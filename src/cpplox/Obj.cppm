@@ -14,9 +14,12 @@ public:
         BoundMethod,
         Class,
         Closure,
+        Coroutine,
         Function,
         Instance,
+        List,
         Native,
+        Rope,
         String,
         Upvalue,
     };
@@ -43,12 +46,15 @@ private:
 };
 
 export class ObjString;
+export class ObjRope;
 export class ObjUpvalue;
 export class ObjFunction;
 export class ObjClosure;
+export class ObjCoroutine;
 export class ObjNative;
 export class ObjClass;
 export class ObjInstance;
+export class ObjList;
 export class ObjBoundMethod;
 
 export auto release_object(Obj * obj) -> void;
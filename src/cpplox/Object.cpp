@@ -2,6 +2,7 @@ module cpplox;
 
 import :Compiler;
 import :Chunk;
+import :CodeArena;
 import :EnumFormatter;
 import :Object;
 import :Value;
@@ -18,16 +19,17 @@ constexpr const bool DEBUG_RUN_GC_EVERY_TIME = false;
 constexpr const bool DEBUG_LOG_GC = false;
 constexpr const std::size_t GC_HEAP_GROW_FACTOR = 2;
 
-auto object_size(Obj::ObjType type) -> std::size_t;
+auto object_size(const Obj * obj) -> std::size_t;
 auto collect_garbage() -> void;
 
-template <std::derived_from<Obj> T, typename... Args> auto save_object(T * obj) -> T *
+template <std::derived_from<Obj> T, typename... Args>
+auto save_object(T * obj, std::size_t size = sizeof(T)) -> T *
 {
     if constexpr (DEBUG_RUN_GC_EVERY_TIME) {
         collect_garbage();
     }
 
-    if (g_vm.bytes_allocated >= g_vm.next_gc) {
+    if (g_vm->bytes_allocated >= g_vm->next_gc) {
         collect_garbage();
     }
 
@@ -37,8 +39,8 @@ template <std::derived_from<Obj> T, typename... Args> auto save_object(T * obj)
         );
     }
 
-    g_vm.objects.push_back(obj);
-    g_vm.bytes_allocated += sizeof(T);
+    g_vm->objects.push_back(obj);
+    g_vm->bytes_allocated += size;
 
     return obj;
 }
@@ -48,20 +50,117 @@ template <std::derived_from<Obj> T, typename... Args> auto save_object(T * obj)
 auto release_object(Obj * obj) -> void
 {
     auto type = obj->get_type();
+    auto size = object_size(obj);
 
     delete obj; // NOLINT(cppcoreguidelines-owning-memory)
 
-    g_vm.bytes_allocated -= object_size(type);
+    g_vm->bytes_allocated -= size;
 
     if constexpr (DEBUG_LOG_GC) {
         std::println("Released {} at {}", magic_enum::enum_name(type), static_cast<void *>(obj));
     }
 }
 
-auto ObjString::create(std::string data) -> ObjString *
+auto ObjString::create(std::string_view data) -> ObjString *
 {
+    return concatenate(std::span{&data, 1});
+}
+
+auto ObjString::concatenate(std::span<const std::string_view> parts) -> ObjString *
+{
+    static_assert(alignof(ObjString) >= alignof(char));
+
+    std::size_t length = 0;
+    for (auto part : parts) {
+        length += part.length();
+    }
+
+    auto size = allocation_size(length);
+    void * memory = ::operator new(size);
     // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
-    return save_object(new ObjString(std::move(data)));
+    auto * str = new (memory) ObjString(length);
+
+    char * out = str->chars();
+    for (auto part : parts) {
+        out = std::ranges::copy(part, out).out;
+    }
+    str->m_hash = hash_chars(str->data());
+
+    // parts may point into other strings, they are only collected once the new one is complete
+    return save_object(str, size);
+}
+
+auto ObjString::operator delete(void * ptr) -> void { ::operator delete(ptr); }
+
+auto ObjString::hash_chars(std::string_view chars) -> std::size_t
+{
+    constexpr std::uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+    constexpr std::uint64_t FNV_PRIME = 0x100000001b3;
+
+    std::uint64_t hash = FNV_OFFSET_BASIS;
+    for (char c : chars) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= FNV_PRIME;
+    }
+    return static_cast<std::size_t>(hash);
+}
+
+auto ObjString::allocation_size(std::size_t length) -> std::size_t
+{
+    return sizeof(ObjString) + length;
+}
+
+auto ObjRope::create(Value left, Value right) -> ObjRope *
+{
+    auto length = left.string_length() + right.string_length();
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+    return save_object(new ObjRope(left.as_obj(), right.as_obj(), length));
+}
+
+auto ObjRope::flatten() -> std::string_view
+{
+    if (is_flat()) {
+        return std::string_view{*m_flat}.substr(0, m_length);
+    }
+
+    // Extending a flattened rope, e.g. `s = s + x; print s;` in a loop, appends to its buffer as
+    // long as nothing else has been appended to it and there is room. Otherwise the new buffer
+    // gets room for as much again, so building such a string copies it only a few times.
+    std::vector<const Obj *> pending{m_right, m_left};
+    const auto * left = dynamic_cast<const ObjRope *>(m_left);
+    if (left != nullptr && left->is_flat() && left->m_flat->size() == left->m_length
+        && left->m_flat->capacity() >= m_length) {
+        m_flat = left->m_flat;
+        pending.pop_back();
+    }
+    else {
+        m_flat = std::make_shared<std::string>();
+        m_flat->reserve(left != nullptr && left->is_flat() ? 2 * m_length : m_length);
+        m_buffer_size = m_flat->capacity();
+    }
+
+    // Ropes built in loops are as deep as the loop is long, walk them without recursion. Appends
+    // stay within the reserved room, characters already in the buffer do not move.
+    while (!pending.empty()) {
+        const auto * part = pending.back();
+        pending.pop_back();
+
+        if (const auto * rope = dynamic_cast<const ObjRope *>(part); rope == nullptr) {
+            m_flat->append(dynamic_cast<const ObjString *>(part)->data());
+        }
+        else if (rope->is_flat()) {
+            m_flat->append(*rope->m_flat, 0, rope->m_length);
+        }
+        else {
+            pending.push_back(rope->m_right);
+            pending.push_back(rope->m_left);
+        }
+    }
+
+    m_left = nullptr;
+    m_right = nullptr;
+    g_vm->bytes_allocated += m_buffer_size;
+    return std::string_view{*m_flat}.substr(0, m_length);
 }
 
 auto ObjUpvalue::create(Value * location) -> ObjUpvalue *
@@ -76,6 +175,38 @@ auto ObjFunction::create(std::string name) -> ObjFunction *
     return save_object(new ObjFunction(std::move(name)));
 }
 
+auto ObjFunction::relocate(std::pmr::memory_resource & resource) -> void
+{
+    relocate_chunk(m_chunk, resource);
+    cpplox::relocate(m_name, resource);
+}
+
+auto ObjFunction::relocated_size() const -> std::size_t
+{
+    return relocated_chunk_size(m_chunk) + m_name.size() + 1 + alignof(std::max_align_t);
+}
+
+namespace {
+
+auto collect_functions(ObjFunction & function, std::vector<ObjFunction *> & functions) -> void
+{
+    functions.push_back(&function);
+    for (const auto & constant : function.get_chunk().constants) {
+        if (constant.is_function()) {
+            collect_functions(*constant.as_objfunction(), functions);
+        }
+    }
+}
+
+} // namespace
+
+auto collect_functions(ObjFunction & script) -> std::vector<ObjFunction *>
+{
+    std::vector<ObjFunction *> functions;
+    collect_functions(script, functions);
+    return functions;
+}
+
 auto ObjNative::create(Value::NativeFn callable) -> ObjNative *
 {
     // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
@@ -84,8 +215,19 @@ auto ObjNative::create(Value::NativeFn callable) -> ObjNative *
 
 auto ObjClosure::create(ObjFunction * function) -> ObjClosure *
 {
+    static_assert(sizeof(ObjClosure) % alignof(ObjUpvalue *) == 0);
+
+    auto size = allocation_size(function->upvalue_count());
+    void * memory = ::operator new(size);
     // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
-    return save_object(new ObjClosure(function));
+    return save_object(new (memory) ObjClosure(function, function->upvalue_count()), size);
+}
+
+auto ObjClosure::operator delete(void * ptr) -> void { ::operator delete(ptr); }
+
+auto ObjClosure::allocation_size(std::size_t upvalue_count) -> std::size_t
+{
+    return sizeof(ObjClosure) + (upvalue_count * sizeof(ObjUpvalue *));
 }
 
 auto ObjClass::create(ObjString * name) -> ObjClass *
@@ -100,27 +242,50 @@ auto ObjInstance::create(ObjClass * cls) -> ObjInstance *
     return save_object(new ObjInstance(cls));
 }
 
+auto ObjList::create(std::span<const Value> elements) -> ObjList *
+{
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+    return save_object(new ObjList(elements));
+}
+
 auto ObjBoundMethod::create(Value receiver, ObjClosure * method) -> ObjBoundMethod *
 {
     // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
     return save_object(new ObjBoundMethod(receiver, method));
 }
 
+auto ObjCoroutine::create(std::span<const Value> call) -> ObjCoroutine *
+{
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+    return save_object(new ObjCoroutine(call));
+}
+
 } // namespace cpplox
 
 namespace cpplox { namespace {
 
-auto object_size(Obj::ObjType type) -> std::size_t
+auto object_size(const Obj * obj) -> std::size_t
 {
-    switch (type) {
-    case Obj::ObjType::Closure: return sizeof(ObjClosure);
+    switch (obj->get_type()) {
+    // the function may be already released, closure knows its size by itself
+    case Obj::ObjType::Closure: {
+        const auto * closure = dynamic_cast<const ObjClosure *>(obj);
+        return ObjClosure::allocation_size(closure->upvalues().size());
+    }
     case Obj::ObjType::Function: return sizeof(ObjFunction);
     case Obj::ObjType::Native: return sizeof(ObjNative);
-    case Obj::ObjType::String: return sizeof(ObjString);
+    case Obj::ObjType::String:
+        return ObjString::allocation_size(dynamic_cast<const ObjString *>(obj)->data().length());
+    case Obj::ObjType::Rope: {
+        const auto * rope = dynamic_cast<const ObjRope *>(obj);
+        return sizeof(ObjRope) + rope->buffer_size();
+    }
     case Obj::ObjType::Upvalue: return sizeof(ObjUpvalue);
     case Obj::ObjType::Class: return sizeof(ObjClass);
     case Obj::ObjType::Instance: return sizeof(ObjInstance);
+    case Obj::ObjType::List: return sizeof(ObjList);
     case Obj::ObjType::BoundMethod: return sizeof(ObjBoundMethod);
+    case Obj::ObjType::Coroutine: return sizeof(ObjCoroutine);
     }
 }
 
@@ -141,7 +306,7 @@ auto mark_object(Obj * obj) -> void
         );
     }
     obj->mark();
-    g_vm.gray_objects.insert(obj);
+    g_vm->gray_objects.insert(obj);
 }
 
 auto mark_value(const Value & value) -> void
@@ -177,15 +342,28 @@ auto blacken_object(Obj * obj) -> void
         for (const auto & value : function->get_chunk().constants) {
             mark_value(value);
         }
+        mark_object(function->get_shared_closure());
         break;
     }
     case Obj::ObjType::Native:
     case Obj::ObjType::String: break;
-    case Obj::ObjType::Upvalue: mark_value(*dynamic_cast<ObjUpvalue *>(obj)->location()); break;
+    case Obj::ObjType::Rope: {
+        auto * rope = dynamic_cast<ObjRope *>(obj);
+        mark_object(rope->left());
+        mark_object(rope->right());
+        break;
+    }
+    case Obj::ObjType::Upvalue: {
+        auto * upvalue = dynamic_cast<ObjUpvalue *>(obj);
+        mark_value(*upvalue->location());
+        mark_object(upvalue->get_coroutine());
+        break;
+    }
     case Obj::ObjType::Class: {
         auto * cls = dynamic_cast<ObjClass *>(obj);
         mark_object(cls->get_name());
-        for (const auto & [_, value] : cls->all_methods()) {
+        for (const auto & [name, value] : cls->all_methods()) {
+            mark_object(name);
             mark_value(value);
         }
         break;
@@ -193,7 +371,14 @@ auto blacken_object(Obj * obj) -> void
     case Obj::ObjType::Instance: {
         auto * instance = dynamic_cast<ObjInstance *>(obj);
         mark_object(instance->get_class());
-        for (const auto & [_, value] : instance->all_fields()) {
+        for (const auto & [name, value] : instance->all_fields()) {
+            mark_object(name);
+            mark_value(value);
+        }
+        break;
+    }
+    case Obj::ObjType::List: {
+        for (const auto & value : dynamic_cast<ObjList *>(obj)->elements()) {
             mark_value(value);
         }
         break;
@@ -204,6 +389,21 @@ auto blacken_object(Obj * obj) -> void
         mark_object(bound_method->get_method());
         break;
     }
+    case Obj::ObjType::Coroutine: {
+        // stacks of its resumer while it runs, which are roots as well
+        auto * coroutine = dynamic_cast<ObjCoroutine *>(obj);
+        mark_object(coroutine->get_resumer());
+        for (const auto & value : coroutine->stack()) {
+            mark_value(value);
+        }
+        for (const auto & frame : coroutine->frames()) {
+            mark_object(frame.closure);
+        }
+        for (auto * upvalue : coroutine->open_upvalues()) {
+            mark_object(upvalue);
+        }
+        break;
+    }
     }
 }
 
@@ -219,31 +419,42 @@ auto mark_compiler_roots() -> void
 
 auto mark_roots() -> void
 {
-    for (const auto & value : g_vm.stack) {
+    for (const auto & value : g_vm->stack) {
         mark_value(value);
     }
 
-    for (const auto & frame : g_vm.frames) {
+    for (const auto & frame : g_vm->frames) {
         mark_object(frame.closure);
     }
 
-    for (ObjUpvalue * upvalue = g_vm.open_upvalues; upvalue != nullptr; upvalue = upvalue->next()) {
+    for (auto * upvalue : g_vm->open_upvalues) {
         mark_object(upvalue);
     }
 
-    for (const auto & [_, value] : g_vm.globals) {
+    for (const auto & [name, value] : g_vm->globals) {
+        mark_object(name);
         mark_value(value);
     }
 
+    for (auto * obj : g_vm->host_roots) {
+        mark_object(obj);
+    }
+
+    mark_object(g_vm->coroutine);
+
+    for (const auto & [id, callback] : g_vm->events.callbacks()) {
+        mark_value(callback);
+    }
+
     mark_compiler_roots();
 }
 
 auto trace_references() -> void
 {
-    while (!g_vm.gray_objects.empty()) {
-        auto it = g_vm.gray_objects.begin();
+    while (!g_vm->gray_objects.empty()) {
+        auto it = g_vm->gray_objects.begin();
         Obj * obj = *it;
-        g_vm.gray_objects.erase(it);
+        g_vm->gray_objects.erase(it);
 
         blacken_object(obj);
     }
@@ -252,7 +463,7 @@ auto trace_references() -> void
 auto sweep() -> void
 {
     std::vector<Obj *> new_objects;
-    for (auto * obj : g_vm.objects) {
+    for (auto * obj : g_vm->objects) {
         if (obj->is_marked()) {
             obj->clear_mark();
             new_objects.push_back(obj);
@@ -261,7 +472,7 @@ auto sweep() -> void
             release_object(obj);
         }
     }
-    g_vm.objects = std::move(new_objects);
+    g_vm->objects = std::move(new_objects);
 }
 
 auto collect_garbage() -> void
@@ -270,22 +481,22 @@ auto collect_garbage() -> void
         std::println("-- gc begin");
     }
 
-    std::size_t before = g_vm.bytes_allocated;
+    std::size_t before = g_vm->bytes_allocated;
 
     mark_roots();
     trace_references();
     sweep();
 
-    g_vm.next_gc = g_vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    g_vm->next_gc = g_vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
 
     if constexpr (DEBUG_LOG_GC) {
         std::println("-- gc end");
         std::println(
                 "   collected {} bytes (from {} to {}), next gc at {}",
-                before - g_vm.bytes_allocated,
+                before - g_vm->bytes_allocated,
                 before,
-                g_vm.bytes_allocated,
-                g_vm.next_gc
+                g_vm->bytes_allocated,
+                g_vm->next_gc
         );
     }
 }
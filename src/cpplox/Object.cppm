@@ -5,31 +5,129 @@ import std;
 export import :Obj;
 
 import :Chunk;
+import :CodeArena;
+import :Compiler;
 import :EnumFormatter;
+import :Jit;
+import :Runtime;
 import :Value;
+import :ValueStack;
 
 namespace cpplox {
 
-export class ObjString : public Obj
+// Characters are stored right after the object, in the same allocation
+export class ObjString final : public Obj
 {
 public:
-    static auto create(std::string data) -> ObjString *;
+    static auto create(std::string_view data) -> ObjString *;
+
+    // Concatenation of `parts`, written straight into the new string
+    static auto concatenate(std::span<const std::string_view> parts) -> ObjString *;
+
+    // Pairs with the allocation in concatenate(), size of the object is not known statically
+    static auto operator delete(void * ptr) -> void;
 
 public:
-    [[nodiscard]] constexpr auto data() const -> const std::string & { return m_data; }
+    [[nodiscard]] auto data() const -> std::string_view { return {chars(), m_length}; }
+    [[nodiscard]] constexpr auto hash() const -> std::size_t { return m_hash; }
+
+    // FNV-1a, the same for strings and for plain characters looked up in StringMap
+    [[nodiscard]] static auto hash_chars(std::string_view chars) -> std::size_t;
+
+    // Size of a string including its characters
+    [[nodiscard]] static auto allocation_size(std::size_t length) -> std::size_t;
 
 private:
-    explicit ObjString(std::string data)
+    explicit ObjString(std::size_t length)
         : Obj(ObjType::String)
-        , m_data(std::move(data))
+        , m_length(length)
     {
     }
 
-    // TODO: Can we do a flexible array member for this to avoid double indirection?
-    // See: ch. 19 challenges, https://en.wikipedia.org/wiki/Flexible_array_member
-    std::string m_data;
+    [[nodiscard]] auto chars() const -> char *
+    {
+        // NOLINTNEXTLINE(*-pro-type-reinterpret-cast,*-pro-type-const-cast)
+        return reinterpret_cast<char *>(const_cast<ObjString *>(this) + 1);
+    }
+
+    std::size_t m_length;
+    std::size_t m_hash = 0;
 };
 
+// Concatenation of two strings (ObjString or ObjRope), flattened into a buffer once its characters
+// are needed, e.g. for printing or comparison. Strings built piece by piece link ropes instead of
+// copying everything built so far on every step. Strings read while they are built are appended
+// to the buffer of the flattened rope they extend, see flatten().
+export class ObjRope final : public Obj
+{
+public:
+    static auto create(Value left, Value right) -> ObjRope *;
+
+public:
+    [[nodiscard]] constexpr auto length() const -> std::size_t { return m_length; }
+
+    // Both null once flattened, the rope does not keep its parts alive after that
+    [[nodiscard]] constexpr auto left() const -> Obj * { return m_left; }
+    [[nodiscard]] constexpr auto right() const -> Obj * { return m_right; }
+    [[nodiscard]] constexpr auto is_flat() const -> bool { return m_left == nullptr; }
+
+    // Bytes of the buffer allocated when this rope was flattened, 0 if it extends a shared one
+    [[nodiscard]] constexpr auto buffer_size() const -> std::size_t { return m_buffer_size; }
+
+    // Allocates no objects, so it cannot trigger GC and is safe to call anywhere. Characters of a
+    // flattened rope never move, the view stays valid as long as the rope.
+    auto flatten() -> std::string_view;
+
+private:
+    ObjRope(Obj * left, Obj * right, std::size_t length)
+        : Obj(ObjType::Rope)
+        , m_length(length)
+        , m_left(left)
+        , m_right(right)
+    {
+    }
+
+    std::size_t m_length;
+    Obj * m_left;
+    Obj * m_right;
+    std::shared_ptr<std::string> m_flat; // the first `m_length` characters are this rope's
+    std::size_t m_buffer_size = 0;
+};
+
+// Strings are hashed once, by their cached hash. Plain string_views are hashed on lookup.
+struct ObjStringHash
+{
+    using is_transparent = void;
+
+    auto operator()(const ObjString * str) const -> std::size_t { return str->hash(); }
+    auto operator()(std::string_view str) const -> std::size_t
+    {
+        return ObjString::hash_chars(str);
+    }
+};
+
+struct ObjStringEqual
+{
+    using is_transparent = void;
+
+    auto operator()(const ObjString * lhs, const ObjString * rhs) const -> bool
+    {
+        return lhs == rhs || (lhs->hash() == rhs->hash() && lhs->data() == rhs->data());
+    }
+    auto operator()(const ObjString * lhs, std::string_view rhs) const -> bool
+    {
+        return lhs->data() == rhs;
+    }
+    auto operator()(std::string_view lhs, const ObjString * rhs) const -> bool
+    {
+        return lhs == rhs->data();
+    }
+};
+
+// Map keyed by contents of strings. Keys are objects, the owner of the map must mark them for GC.
+export template <class T>
+using StringMap = std::unordered_map<ObjString *, T, ObjStringHash, ObjStringEqual>;
+
 export class ObjUpvalue : public Obj
 {
 public:
@@ -38,15 +136,21 @@ public:
 public:
     [[nodiscard]] constexpr auto location() const -> Value * { return m_location; }
 
-    constexpr auto set_next(ObjUpvalue * next) -> void { m_next = next; }
-    [[nodiscard]] constexpr auto next() const -> ObjUpvalue * { return m_next; }
+    // Owner of the stack an open upvalue points into, null for the stack outside of coroutines.
+    // The coroutine is kept alive as long as the upvalue is open.
+    [[nodiscard]] constexpr auto get_coroutine() const -> ObjCoroutine * { return m_coroutine; }
+    constexpr auto set_coroutine(ObjCoroutine * coroutine) -> void { m_coroutine = coroutine; }
 
     constexpr auto close() -> void
     {
         m_closed = *m_location;
         m_location = &m_closed;
+        m_coroutine = nullptr;
     }
 
+    // The stack slot of an open upvalue has moved, see grow_stack()
+    constexpr auto relocate(Value * location) -> void { m_location = location; }
+
 private:
     explicit ObjUpvalue(Value * location)
         : Obj(ObjType::Upvalue)
@@ -57,7 +161,7 @@ private:
 
     Value * m_location;
     Value m_closed;
-    ObjUpvalue * m_next = nullptr; // intrusive list
+    ObjCoroutine * m_coroutine = nullptr;
 };
 
 export class ObjFunction : public Obj
@@ -83,19 +187,82 @@ public:
         return std::forward<Self>(self).m_upvalue_count;
     }
 
+    // Highest the value stack of its frame gets, calls make room for it up front. Computed by
+    // verify_function().
+    template <class Self> [[nodiscard]] auto max_stack(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_max_stack;
+    }
+
+    // Whether closures declared inside capture any of its locals, returns of functions which do not
+    // skip closing upvalues
+    template <class Self> [[nodiscard]] auto captures_locals(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_captures_locals;
+    }
+
+    // Compiled body, run() executes frames of this function through it if present
+    [[nodiscard]] constexpr auto get_compiled() const -> CompiledFn { return m_compiled; }
+    constexpr auto set_compiled(CompiledFn compiled) -> void { m_compiled = compiled; }
+
+    [[nodiscard]] auto get_jit_code() const -> const JitCode * { return m_jit_code.get(); }
+    auto set_jit_code(std::unique_ptr<JitCode> jit_code) -> void { m_jit_code = std::move(jit_code); }
+
+    template <class Self> [[nodiscard]] auto call_count(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_call_count;
+    }
+
+    template <class Self> [[nodiscard]] auto jit_attempted(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_jit_attempted;
+    }
+
+    // Closure shared by all instantiations of a function without upvalues, they are all the same
+    [[nodiscard]] constexpr auto get_shared_closure() const -> ObjClosure *
+    {
+        return m_shared_closure;
+    }
+    constexpr auto set_shared_closure(ObjClosure * closure) -> void { m_shared_closure = closure; }
+
+    // Set while the body is only skimmed, see compile_lazy_function()
+    [[nodiscard]] auto get_lazy() const -> const LazyFunction * { return m_lazy.get(); }
+    auto set_lazy(std::unique_ptr<LazyFunction> lazy) -> void { m_lazy = std::move(lazy); }
+    auto take_lazy() -> std::unique_ptr<LazyFunction> { return std::move(m_lazy); }
+
+    // Moves chunk and name into `resource` (see CodeArena), the function must be fully compiled
+    auto relocate(std::pmr::memory_resource & resource) -> void;
+
+    // Upper bound of memory needed by relocate()
+    [[nodiscard]] auto relocated_size() const -> std::size_t;
+
 private:
-    explicit ObjFunction(std::string name)
+    explicit ObjFunction(std::string_view name)
         : Obj(ObjType::Function)
-        , m_name(std::move(name))
+        , m_name(name)
     {
     }
 
     std::size_t m_arity = 0;
     std::size_t m_upvalue_count = 0;
+    std::size_t m_max_stack = 0;
+    bool m_captures_locals = false;
     Chunk m_chunk;
-    std::string m_name;
+    std::pmr::string m_name;
+    std::unique_ptr<LazyFunction> m_lazy;
+
+    CompiledFn m_compiled = nullptr;
+    std::unique_ptr<JitCode> m_jit_code;
+    std::size_t m_call_count = 0;
+    bool m_jit_attempted = false;
+
+    ObjClosure * m_shared_closure = nullptr;
 };
 
+// The script and all functions declared in it (recursively), every function is followed by
+// functions declared in it
+auto collect_functions(ObjFunction & script) -> std::vector<ObjFunction *>;
+
 class ObjNative : public Obj
 {
 public:
@@ -114,30 +281,50 @@ private:
     Value::NativeFn m_callable;
 };
 
-export class ObjClosure : public Obj
+// Upvalues are stored right after the object, in the same allocation
+export class ObjClosure final : public Obj
 {
 public:
     static auto create(ObjFunction * function) -> ObjClosure *;
 
+    // Pairs with the allocation in create(), size of the object is not known statically
+    static auto operator delete(void * ptr) -> void;
+
 public:
     [[nodiscard]] constexpr auto get_function() const -> ObjFunction * { return m_function; }
 
-    constexpr auto add_upvalue(ObjUpvalue * upvalue) -> void { m_upvalues.push_back(upvalue); }
+    // Upvalues are null until set, i.e. while the Closure instruction is capturing them
+    [[nodiscard]] auto upvalues() const -> std::span<ObjUpvalue * const>
+    {
+        return {upvalue_storage(), m_upvalue_count};
+    }
 
-    [[nodiscard]] constexpr auto upvalues() const -> std::span<ObjUpvalue * const>
+    auto set_upvalue(std::size_t index, ObjUpvalue * upvalue) -> void
     {
-        return m_upvalues;
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        upvalue_storage()[index] = upvalue;
     }
 
+    // Size of a closure including its upvalues
+    [[nodiscard]] static auto allocation_size(std::size_t upvalue_count) -> std::size_t;
+
 private:
-    explicit ObjClosure(ObjFunction * function)
+    explicit ObjClosure(ObjFunction * function, std::size_t upvalue_count)
         : Obj(ObjType::Closure)
         , m_function(function)
+        , m_upvalue_count(upvalue_count)
+    {
+        std::ranges::fill_n(upvalue_storage(), static_cast<std::ptrdiff_t>(upvalue_count), nullptr);
+    }
+
+    [[nodiscard]] auto upvalue_storage() const -> ObjUpvalue **
     {
+        // NOLINTNEXTLINE(*-pro-type-reinterpret-cast,*-pro-type-const-cast)
+        return reinterpret_cast<ObjUpvalue **>(const_cast<ObjClosure *>(this) + 1);
     }
 
     ObjFunction * m_function;
-    std::vector<ObjUpvalue *> m_upvalues;
+    std::size_t m_upvalue_count;
 };
 
 export class ObjClass : public Obj
@@ -148,7 +335,7 @@ public:
 public:
     [[nodiscard]] constexpr auto get_name() const -> ObjString * { return m_name; }
 
-    [[nodiscard]] constexpr auto get_method(const std::string & name) -> std::optional<Value>
+    [[nodiscard]] auto get_method(ObjString * name) const -> std::optional<Value>
     {
         auto it = m_methods.find(name);
         if (it != m_methods.end()) {
@@ -157,22 +344,23 @@ public:
         return std::nullopt;
     }
 
-    constexpr auto add_method(const std::string & name, Value method) -> void
+    // For names which are not strings yet, e.g. "init"
+    [[nodiscard]] auto get_method(std::string_view name) const -> std::optional<Value>
     {
         auto it = m_methods.find(name);
         if (it != m_methods.end()) {
-            it->second = method;
-        }
-        else {
-            m_methods.emplace(name, method);
+            return it->second;
         }
+        return std::nullopt;
     }
 
-    [[nodiscard]] constexpr auto all_methods() const -> std::unordered_map<std::string, Value>
+    auto add_method(ObjString * name, Value method) -> void
     {
-        return m_methods;
+        m_methods.insert_or_assign(name, method);
     }
 
+    [[nodiscard]] auto all_methods() const -> const StringMap<Value> & { return m_methods; }
+
 private:
     explicit ObjClass(ObjString * name)
         : Obj(ObjType::Class)
@@ -181,7 +369,7 @@ private:
     }
 
     ObjString * m_name; // TODO: somehow use string_view into source code instead?
-    std::unordered_map<std::string, Value> m_methods;
+    StringMap<Value> m_methods;
 };
 
 export class ObjInstance : public Obj
@@ -192,7 +380,7 @@ public:
 public:
     [[nodiscard]] constexpr auto get_class() const -> ObjClass * { return m_class; }
 
-    [[nodiscard]] constexpr auto get_field(const std::string & name) const -> std::optional<Value>
+    [[nodiscard]] auto get_field(ObjString * name) const -> std::optional<Value>
     {
         auto it = m_fields.find(name);
         if (it != m_fields.end()) {
@@ -201,21 +389,12 @@ public:
         return std::nullopt;
     }
 
-    constexpr auto set_field(const std::string & name, Value value) -> void
+    auto set_field(ObjString * name, Value value) -> void
     {
-        auto it = m_fields.find(name);
-        if (it != m_fields.end()) {
-            it->second = value;
-        }
-        else {
-            m_fields.emplace(name, value);
-        }
+        m_fields.insert_or_assign(name, value);
     }
 
-    [[nodiscard]] constexpr auto all_fields() const -> std::unordered_map<std::string, Value>
-    {
-        return m_fields;
-    }
+    [[nodiscard]] auto all_fields() const -> const StringMap<Value> & { return m_fields; }
 
 private:
     explicit ObjInstance(ObjClass * cls)
@@ -225,7 +404,29 @@ private:
     }
 
     ObjClass * m_class;
-    std::unordered_map<std::string, Value> m_fields;
+    StringMap<Value> m_fields;
+};
+
+// Values stored contiguously, the buffer grows geometrically as elements are appended
+export class ObjList final : public Obj
+{
+public:
+    static auto create(std::span<const Value> elements) -> ObjList *;
+
+public:
+    template <class Self> [[nodiscard]] auto elements(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_elements;
+    }
+
+private:
+    explicit ObjList(std::span<const Value> elements)
+        : Obj(ObjType::List)
+        , m_elements(elements.begin(), elements.end())
+    {
+    }
+
+    std::vector<Value> m_elements;
 };
 
 export class ObjBoundMethod : public Obj
@@ -249,4 +450,72 @@ private:
     ObjClosure * m_method;
 };
 
+export struct CallFrame
+{
+    ObjClosure * closure;
+    const Byte * ip;
+    Value * slots;                 // TODO: std::span? or store offset?
+    CompiledFn compiled = nullptr; // run() hands the frame over to it if present
+    std::size_t elided = 0;        // frames of callers replaced by tail calls
+};
+
+// Call running on a value stack and call frames of its own, see resume_coroutine(). Stacks are
+// swapped with the ones of the VM while it runs, so it holds the stacks of its resumer then.
+export class ObjCoroutine final : public Obj
+{
+public:
+    enum class State : std::uint8_t
+    {
+        Created,   // the call is on the stack, not made yet
+        Suspended, // by yield()
+        Running,   // or waiting for a coroutine it has resumed
+        Done,      // returned or failed, the stacks are empty
+    };
+
+    // `call` is the callee followed by its arguments
+    static auto create(std::span<const Value> call) -> ObjCoroutine *;
+
+public:
+    [[nodiscard]] constexpr auto get_state() const -> State { return m_state; }
+    constexpr auto set_state(State state) -> void { m_state = state; }
+
+    // Coroutine which has resumed this one while it runs, null if it was resumed outside of them
+    [[nodiscard]] constexpr auto get_resumer() const -> ObjCoroutine * { return m_resumer; }
+    constexpr auto set_resumer(ObjCoroutine * resumer) -> void { m_resumer = resumer; }
+
+    template <class Self> [[nodiscard]] auto frames(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_frames;
+    }
+
+    template <class Self> [[nodiscard]] auto stack(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_stack;
+    }
+
+    template <class Self> [[nodiscard]] auto open_upvalues(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_open_upvalues;
+    }
+
+    template <class Self> [[nodiscard]] auto open_upvalue_count(this Self && self) -> auto &&
+    {
+        return std::forward<Self>(self).m_open_upvalue_count;
+    }
+
+private:
+    explicit ObjCoroutine(std::span<const Value> call)
+        : Obj(ObjType::Coroutine)
+        , m_stack(call)
+    {
+    }
+
+    State m_state = State::Created;
+    ObjCoroutine * m_resumer = nullptr;
+    std::vector<CallFrame> m_frames;
+    ValueStack m_stack;
+    std::vector<ObjUpvalue *> m_open_upvalues;
+    std::size_t m_open_upvalue_count = 0;
+};
+
 } // namespace cpplox
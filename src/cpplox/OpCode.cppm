@@ -21,15 +21,20 @@ export enum class OpCode : Byte {
     Nil,
     True,
     False,
+    List,
     // Value manipulators
     Pop,
     DefineGlobal,
     GetGlobal,
+    GetIndex,
     GetLocal,
     GetProperty,
+    GetMethod,
     GetSuper,
+    GetSuperMethod,
     GetUpvalue,
     SetGlobal,
+    SetIndex,
     SetLocal,
     SetProperty,
     SetUpvalue,
@@ -39,6 +44,7 @@ export enum class OpCode : Byte {
     Less,
     // Binary ops
     Add,
+    Concat,
     Substract,
     Multiply,
     Divide,
@@ -51,6 +57,8 @@ export enum class OpCode : Byte {
     JumpIfFalse,
     Loop,
     Call,
+    CallMethod,
+    TailCall,
     Invoke,
     SuperInvoke,
     Closure,
@@ -0,0 +1,89 @@
+export module cpplox:Runtime;
+
+import std;
+
+import :Obj;
+import :OpCode;
+
+namespace cpplox {
+
+// Outcome of an instruction executed by compiled code (see Jit) instead of run().
+export enum class RunStatus : std::uint32_t {
+    Next,   // continue with the following instruction
+    Branch, // conditional jump is taken
+    Switch, // a frame was pushed or popped, continue in run()
+    Error,  // runtime error was reported
+    Halt,   // script returned
+};
+
+// Native body of a function. Runs the frame on top of the call stack starting from `ip`, until the
+// frame changes or an error occurs.
+export using CompiledFn = RunStatus (*)(ObjFunction & function, const Byte * ip);
+
+// Executes an instruction starting at `ip`, operands are decoded from the code itself
+export using RuntimeFn = RunStatus (*)(const Byte * ip);
+
+export struct RuntimeEntry
+{
+    RuntimeFn fn;
+    std::string_view name;
+};
+
+// Entry point for an instruction. Jumps have no entry point, compiled code handles them by itself
+// (with help of `runtime::branch_if_false`).
+export auto runtime_entry(OpCode op) -> std::optional<RuntimeEntry>;
+
+export namespace runtime {
+
+auto op_constant(const Byte * ip) -> RunStatus;
+auto op_nil(const Byte * ip) -> RunStatus;
+auto op_true(const Byte * ip) -> RunStatus;
+auto op_false(const Byte * ip) -> RunStatus;
+auto op_list(const Byte * ip) -> RunStatus;
+auto op_pop(const Byte * ip) -> RunStatus;
+auto op_define_global(const Byte * ip) -> RunStatus;
+auto op_get_global(const Byte * ip) -> RunStatus;
+auto op_get_index(const Byte * ip) -> RunStatus;
+auto op_get_local(const Byte * ip) -> RunStatus;
+auto op_get_property(const Byte * ip) -> RunStatus;
+auto op_get_method(const Byte * ip) -> RunStatus;
+auto op_get_super(const Byte * ip) -> RunStatus;
+auto op_get_super_method(const Byte * ip) -> RunStatus;
+auto op_get_upvalue(const Byte * ip) -> RunStatus;
+auto op_set_global(const Byte * ip) -> RunStatus;
+auto op_set_index(const Byte * ip) -> RunStatus;
+auto op_set_local(const Byte * ip) -> RunStatus;
+auto op_set_property(const Byte * ip) -> RunStatus;
+auto op_set_upvalue(const Byte * ip) -> RunStatus;
+auto op_equal(const Byte * ip) -> RunStatus;
+auto op_greater(const Byte * ip) -> RunStatus;
+auto op_less(const Byte * ip) -> RunStatus;
+auto op_add(const Byte * ip) -> RunStatus;
+auto op_concat(const Byte * ip) -> RunStatus;
+auto op_substract(const Byte * ip) -> RunStatus;
+auto op_multiply(const Byte * ip) -> RunStatus;
+auto op_divide(const Byte * ip) -> RunStatus;
+auto op_not(const Byte * ip) -> RunStatus;
+auto op_negate(const Byte * ip) -> RunStatus;
+auto op_print(const Byte * ip) -> RunStatus;
+auto op_call(const Byte * ip) -> RunStatus;
+auto op_call_method(const Byte * ip) -> RunStatus;
+auto op_tail_call(const Byte * ip) -> RunStatus;
+auto op_invoke(const Byte * ip) -> RunStatus;
+auto op_super_invoke(const Byte * ip) -> RunStatus;
+auto op_closure(const Byte * ip) -> RunStatus;
+auto op_close_upvalue(const Byte * ip) -> RunStatus;
+auto op_return(const Byte * ip) -> RunStatus;
+auto op_class(const Byte * ip) -> RunStatus;
+auto op_inherit(const Byte * ip) -> RunStatus;
+auto op_method(const Byte * ip) -> RunStatus;
+
+// Returns Branch if JumpIfFalse at `ip` should jump
+auto branch_if_false(const Byte * ip) -> RunStatus;
+
+// Start of the function's bytecode, compiled code addresses instructions relative to it
+auto code_start(const ObjFunction & function) -> const Byte *;
+
+} // namespace runtime
+
+} // namespace cpplox
@@ -1,3 +1,10 @@
+module;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define CPPLOX_SCANNER_SIMD 1
+#endif
+
 module cpplox;
 
 import std;
@@ -7,8 +14,8 @@ import :SourceLocation;
 
 namespace cpplox {
 
-// FIXME: get rid of singleton instance
-Scanner g_scanner; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// Source being scanned on the current thread
+thread_local Scanner g_scanner; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 namespace {
 
@@ -20,7 +27,6 @@ auto is_at_end() -> bool { return g_scanner.current >= g_scanner.source.length()
 auto advance() -> char
 {
     g_scanner.current++;
-    g_scanner.sloc.column++;
     return g_scanner.source[g_scanner.current - 1];
 }
 
@@ -28,7 +34,7 @@ auto peek() -> char { return g_scanner.source[g_scanner.current]; }
 
 auto peek_next() -> char
 {
-    if (is_at_end()) {
+    if (g_scanner.current + 1 >= g_scanner.source.length()) {
         return '\0';
     }
     return g_scanner.source[g_scanner.current + 1];
@@ -46,28 +52,163 @@ auto match(char expected) -> bool
     return true;
 }
 
+// `next` is the offset right after the newline character
+auto new_line(std::size_t next) -> void
+{
+    g_scanner.line++;
+    g_scanner.line_start = next;
+}
+
+// *** Skipping runs of characters ***
+
+// Identifiers, blanks, comments and string bodies are skipped a block at a time. Every kind of run
+// knows which characters stop it, both for a whole block and for a single character (used for
+// the tail of the source, shorter than a block).
+
+#if defined(__AVX2__)
+
+using Block = __m256i;
+
+auto load(const char * data) -> Block
+{
+    return _mm256_loadu_si256(reinterpret_cast<const Block *>(data)); // NOLINT
+}
+
+auto splat(char c) -> Block { return _mm256_set1_epi8(c); }
+auto either(Block lhs, Block rhs) -> Block { return _mm256_or_si256(lhs, rhs); }
+auto both(Block lhs, Block rhs) -> Block { return _mm256_and_si256(lhs, rhs); }
+auto equal(Block block, char c) -> Block { return _mm256_cmpeq_epi8(block, splat(c)); }
+auto greater(Block lhs, Block rhs) -> Block { return _mm256_cmpgt_epi8(lhs, rhs); }
+auto to_mask(Block block) -> std::uint32_t
+{
+    return static_cast<std::uint32_t>(_mm256_movemask_epi8(block));
+}
+
+#elif defined(__SSE2__)
+
+using Block = __m128i;
+
+auto load(const char * data) -> Block
+{
+    return _mm_loadu_si128(reinterpret_cast<const Block *>(data)); // NOLINT
+}
+
+auto splat(char c) -> Block { return _mm_set1_epi8(c); }
+auto either(Block lhs, Block rhs) -> Block { return _mm_or_si128(lhs, rhs); }
+auto both(Block lhs, Block rhs) -> Block { return _mm_and_si128(lhs, rhs); }
+auto equal(Block block, char c) -> Block { return _mm_cmpeq_epi8(block, splat(c)); }
+auto greater(Block lhs, Block rhs) -> Block { return _mm_cmpgt_epi8(lhs, rhs); }
+auto to_mask(Block block) -> std::uint32_t
+{
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(block));
+}
+
+#endif
+
+#if defined(CPPLOX_SCANNER_SIMD)
+
+constexpr const std::size_t BLOCK_SIZE = sizeof(Block);
+constexpr const std::uint32_t FULL_MASK
+        = BLOCK_SIZE == 32 ? ~std::uint32_t{0} : (std::uint32_t{1} << BLOCK_SIZE) - 1;
+
+// Comparison is signed, so this only works for ASCII ranges
+auto in_range(Block block, char low, char high) -> Block
+{
+    return both(
+            greater(block, splat(static_cast<char>(low - 1))),
+            greater(splat(static_cast<char>(high + 1)), block)
+    );
+}
+
+// Mask of characters not matched by `block`
+auto not_mask(Block block) -> std::uint32_t { return ~to_mask(block) & FULL_MASK; }
+
+#endif
+
+struct IdentifierRun
+{
+    static auto stops(char c) -> bool { return !is_alpha(c) && !is_digit(c) && c != '_'; }
+#if defined(CPPLOX_SCANNER_SIMD)
+    static auto stops(Block block) -> std::uint32_t
+    {
+        auto letters = either(in_range(block, 'a', 'z'), in_range(block, 'A', 'Z'));
+        return not_mask(either(letters, either(in_range(block, '0', '9'), equal(block, '_'))));
+    }
+#endif
+};
+
+// Newlines are not blank, lines are counted by the caller
+struct BlankRun
+{
+    static auto stops(char c) -> bool { return c != ' ' && c != '\t' && c != '\r'; }
+#if defined(CPPLOX_SCANNER_SIMD)
+    static auto stops(Block block) -> std::uint32_t
+    {
+        return not_mask(either(equal(block, ' '), either(equal(block, '\t'), equal(block, '\r'))));
+    }
+#endif
+};
+
+struct CommentRun
+{
+    static auto stops(char c) -> bool { return c == '\n'; }
+#if defined(CPPLOX_SCANNER_SIMD)
+    static auto stops(Block block) -> std::uint32_t { return to_mask(equal(block, '\n')); }
+#endif
+};
+
+struct StringRun
+{
+    static auto stops(char c) -> bool { return c == '"' || c == '\n'; }
+#if defined(CPPLOX_SCANNER_SIMD)
+    static auto stops(Block block) -> std::uint32_t
+    {
+        return to_mask(either(equal(block, '"'), equal(block, '\n')));
+    }
+#endif
+};
+
+// See set_scanner_simd()
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+constinit thread_local bool t_simd = true;
+
+// Offset of the first character at or after `offset` stopping the run, or the end of the source
+template <class Run> auto skip(std::size_t offset) -> std::size_t
+{
+    const auto source = g_scanner.source;
+#if defined(CPPLOX_SCANNER_SIMD)
+    for (; t_simd && offset + BLOCK_SIZE <= source.length(); offset += BLOCK_SIZE) {
+        if (auto stops = Run::stops(load(&source[offset])); stops != 0) {
+            return offset + static_cast<std::size_t>(std::countr_zero(stops));
+        }
+    }
+#endif
+    while (offset < source.length() && !Run::stops(source[offset])) {
+        offset++;
+    }
+    return offset;
+}
+
+// *** Tokens ***
+
 auto skip_whitespace() -> void
 {
-    while (!is_at_end()) {
-        char c = peek();
-        switch (c) {
+    while (true) {
+        g_scanner.current = skip<BlankRun>(g_scanner.current);
+        if (is_at_end()) {
+            return;
+        }
+
+        switch (peek()) {
         case '\n':
-            // TODO: move line tracking into advance() as well
-            g_scanner.sloc.line++;
-            g_scanner.sloc.column = 0;
-            [[fallthrough]];
-        case ' ':
-        case '\r':
-        case '\t': advance(); break;
+            advance();
+            new_line(g_scanner.current);
+            break;
         case '/':
-            if (peek_next() == '/') {
-                while (!is_at_end() && peek() != '\n') {
-                    advance();
-                }
-            }
-            else {
+            if (peek_next() != '/') {
                 return;
             }
+            g_scanner.current = skip<CommentRun>(g_scanner.current + 2);
             break;
         default: return;
         }
@@ -97,70 +238,76 @@ auto error_token(std::string_view message) -> Token
     };
 }
 
-auto check_keyword(std::string_view keyword, TokenType type) -> TokenType
+struct Keyword
+{
+    std::string_view lexeme;
+    TokenType type = TokenType::Identifier;
+};
+
+constexpr const std::array KEYWORDS = {
+        Keyword{.lexeme = "and", .type = TokenType::And},
+        Keyword{.lexeme = "class", .type = TokenType::Class},
+        Keyword{.lexeme = "else", .type = TokenType::Else},
+        Keyword{.lexeme = "false", .type = TokenType::False},
+        Keyword{.lexeme = "for", .type = TokenType::For},
+        Keyword{.lexeme = "fun", .type = TokenType::Fun},
+        Keyword{.lexeme = "if", .type = TokenType::If},
+        Keyword{.lexeme = "nil", .type = TokenType::Nil},
+        Keyword{.lexeme = "or", .type = TokenType::Or},
+        Keyword{.lexeme = "print", .type = TokenType::Print},
+        Keyword{.lexeme = "return", .type = TokenType::Return},
+        Keyword{.lexeme = "super", .type = TokenType::Super},
+        Keyword{.lexeme = "this", .type = TokenType::This},
+        Keyword{.lexeme = "true", .type = TokenType::True},
+        Keyword{.lexeme = "var", .type = TokenType::Var},
+        Keyword{.lexeme = "while", .type = TokenType::While},
+};
+
+constexpr const std::size_t KEYWORD_TABLE_SIZE = 32;
+
+// Perfect hash for KEYWORDS: every keyword gets its own slot, see generate_keyword_table()
+constexpr auto keyword_hash(std::string_view lexeme) -> std::size_t
 {
-    if (get_lexeme() == keyword) {
-        return type;
+    auto first = static_cast<unsigned char>(lexeme.front());
+    auto last = static_cast<unsigned char>(lexeme.back());
+    return (first + 5 * last + lexeme.length()) % KEYWORD_TABLE_SIZE;
+}
+
+consteval auto generate_keyword_table() -> std::array<Keyword, KEYWORD_TABLE_SIZE>
+{
+    std::array<Keyword, KEYWORD_TABLE_SIZE> table{};
+    for (const auto & keyword : KEYWORDS) {
+        auto & slot = table.at(keyword_hash(keyword.lexeme));
+        if (!slot.lexeme.empty()) {
+            throw "keyword_hash() has collisions"; // fails compilation
+        }
+        slot = keyword;
     }
-    return TokenType::Identifier;
+    return table;
 }
 
+constinit const auto g_keyword_table = generate_keyword_table();
+
 auto identifier_type() -> TokenType
 {
-    using enum TokenType;
     auto lexeme = get_lexeme();
-    switch (lexeme[0]) {
-    case 'a': return check_keyword("and", And);
-    case 'c': return check_keyword("class", Class);
-    case 'e': return check_keyword("else", Else);
-    case 'f':
-        if (lexeme.length() > 1) {
-            switch (lexeme[1]) {
-            case 'a': return check_keyword("false", False);
-            case 'o': return check_keyword("for", For);
-            case 'u': return check_keyword("fun", Fun);
-            default: return Identifier;
-            }
-        }
-        return Identifier;
-    case 'i': return check_keyword("if", If);
-    case 'n': return check_keyword("nil", Nil);
-    case 'o': return check_keyword("or", Or);
-    case 'p': return check_keyword("print", Print);
-    case 'r': return check_keyword("return", Return);
-    case 's': return check_keyword("super", Super);
-    case 't':
-        if (lexeme.length() > 1) {
-            switch (lexeme[1]) {
-            case 'h': return check_keyword("this", This);
-            case 'r': return check_keyword("true", True);
-            default: return Identifier;
-            }
-        }
-        return Identifier;
-    case 'v': return check_keyword("var", Var);
-    case 'w': return check_keyword("while", While);
-    default: return Identifier;
-    }
-    std::unreachable();
+    // Empty slots never match, lexeme is never empty
+    const auto & keyword = g_keyword_table[keyword_hash(lexeme)];
+    return keyword.lexeme == lexeme ? keyword.type : TokenType::Identifier;
 }
 
 auto string() -> Token
 {
-    while (!is_at_end() && peek() != '"') {
-        if (peek() == '\n') {
-            g_scanner.sloc.line++;
-            g_scanner.sloc.column = 0;
+    while (true) {
+        g_scanner.current = skip<StringRun>(g_scanner.current);
+        if (is_at_end()) {
+            return error_token("Unterminated string.");
         }
-        advance();
-    }
-
-    if (is_at_end()) {
-        return error_token("Unterminated string.");
+        if (advance() == '"') {
+            return make_token(TokenType::String);
+        }
+        new_line(g_scanner.current);
     }
-
-    advance(); // consume closing quote
-    return make_token(TokenType::String);
 }
 
 auto number() -> Token
@@ -182,24 +329,25 @@ auto number() -> Token
 
 auto identifier() -> Token
 {
-    while (!is_at_end() && (is_alpha(peek()) || is_digit(peek()) || peek() == '_')) {
-        advance();
-    }
+    g_scanner.current = skip<IdentifierRun>(g_scanner.current);
     return make_token(identifier_type());
 }
 
 } // namespace
 
-auto init_scanner(std::string_view source) -> void
+auto init_scanner(std::string_view source, std::size_t offset, SourceLocation sloc) -> void
 {
     g_scanner.source = source;
-    g_scanner.start = 0;
-    g_scanner.current = 0;
+    g_scanner.start = offset;
+    g_scanner.current = offset;
 
-    g_scanner.start_sloc = {.line = 1, .column = 1};
-    g_scanner.sloc = {.line = 1, .column = 1};
+    g_scanner.start_sloc = sloc;
+    g_scanner.line = sloc.line;
+    g_scanner.line_start = offset - (sloc.column - 1);
 }
 
+auto set_scanner_simd(bool enabled) -> void { t_simd = enabled; }
+
 auto scan_token() -> Token
 {
     using enum TokenType;
@@ -207,7 +355,10 @@ auto scan_token() -> Token
     skip_whitespace();
 
     g_scanner.start = g_scanner.current;
-    g_scanner.start_sloc = g_scanner.sloc;
+    g_scanner.start_sloc = {
+            .line = g_scanner.line,
+            .column = g_scanner.current - g_scanner.line_start + 1,
+    };
     if (is_at_end()) {
         return make_token(EndOfFile);
     }
@@ -225,6 +376,8 @@ auto scan_token() -> Token
     case ')': return make_token(RightParenthesis);
     case '{': return make_token(LeftBrace);
     case '}': return make_token(RightBrace);
+    case '[': return make_token(LeftBracket);
+    case ']': return make_token(RightBracket);
     case ';': return make_token(Semicolon);
     case ',': return make_token(Comma);
     case '.': return make_token(Dot);
@@ -13,10 +13,22 @@ export struct Scanner
     std::size_t start;
     std::size_t current;
     SourceLocation start_sloc;
-    SourceLocation sloc;
+    // Columns are not counted per character, they are offsets from the start of the line
+    std::size_t line;
+    std::size_t line_start;
 };
 
-export auto init_scanner(std::string_view source) -> void;
+// Scanning may start in the middle of the source, e.g. at a lazily compiled function
+export auto init_scanner(
+        std::string_view source,
+        std::size_t offset = 0,
+        SourceLocation sloc = {.line = 1, .column = 1}
+) -> void;
 export auto scan_token() -> Token;
 
+// Runs of characters (e.g. identifiers and comments) are skipped a SIMD block at a time if the
+// target has SIMD instructions. Turning it off on the current thread is meant for tests comparing
+// tokens with those scanned a character at a time.
+export auto set_scanner_simd(bool enabled) -> void;
+
 } // namespace cpplox
@@ -0,0 +1,243 @@
+module cpplox;
+
+import std;
+
+import :Compiler;
+import :Object;
+import :Snapshot;
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+namespace {
+
+// Objects are created empty first and filled in afterwards, so that cycles (e.g. a class whose
+// methods refer to it through a global) are copied once
+class HeapCopier
+{
+public:
+    explicit HeapCopier(VirtualMachine & from)
+        : m_from(from)
+    {
+    }
+
+    auto copy(Value value) -> Value
+    {
+        return value.is_obj() ? Value::obj(copy(value.as_obj())) : value;
+    }
+
+    template <std::derived_from<Obj> T> auto copy(T * obj) -> T *
+    {
+        if (obj == nullptr) {
+            return nullptr;
+        }
+        if (auto it = m_copies.find(obj); it != m_copies.end()) {
+            return dynamic_cast<T *>(it->second);
+        }
+        auto * created = create(obj);
+        m_copies.emplace(obj, created);
+        m_pending.emplace_back(obj, created);
+        return dynamic_cast<T *>(created);
+    }
+
+    // Fills in objects created so far, which creates more of them
+    auto fill_pending() -> void
+    {
+        while (!m_pending.empty()) {
+            auto [original, created] = m_pending.back();
+            m_pending.pop_back();
+            fill(*original, *created);
+        }
+    }
+
+    [[nodiscard]] auto functions() const -> std::span<ObjFunction * const> { return m_functions; }
+
+private:
+    auto create(Obj * obj) -> Obj *
+    {
+        switch (obj->get_type()) {
+        case Obj::ObjType::String: {
+            return ObjString::create(dynamic_cast<ObjString *>(obj)->data());
+        }
+        case Obj::ObjType::Rope: {
+            // flattening accounts the characters to the current VM
+            auto * current = std::exchange(g_vm, &m_from);
+            auto chars = dynamic_cast<ObjRope *>(obj)->flatten();
+            g_vm = current;
+            return ObjString::create(chars);
+        }
+        case Obj::ObjType::Upvalue: {
+            auto * upvalue = ObjUpvalue::create(&m_closed);
+            upvalue->close();
+            return upvalue;
+        }
+        case Obj::ObjType::Function: {
+            auto * function = ObjFunction::create(
+                    std::string{dynamic_cast<ObjFunction *>(obj)->get_name()}
+            );
+            m_functions.push_back(function);
+            return function;
+        }
+        case Obj::ObjType::Native: {
+            return ObjNative::create(dynamic_cast<ObjNative *>(obj)->get_callable());
+        }
+        case Obj::ObjType::Closure: {
+            return ObjClosure::create(copy(dynamic_cast<ObjClosure *>(obj)->get_function()));
+        }
+        case Obj::ObjType::Class: {
+            return ObjClass::create(copy(dynamic_cast<ObjClass *>(obj)->get_name()));
+        }
+        case Obj::ObjType::Instance: {
+            return ObjInstance::create(copy(dynamic_cast<ObjInstance *>(obj)->get_class()));
+        }
+        case Obj::ObjType::List: {
+            return ObjList::create({});
+        }
+        case Obj::ObjType::BoundMethod: {
+            auto * bound_method = dynamic_cast<ObjBoundMethod *>(obj);
+            return ObjBoundMethod::create(
+                    copy(bound_method->get_receiver()), copy(bound_method->get_method())
+            );
+        }
+        case Obj::ObjType::Coroutine: {
+            // frames of started coroutines point into their stacks, those are copied as done
+            auto * coroutine = ObjCoroutine::create({});
+            if (dynamic_cast<ObjCoroutine *>(obj)->get_state() != ObjCoroutine::State::Created) {
+                coroutine->set_state(ObjCoroutine::State::Done);
+            }
+            return coroutine;
+        }
+        }
+        std::unreachable();
+    }
+
+    auto fill(Obj & original, Obj & target) -> void
+    {
+        switch (original.get_type()) {
+        case Obj::ObjType::Upvalue: {
+            *dynamic_cast<ObjUpvalue &>(target).location()
+                    = copy(*dynamic_cast<ObjUpvalue &>(original).location());
+            break;
+        }
+        case Obj::ObjType::Function: {
+            fill_function(
+                    dynamic_cast<ObjFunction &>(original), dynamic_cast<ObjFunction &>(target)
+            );
+            break;
+        }
+        case Obj::ObjType::Closure: {
+            auto & closure = dynamic_cast<ObjClosure &>(target);
+            for (auto [index, upvalue] :
+                 std::views::enumerate(dynamic_cast<ObjClosure &>(original).upvalues())) {
+                closure.set_upvalue(static_cast<std::size_t>(index), copy(upvalue));
+            }
+            break;
+        }
+        case Obj::ObjType::Class: {
+            auto & cls = dynamic_cast<ObjClass &>(target);
+            for (const auto & [name, method] : dynamic_cast<ObjClass &>(original).all_methods()) {
+                cls.add_method(copy(name), copy(method));
+            }
+            break;
+        }
+        case Obj::ObjType::Instance: {
+            auto & instance = dynamic_cast<ObjInstance &>(target);
+            for (const auto & [name, value] : dynamic_cast<ObjInstance &>(original).all_fields()) {
+                instance.set_field(copy(name), copy(value));
+            }
+            break;
+        }
+        case Obj::ObjType::List: {
+            auto & list = dynamic_cast<ObjList &>(target);
+            for (auto value : dynamic_cast<ObjList &>(original).elements()) {
+                list.elements().push_back(copy(value));
+            }
+            break;
+        }
+        case Obj::ObjType::Coroutine: {
+            auto & coroutine = dynamic_cast<ObjCoroutine &>(target);
+            if (coroutine.get_state() == ObjCoroutine::State::Created) {
+                const auto & stack = dynamic_cast<ObjCoroutine &>(original).stack();
+                coroutine.stack().reserve(stack.size());
+                for (auto value : stack) {
+                    coroutine.stack().push(copy(value));
+                }
+            }
+            break;
+        }
+        case Obj::ObjType::String:
+        case Obj::ObjType::Rope:
+        case Obj::ObjType::Native:
+        case Obj::ObjType::BoundMethod: break; // complete once created
+        }
+    }
+
+    auto fill_function(ObjFunction & original, ObjFunction & function) -> void
+    {
+        function.arity() = original.arity();
+        function.upvalue_count() = original.upvalue_count();
+        function.max_stack() = original.max_stack();
+        function.captures_locals() = original.captures_locals();
+
+        auto & chunk = function.get_chunk();
+        chunk.code.assign(original.get_chunk().code.begin(), original.get_chunk().code.end());
+        chunk.locations = original.get_chunk().locations;
+        for (auto constant : original.get_chunk().constants) {
+            chunk.constants.push_back(copy(constant));
+        }
+
+        if (const auto * lazy = original.get_lazy(); lazy != nullptr) {
+            function.set_lazy(std::make_unique<LazyFunction>(*lazy));
+        }
+        // JIT-compiled code is compiled again once the copy gets hot, ahead of time compiled code
+        // is not tied to the VM
+        if (original.get_jit_code() == nullptr) {
+            function.set_compiled(original.get_compiled());
+        }
+        function.set_shared_closure(copy(original.get_shared_closure()));
+    }
+
+    VirtualMachine & m_from;
+    std::unordered_map<Obj *, Obj *> m_copies;
+    std::vector<std::pair<Obj *, Obj *>> m_pending;
+    std::vector<ObjFunction *> m_functions;
+    Value m_closed = Value::nil(); // initial location of copied upvalues
+};
+
+auto copy_heap(VirtualMachine & from, bool with_globals, std::span<const Value> values)
+        -> std::vector<Value>
+{
+    // Copies are only reachable from the copier until they are stored into globals
+    auto next_gc = std::exchange(g_vm->next_gc, std::numeric_limits<std::size_t>::max());
+
+    HeapCopier copier{from};
+    if (with_globals) {
+        for (const auto & [name, value] : from.globals) {
+            g_vm->globals.insert_or_assign(copier.copy(name), copier.copy(value));
+        }
+    }
+    std::vector<Value> copies;
+    for (auto value : values) {
+        copies.push_back(copier.copy(value));
+    }
+    copier.fill_pending();
+    freeze_functions(copier.functions());
+
+    g_vm->next_gc = std::max(next_gc, g_vm->bytes_allocated);
+    return copies;
+}
+
+} // namespace
+
+auto copy_globals(VirtualMachine & from, std::span<const Value> values) -> std::vector<Value>
+{
+    return copy_heap(from, /* with_globals = */ true, values);
+}
+
+auto copy_values(VirtualMachine & from, std::span<const Value> values) -> std::vector<Value>
+{
+    return copy_heap(from, /* with_globals = */ false, values);
+}
+
+} // namespace cpplox
@@ -0,0 +1,23 @@
+export module cpplox:Snapshot;
+
+import std;
+
+import :Value;
+import :VirtualMachine;
+
+namespace cpplox {
+
+// Copies globals of `from` into the current VM, along with every object reachable from them.
+// Nothing is shared between the two VMs afterwards. Ropes are flattened and copied as strings,
+// otherwise `from` is only read, so several threads may copy a VM without ropes at once.
+// JIT-compiled code is not copied. Upvalues which are still open are copied as closed ones.
+// Coroutines which have started are copied as done ones.
+//
+// `values` are copied along and their copies returned. They are not rooted, GC may collect them at
+// the next allocation.
+auto copy_globals(VirtualMachine & from, std::span<const Value> values = {}) -> std::vector<Value>;
+
+// Same as copy_globals(), without the globals
+auto copy_values(VirtualMachine & from, std::span<const Value> values) -> std::vector<Value>;
+
+} // namespace cpplox
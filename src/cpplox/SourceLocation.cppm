@@ -8,6 +8,8 @@ export struct SourceLocation
 {
     std::size_t line;
     std::size_t column;
+
+    auto operator==(const SourceLocation & other) const -> bool = default;
     // TODO: filename and function/method name
 };
 
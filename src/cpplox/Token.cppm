@@ -13,6 +13,8 @@ export enum class TokenType : std::uint8_t {
     RightParenthesis, // )
     LeftBrace,        // {
     RightBrace,       // }
+    LeftBracket,      // [
+    RightBracket,     // ]
     Comma,            // ,
     Dot,              // .
     Minus,            // -
@@ -1,3 +1,7 @@
+module;
+
+#include <cstddef>
+
 module cpplox;
 
 import std;
@@ -16,9 +20,12 @@ template <Obj::ObjType type> auto value_is_obj_type(Value value) -> bool
 
 } // namespace
 
-auto Value::string(std::string data) -> Value
+auto Value::type_offset() -> std::size_t { return offsetof(Value, m_type); }
+auto Value::payload_offset() -> std::size_t { return offsetof(Value, m_as); }
+
+auto Value::string(std::string_view data) -> Value
 {
-    return {ValueType::Obj, {.obj = ObjString::create(std::move(data))}};
+    return {ValueType::Obj, {.obj = ObjString::create(data)}};
 }
 
 auto Value::upvalue(Value * location) -> Value
@@ -56,7 +63,12 @@ auto Value::bound_method(Value receiver, ObjClosure * method) -> Value
     return {ValueType::Obj, {.obj = ObjBoundMethod::create(receiver, method)}};
 }
 
-auto Value::is_string() const -> bool { return value_is_obj_type<Obj::ObjType::String>(*this); }
+auto Value::is_string() const -> bool
+{
+    return value_is_obj_type<Obj::ObjType::String>(*this) || is_rope();
+}
+
+auto Value::is_rope() const -> bool { return value_is_obj_type<Obj::ObjType::Rope>(*this); }
 
 auto Value::is_upvalue() const -> bool { return value_is_obj_type<Obj::ObjType::Upvalue>(*this); }
 
@@ -71,11 +83,19 @@ auto Value::is_bound_method() const -> bool
     return value_is_obj_type<Obj::ObjType::BoundMethod>(*this);
 }
 
+auto Value::is_coroutine() const -> bool
+{
+    return value_is_obj_type<Obj::ObjType::Coroutine>(*this);
+}
+
+auto Value::is_list() const -> bool { return value_is_obj_type<Obj::ObjType::List>(*this); }
+
 auto Value::is_class() const -> bool { return value_is_obj_type<Obj::ObjType::Class>(*this); }
 
 auto Value::is_instance() const -> bool { return value_is_obj_type<Obj::ObjType::Instance>(*this); }
 
 auto Value::as_objstring() const -> ObjString * { return dynamic_cast<ObjString *>(as_obj()); }
+auto Value::as_objrope() const -> ObjRope * { return dynamic_cast<ObjRope *>(as_obj()); }
 
 auto Value::as_objupvalue() const -> ObjUpvalue * { return dynamic_cast<ObjUpvalue *>(as_obj()); }
 
@@ -100,7 +120,22 @@ auto Value::as_objboundmethod() const -> ObjBoundMethod *
     return dynamic_cast<ObjBoundMethod *>(as_obj());
 }
 
-auto Value::as_string() const -> const std::string & { return as_objstring()->data(); }
+auto Value::as_objcoroutine() const -> ObjCoroutine *
+{
+    return dynamic_cast<ObjCoroutine *>(as_obj());
+}
+
+auto Value::as_objlist() const -> ObjList * { return dynamic_cast<ObjList *>(as_obj()); }
+
+auto Value::as_string() const -> std::string_view
+{
+    return is_rope() ? as_objrope()->flatten() : as_objstring()->data();
+}
+
+auto Value::string_length() const -> std::size_t
+{
+    return is_rope() ? as_objrope()->length() : as_objstring()->data().length();
+}
 
 auto Value::as_native() const -> Value::NativeFn { return as_objnative()->get_callable(); }
 
@@ -115,15 +150,49 @@ auto Value::operator==(const Value & other) const -> bool
     case ValueType::Nil: return true;
     case ValueType::Number: return as_number() == other.as_number();
     case ValueType::Obj:
-        switch (as_obj()->get_type()) {
-        case Obj::ObjType::String: return as_string() == other.as_string();
-        default: return as_obj() == other.as_obj();
+        if (as_obj() == other.as_obj()) {
+            return true;
+        }
+        if (!is_string() || !other.is_string()) {
+            return false;
         }
+        if (!is_rope() && !other.is_rope()) {
+            const auto * lhs = as_objstring();
+            const auto * rhs = other.as_objstring();
+            return lhs->hash() == rhs->hash() && lhs->data() == rhs->data();
+        }
+        return string_length() == other.string_length() && as_string() == other.as_string();
     }
 }
 
 } // namespace cpplox
 
+namespace {
+
+// Lists being formatted on this thread, a list containing itself is printed as [...] there
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local std::vector<const cpplox::ObjList *> t_formatted_lists;
+
+auto format_list(const cpplox::ObjList & list, std::format_context & ctx)
+        -> std::format_context::iterator
+{
+    if (std::ranges::contains(t_formatted_lists, &list)) {
+        return std::format_to(ctx.out(), "[...]");
+    }
+    t_formatted_lists.push_back(&list);
+    auto out = std::format_to(ctx.out(), "[");
+    for (const auto & [index, element] : std::views::enumerate(list.elements())) {
+        if (index > 0) {
+            out = std::format_to(out, ", ");
+        }
+        out = std::format_to(out, "{}", element);
+    }
+    t_formatted_lists.pop_back();
+    return std::format_to(out, "]");
+}
+
+} // namespace
+
 auto std::formatter<cpplox::Value>::format(
         const cpplox::Value & value, std::format_context & ctx
 ) const -> std::format_context::iterator
@@ -136,6 +205,7 @@ auto std::formatter<cpplox::Value>::format(
         return std::format_to(ctx.out(), "{}", value.as_number());
     case cpplox::Value::ValueType::Obj:
         switch (value.as_obj()->get_type()) {
+        case cpplox::Obj::ObjType::Rope:
         case cpplox::Obj::ObjType::String:
             return std::formatter<std::string_view>::format(value.as_string(), ctx);
         case cpplox::Obj::ObjType::Upvalue: return std::format_to(ctx.out(), "upvalue");
@@ -169,6 +239,8 @@ auto std::formatter<cpplox::Value>::format(
             }
             return std::format_to(ctx.out(), "<fn {}>", name);
         }
+        case cpplox::Obj::ObjType::Coroutine: return std::format_to(ctx.out(), "<coroutine>");
+        case cpplox::Obj::ObjType::List: return format_list(*value.as_objlist(), ctx);
         }
     }
 }
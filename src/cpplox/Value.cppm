@@ -40,6 +40,10 @@ private:
 public:
     [[nodiscard]] constexpr auto get_type() const -> ValueType { return m_type; }
 
+    // Where the type and the payload are, for machine code reading values (see Jit)
+    static auto type_offset() -> std::size_t;
+    static auto payload_offset() -> std::size_t;
+
     // Initializers
 
     static auto boolean(bool value) -> Value { return {ValueType::Boolean, {.boolean = value}}; }
@@ -52,7 +56,7 @@ public:
     // behind our Obj * field?
     static auto obj(Obj * obj) -> Value { return {ValueType::Obj, {.obj = obj}}; }
 
-    static auto string(std::string) -> Value;
+    static auto string(std::string_view) -> Value;
     static auto upvalue(Value *) -> Value;
     static auto function(std::string) -> Value;
     static auto closure(ObjFunction *) -> Value;
@@ -70,6 +74,7 @@ public:
     // NOLINTEND(cppcoreguidelines-pro-type-union-access)
 
     [[nodiscard]] auto as_objstring() const -> ObjString *;
+    [[nodiscard]] auto as_objrope() const -> ObjRope *;
     [[nodiscard]] auto as_objupvalue() const -> ObjUpvalue *;
     [[nodiscard]] auto as_objfunction() const -> ObjFunction *;
     [[nodiscard]] auto as_objclosure() const -> ObjClosure *;
@@ -77,8 +82,12 @@ public:
     [[nodiscard]] auto as_objclass() const -> ObjClass *;
     [[nodiscard]] auto as_objinstance() const -> ObjInstance *;
     [[nodiscard]] auto as_objboundmethod() const -> ObjBoundMethod *;
+    [[nodiscard]] auto as_objcoroutine() const -> ObjCoroutine *;
+    [[nodiscard]] auto as_objlist() const -> ObjList *;
 
-    [[nodiscard]] auto as_string() const -> const std::string &;
+    // Flattens ropes, characters stay valid as long as the string object itself
+    [[nodiscard]] auto as_string() const -> std::string_view;
+    [[nodiscard]] auto string_length() const -> std::size_t; // does not flatten ropes
     [[nodiscard]] auto as_native() const -> NativeFn;
 
     // Queries
@@ -90,7 +99,8 @@ public:
     [[nodiscard]] auto is_number() const -> bool { return is(ValueType::Number); }
     [[nodiscard]] auto is_obj() const -> bool { return is(ValueType::Obj); }
 
-    [[nodiscard]] auto is_string() const -> bool;
+    [[nodiscard]] auto is_string() const -> bool; // either ObjString or ObjRope
+    [[nodiscard]] auto is_rope() const -> bool;
     [[nodiscard]] auto is_upvalue() const -> bool;
     [[nodiscard]] auto is_function() const -> bool;
     [[nodiscard]] auto is_closure() const -> bool;
@@ -98,6 +108,8 @@ public:
     [[nodiscard]] auto is_class() const -> bool;
     [[nodiscard]] auto is_instance() const -> bool;
     [[nodiscard]] auto is_bound_method() const -> bool;
+    [[nodiscard]] auto is_coroutine() const -> bool;
+    [[nodiscard]] auto is_list() const -> bool;
 
     auto operator==(const Value & other) const -> bool;
 
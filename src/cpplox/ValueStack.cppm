@@ -0,0 +1,127 @@
+module;
+
+#include <cassert>
+
+export module cpplox:ValueStack;
+
+import std;
+
+import :Value;
+
+namespace cpplox {
+
+// Value stack of a VM or of a coroutine. Unlike std::vector, pushes write through the top pointer
+// without checking for room: the VM makes room once per call for everything the frame pushes (see
+// reserve_stack()), and running out of it is a bug rather than a reason to reallocate behind the
+// back of frames and upvalues pointing into the stack.
+class ValueStack
+{
+public:
+    ValueStack() = default;
+
+    explicit ValueStack(std::span<const Value> values)
+    {
+        reserve(values.size());
+        m_top = std::ranges::copy(values, m_data).out;
+    }
+
+    ValueStack(const ValueStack &) = delete;
+    auto operator=(const ValueStack &) -> ValueStack & = delete;
+
+    ValueStack(ValueStack && other) noexcept
+        : m_data(std::exchange(other.m_data, nullptr))
+        , m_top(std::exchange(other.m_top, nullptr))
+        , m_end(std::exchange(other.m_end, nullptr))
+    {
+    }
+
+    auto operator=(ValueStack && other) noexcept -> ValueStack &
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_top, other.m_top);
+        std::swap(m_end, other.m_end);
+        return *this;
+    }
+
+    ~ValueStack()
+    {
+        if (m_data != nullptr) {
+            std::allocator<Value>{}.deallocate(m_data, capacity());
+        }
+    }
+
+    auto push(Value value) -> void
+    {
+        assert(m_top != m_end && "No room reserved on the value stack");
+        *m_top++ = value; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+
+    auto pop() -> Value
+    {
+        assert(m_top != m_data && "Value stack empty");
+        return *--m_top; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+
+    auto drop(std::size_t count) -> void
+    {
+        assert(size() >= count && "Value stack empty");
+        m_top -= count; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+
+    // Removes the value at `slot`, values above it move down
+    auto erase(Value * slot) -> void
+    {
+        m_top = std::ranges::copy(std::next(slot), m_top, slot).out;
+    }
+
+    auto clear() -> void { m_top = m_data; }
+
+    // Moves the values into a buffer with room for `capacity` values, if this one is smaller.
+    // Pointers into the stack are left dangling, see grow_stack().
+    auto reserve(std::size_t capacity) -> void
+    {
+        if (capacity <= this->capacity()) {
+            return;
+        }
+        auto * data = std::allocator<Value>{}.allocate(capacity);
+        auto * top = std::ranges::copy(m_data, m_top, data).out;
+        if (m_data != nullptr) {
+            std::allocator<Value>{}.deallocate(m_data, this->capacity());
+        }
+        m_data = data;
+        m_top = top;
+        m_end = std::next(data, static_cast<std::ptrdiff_t>(capacity));
+    }
+
+    // Values stay mutable through a const stack, as they do through a const pointer
+    [[nodiscard]] auto data() const -> Value * { return m_data; }
+    [[nodiscard]] auto begin() const -> Value * { return m_data; }
+    [[nodiscard]] auto end() const -> Value * { return m_top; }
+
+    [[nodiscard]] auto operator[](std::size_t slot) const -> Value &
+    {
+        return m_data[slot]; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+    [[nodiscard]] auto front() const -> Value & { return *m_data; }
+    [[nodiscard]] auto back() const -> Value & { return *std::prev(m_top); }
+
+    [[nodiscard]] auto size() const -> std::size_t
+    {
+        return static_cast<std::size_t>(std::distance(m_data, m_top));
+    }
+    [[nodiscard]] auto capacity() const -> std::size_t
+    {
+        return static_cast<std::size_t>(std::distance(m_data, m_end));
+    }
+    [[nodiscard]] auto empty() const -> bool { return m_top == m_data; }
+
+    // JIT-compiled code keeps the top in a register, it stores it here before calling into the VM
+    [[nodiscard]] auto top_address() -> Value ** { return &m_top; }
+
+private:
+    Value * m_data = nullptr;
+    Value * m_top = nullptr;
+    Value * m_end = nullptr;
+};
+
+} // namespace cpplox
@@ -0,0 +1,204 @@
+module cpplox;
+
+import std;
+
+import :Chunk;
+import :Object;
+import :OpCode;
+import :Value;
+import :Verifier;
+
+import magic_enum;
+
+namespace cpplox {
+
+namespace {
+
+class Verifier
+{
+public:
+    explicit Verifier(const ObjFunction & function)
+        : m_function(function)
+        , m_chunk(function.get_chunk())
+        , m_heights(m_chunk.code.size())
+        , m_bytes(m_chunk.code.size(), ByteKind::Unvisited)
+    {
+    }
+
+    // Returns the highest stack height, or nothing if the code is malformed
+    auto run() -> std::optional<std::size_t>
+    {
+        using enum OpCode;
+
+        // frame starts with the callee and its arguments
+        std::size_t max_height = m_function.arity() + 1;
+        if (!visit(0, max_height)) {
+            return std::nullopt;
+        }
+
+        while (!m_pending.empty()) {
+            auto offset = m_pending.back();
+            m_pending.pop_back();
+
+            auto height = m_heights[offset].value();
+            if (!check_instruction(offset, height)) {
+                return std::nullopt;
+            }
+
+            auto [pops, pushes] = stack_effect(m_chunk, offset);
+            if (height < pops) {
+                return std::nullopt;
+            }
+            height = height - pops + pushes;
+            max_height = std::max(max_height, height);
+
+            auto op = static_cast<OpCode>(m_chunk.code[offset]);
+            if (op == Jump || op == JumpIfFalse || op == Loop) {
+                auto target = jump_target(m_chunk, offset);
+                if (!target.has_value() || !visit(target.value(), height)) {
+                    return std::nullopt;
+                }
+            }
+            if (op != Jump && op != Loop && op != Return) {
+                if (!visit(offset + instruction_size(m_chunk, offset), height)) {
+                    return std::nullopt;
+                }
+            }
+        }
+
+        return max_height;
+    }
+
+private:
+    enum class ByteKind : std::uint8_t {
+        Unvisited,
+        Opcode,
+        Operand,
+    };
+
+    // Schedules the instruction at `offset`, reached with `height` values on the stack
+    auto visit(std::size_t offset, std::size_t height) -> bool
+    {
+        if (offset >= m_heights.size()) {
+            return false;
+        }
+        if (m_heights[offset].has_value()) {
+            return m_heights[offset].value() == height;
+        }
+        m_heights[offset] = height;
+        m_pending.push_back(offset);
+        return true;
+    }
+
+    [[nodiscard]] auto is_constant(std::size_t index) const -> bool
+    {
+        return index < m_chunk.constants.size();
+    }
+
+    [[nodiscard]] auto is_name(std::size_t index) const -> bool
+    {
+        return is_constant(index) && m_chunk.constants[index].is_string();
+    }
+
+    auto check_instruction(std::size_t offset, std::size_t height) -> bool
+    {
+        using enum OpCode;
+
+        const auto & code = m_chunk.code;
+        auto op = magic_enum::enum_cast<OpCode>(code[offset]);
+        if (!op.has_value()) {
+            return false;
+        }
+
+        // size of Closure depends on its function
+        if (op == Closure
+            && (offset + 1 >= code.size() || !is_constant(code[offset + 1])
+                || !m_chunk.constants[code[offset + 1]].is_function())) {
+            return false;
+        }
+        auto size = instruction_size(m_chunk, offset);
+        if (offset + size > code.size() || !mark_bytes(offset, size)) {
+            return false;
+        }
+
+        auto operand = [&code, offset](std::size_t index) -> std::size_t {
+            return code[offset + index];
+        };
+
+        switch (op.value()) {
+        case Constant: return is_constant(operand(1));
+        case DefineGlobal:
+        case GetGlobal:
+        case GetProperty:
+        case GetMethod:
+        case GetSuper:
+        case GetSuperMethod:
+        case SetGlobal:
+        case SetProperty:
+        case Invoke:
+        case SuperInvoke:
+        case Class:
+        case Method: return is_name(operand(1));
+        // locals are below the operand stack, SetLocal takes its value from the top
+        case GetLocal: return operand(1) < height;
+        case SetLocal: return operand(1) + 1 < height;
+        case GetUpvalue:
+        case SetUpvalue: return operand(1) < m_function.upvalue_count();
+        case Concat: return operand(1) >= 2;
+        case Closure: {
+            const auto * function = m_chunk.constants[operand(1)].as_objfunction();
+            for (std::size_t i = 0; i < function->upvalue_count(); i++) {
+                auto is_local = operand(2 + (2 * i));
+                auto index = operand(3 + (2 * i));
+                auto valid = is_local == 1 ? index < height
+                                           : is_local == 0 && index < m_function.upvalue_count();
+                if (!valid) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default: return true;
+        }
+    }
+
+    // Opcodes must not overlap operands of other instructions, i.e. jumps land on instructions
+    auto mark_bytes(std::size_t offset, std::size_t size) -> bool
+    {
+        if (m_bytes[offset] == ByteKind::Operand) {
+            return false;
+        }
+        m_bytes[offset] = ByteKind::Opcode;
+        for (std::size_t i = offset + 1; i < offset + size; i++) {
+            if (m_bytes[i] == ByteKind::Opcode) {
+                return false;
+            }
+            m_bytes[i] = ByteKind::Operand;
+        }
+        return true;
+    }
+
+    const ObjFunction & m_function;
+    const Chunk & m_chunk;
+    std::vector<std::optional<std::size_t>> m_heights; // stack height before each instruction
+    std::vector<ByteKind> m_bytes;
+    std::vector<std::size_t> m_pending; // instructions to check next
+};
+
+} // namespace
+
+auto verify_function(ObjFunction & function) -> bool
+{
+    if (function.get_lazy() != nullptr) {
+        return true;
+    }
+
+    auto max_height = Verifier{function}.run();
+    if (!max_height.has_value()) {
+        return false;
+    }
+    function.max_stack() = max_height.value();
+    return true;
+}
+
+} // namespace cpplox
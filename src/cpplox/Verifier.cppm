@@ -0,0 +1,18 @@
+export module cpplox:Verifier;
+
+import std;
+
+import :Object;
+
+namespace cpplox {
+
+// Checks that bytecode of the function is well-formed, so that the VM may run it without checks:
+// opcodes and operands are valid, jumps land on instructions inside the code, the stack has the
+// same height on every path to an instruction and never underflows, and no path runs past the end
+// of the code. Functions declared inside must be verified already.
+//
+// Stores the highest stack height of the function's frame, see ObjFunction::max_stack(). Functions
+// which are not compiled yet (see LazyFunction) are verified once they are.
+export auto verify_function(ObjFunction & function) -> bool;
+
+} // namespace cpplox
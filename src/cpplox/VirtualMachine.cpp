@@ -7,22 +7,33 @@ module cpplox;
 import std;
 
 import :Compiler;
+import :Coroutines;
 import :Debug;
+import :Events;
+import :Jit;
 import :Object;
 import :OpCode;
+import :Runtime;
 import :VirtualMachine;
+import :Workers;
 
 namespace cpplox {
 
 namespace {
-constexpr const std::size_t FRAMES_MAX = 64;
-constexpr const std::size_t STACK_MAX = 256;
+// Both stacks grow on demand, these are only their sizes at the start
+constexpr const std::size_t INITIAL_FRAMES = 64;
+constexpr const std::size_t INITIAL_STACK = 256;
 constexpr const bool DEBUG_VM_EXECUTION = false;
+// Shorter concatenations are copied right away, a rope would not save anything on them
+constexpr const std::size_t ROPE_MIN_LENGTH = 32;
+// Less code fits in a few cache lines wherever it is, e.g. a REPL line, an arena would only add a
+// mapping of a whole page
+constexpr const std::size_t ARENA_MIN_SIZE = 4096;
 } // namespace
 
 namespace {
 
-auto current_frame() -> CallFrame & { return g_vm.frames.back(); }
+auto current_frame() -> CallFrame & { return g_vm->frames.back(); }
 auto current_chunk() -> Chunk & { return current_frame().closure->get_function()->get_chunk(); }
 
 auto read_byte() -> Byte
@@ -34,56 +45,149 @@ auto read_byte() -> Byte
 
 auto read_instruction() -> OpCode { return static_cast<OpCode>(read_byte()); }
 
-auto read_constant() -> Value { return current_chunk().constants[read_byte()]; }
+auto constant_at(Byte index) -> Value { return current_chunk().constants[index]; }
+
+auto read_constant() -> Value { return constant_at(read_byte()); }
 
 auto read_double_byte() -> DoubleByte
 {
     return static_cast<DoubleByte>(read_byte() << BYTE_DIGITS) | read_byte();
 }
 
-template <typename... Args> auto runtime_error(std::format_string<Args...> fmt, Args &&... args)
+// Line of the stack trace for `frame`
+auto format_frame(const CallFrame & frame) -> std::string
 {
-    std::print(std::cerr, "runtime error: ");
-    std::println(std::cerr, fmt, std::forward<Args>(args)...);
+    const auto * function = frame.closure->get_function();
 
-    for (const auto & frame : std::ranges::reverse_view{g_vm.frames}) {
-        const auto * function = frame.closure->get_function();
+    const auto & chunk = function->get_chunk();
+    auto chunk_offset = static_cast<std::size_t>(std::distance(chunk.code.data(), frame.ip));
 
-        const auto & chunk = function->get_chunk();
-        auto chunk_offset = static_cast<std::size_t>(std::distance(chunk.code.data(), frame.ip));
+    auto location = chunk.locations.at(chunk_offset - 1);
+    auto entry = std::format("  [{}:{}] in ", location.line, location.column);
 
-        const auto & location = chunk.locations[chunk_offset - 1];
-        std::print(std::cerr, "  [{}:{}] in ", location.line, location.column);
+    if (function->get_name().empty()) {
+        entry += "script\n";
+    }
+    else {
+        entry += std::format("{}()\n", function->get_name());
+    }
 
-        if (function->get_name().empty()) {
-            std::println(std::cerr, "script");
-        }
-        else {
-            std::println(std::cerr, "{}()", function->get_name());
+    if (frame.elided > 0) {
+        entry += std::format("  ... {} frame(s) elided by tail calls\n", frame.elided);
+    }
+    return entry;
+}
+
+// Drops all frames and values. Closures may outlive the frames they have captured locals of, open
+// upvalues are closed.
+auto unwind_stacks(
+        std::vector<CallFrame> & frames,
+        ValueStack & stack,
+        std::vector<ObjUpvalue *> & open_upvalues,
+        std::size_t & open_upvalue_count
+) -> void
+{
+    for (auto * upvalue : open_upvalues) {
+        if (upvalue != nullptr) {
+            upvalue->close();
         }
     }
+    open_upvalues.clear();
+    open_upvalue_count = 0;
+    frames.clear();
+    stack.clear();
+}
 
-    g_vm.stack.clear();
+// Unwinds the stacks of the VM and of the coroutines running, the VM can run other code afterwards
+auto unwind_all() -> void
+{
+    unwind_stacks(g_vm->frames, g_vm->stack, g_vm->open_upvalues, g_vm->open_upvalue_count);
+    for (auto * coroutine = g_vm->coroutine; coroutine != nullptr;
+         coroutine = coroutine->get_resumer()) {
+        unwind_stacks(
+                coroutine->frames(),
+                coroutine->stack(),
+                coroutine->open_upvalues(),
+                coroutine->open_upvalue_count()
+        );
+    }
 }
 
-auto push_value(Value value) -> void
+template <typename... Args> auto runtime_error(std::format_string<Args...> fmt, Args &&... args)
 {
-    assert(g_vm.stack.size() < STACK_MAX && "Value stack overflow");
-    g_vm.stack.push_back(value);
+    std::print(std::cerr, "runtime error: ");
+    std::println(std::cerr, fmt, std::forward<Args>(args)...);
+
+    // Deep recursion leaves runs of identical frames, each run is printed once
+    std::string previous;
+    std::size_t repeated = 0;
+    auto print_repeated = [&repeated] {
+        if (repeated > 0) {
+            std::println(std::cerr, "  ... previous frame repeated {} more time(s)", repeated);
+            repeated = 0;
+        }
+    };
+
+    auto print_frames = [&](const std::vector<CallFrame> & frames) {
+        for (const auto & frame : std::ranges::reverse_view{frames}) {
+            auto entry = format_frame(frame);
+            if (entry == previous) {
+                repeated++;
+                continue;
+            }
+
+            print_repeated();
+            std::print(std::cerr, "{}", entry);
+            previous = std::move(entry);
+        }
+    };
+
+    // running coroutines hold the frames of their resumers
+    print_frames(g_vm->frames);
+    for (auto * coroutine = g_vm->coroutine; coroutine != nullptr;
+         coroutine = coroutine->get_resumer()) {
+        print_frames(coroutine->frames());
+    }
+    print_repeated();
+
+    unwind_all();
 }
 
-auto pop_value() -> Value
+auto stack_slot(const Value * value) -> std::size_t;
+
+// Moves the stack into a buffer at least twice larger. Frames and open upvalues point into the
+// stack, they are moved along.
+auto grow_stack(std::size_t min_capacity) -> void
 {
-    assert(g_vm.stack.size() > 0 && "Value stack empty");
-    Value val = g_vm.stack.back();
-    g_vm.stack.pop_back();
-    return val;
+    ValueStack grown;
+    grown.reserve(std::max({2 * g_vm->stack.capacity(), min_capacity, INITIAL_STACK}));
+    for (auto value : g_vm->stack) {
+        grown.push(value);
+    }
+
+    auto relocated = [&grown](Value * slot) { return &grown[stack_slot(slot)]; };
+    for (auto & frame : g_vm->frames) {
+        frame.slots = relocated(frame.slots);
+    }
+    for (auto * upvalue : g_vm->open_upvalues) {
+        if (upvalue != nullptr) {
+            upvalue->relocate(relocated(upvalue->location()));
+        }
+    }
+
+    g_vm->stack = std::move(grown);
 }
 
+auto push_value(Value value) -> void { g_vm->stack.push(value); }
+
+auto pop_value() -> Value { return g_vm->stack.pop(); }
+
+auto pop_values(std::size_t count) -> void { g_vm->stack.drop(count); }
+
 auto peek_value(std::size_t distance = 0) -> Value
 {
-    assert(g_vm.stack.size() > distance && "Cannot peek, stack is not big enough");
-    return g_vm.stack[g_vm.stack.size() - 1 - distance];
+    assert(g_vm->stack.size() > distance && "Cannot peek, stack is not big enough");
+    return g_vm->stack[g_vm->stack.size() - 1 - distance];
 }
 
 template <OpCode op> auto binary_op() -> InterpretResult
@@ -125,8 +229,47 @@ auto is_falsey(Value value) -> bool
     return value.is_nil() || (value.is_boolean() && !value.as_boolean());
 }
 
+auto maybe_jit_compile(ObjFunction & function) -> void
+{
+    if (function.get_compiled() != nullptr || function.jit_attempted()) {
+        return;
+    }
+    if (++function.call_count() <= g_vm->jit_threshold.value()) {
+        return;
+    }
+    function.jit_attempted() = true;
+    jit_compile(function);
+}
+
+auto close_upvalues(Value * last) -> void;
+
+// Reuses the current frame for the call of `closure`, which arguments start at `slot_start`. The
+// caller only returns the result of the call, so its locals are not needed anymore.
+auto replace_frame(ObjClosure & closure, std::size_t slot_start) -> void
+{
+    auto & frame = current_frame();
+    if (frame.closure->get_function()->captures_locals()) {
+        close_upvalues(frame.slots);
+    }
+
+    auto frame_start = stack_slot(frame.slots);
+    auto window_size = g_vm->stack.size() - slot_start;
+    std::move(
+            std::next(g_vm->stack.begin(), static_cast<std::ptrdiff_t>(slot_start)),
+            g_vm->stack.end(),
+            frame.slots
+    );
+    pop_values(g_vm->stack.size() - frame_start - window_size);
+    reserve_stack(closure.get_function()->max_stack() - window_size);
+
+    frame.closure = &closure;
+    frame.ip = closure.get_function()->get_chunk().code.data();
+    frame.compiled = closure.get_function()->get_compiled();
+    frame.elided++;
+}
+
 // FIXME: should return InterpretResult or some other error type?
-auto call(ObjClosure & closure, Byte arg_count) -> bool
+auto call(ObjClosure & closure, Byte arg_count, bool tail = false) -> bool
 {
     auto & function = *closure.get_function();
     if (arg_count != function.arity()) {
@@ -134,39 +277,58 @@ auto call(ObjClosure & closure, Byte arg_count) -> bool
         return false;
     }
 
-    if (g_vm.frames.size() >= FRAMES_MAX) {
+    if (!tail && g_vm->frames.size() >= g_vm->max_frames) {
         runtime_error("Stack overflow.");
         return false;
     }
 
-    auto slot_start = g_vm.stack.size() - arg_count - 1;
+    if (function.get_lazy() != nullptr && !compile_lazy_function(function)) {
+        // same as a compile error of the whole script, only reported later. Code running is
+        // unwound as on runtime errors, see stopped().
+        g_vm->compile_failed = true;
+        unwind_all();
+        return false;
+    }
+
+    if (g_vm->jit_threshold.has_value()) {
+        maybe_jit_compile(function);
+    }
+
+    auto slot_start = g_vm->stack.size() - arg_count - 1;
+    if (tail) {
+        replace_frame(closure, slot_start);
+        return true;
+    }
+    reserve_stack(function.max_stack() - arg_count - 1);
 
-    g_vm.frames.push_back({
+    g_vm->frames.push_back({
             .closure = &closure,
             .ip = function.get_chunk().code.data(),
-            .slots = &g_vm.stack[slot_start],
+            .slots = &g_vm->stack[slot_start],
+            .compiled = function.get_compiled(),
     });
 
     return true;
 }
 
-auto call_value(Value callee, Byte arg_count) -> bool
+// A tail call replaces the current frame if the callee runs in a frame of its own
+auto call_value(Value callee, Byte arg_count, bool tail = false) -> bool
 {
     if (callee.is_bound_method()) {
         auto * bound = callee.as_objboundmethod();
         // place receiver before args on the stack to get 'this' resolved correctly to it
-        g_vm.stack[g_vm.stack.size() - arg_count - 1] = bound->get_receiver();
-        return call(*bound->get_method(), arg_count);
+        g_vm->stack[g_vm->stack.size() - arg_count - 1] = bound->get_receiver();
+        return call(*bound->get_method(), arg_count, tail);
     }
     if (callee.is_class()) {
         auto * cls = callee.as_objclass();
         // place newly created instance before args on the stack to get 'this' resolved correctly to
         // it
-        g_vm.stack[g_vm.stack.size() - arg_count - 1] = Value::instance(cls);
+        g_vm->stack[g_vm->stack.size() - arg_count - 1] = Value::instance(cls);
 
         auto init = cls->get_method("init");
         if (init.has_value()) {
-            return call(*init->as_objclosure(), arg_count);
+            return call(*init->as_objclosure(), arg_count, tail);
         }
 
         if (arg_count != 0) {
@@ -177,39 +339,48 @@ auto call_value(Value callee, Byte arg_count) -> bool
         return true;
     }
     if (callee.is_closure()) {
-        return call(*callee.as_objclosure(), arg_count);
+        return call(*callee.as_objclosure(), arg_count, tail);
     }
     if (callee.is_native()) {
         Value::NativeFn callable = callee.as_native();
-        std::size_t args_start = g_vm.stack.size() - arg_count;
-        Value result = callable(std::span{g_vm.stack}.subspan(args_start, arg_count));
-
-        for (Byte i = 0; i < arg_count; i++) {
-            pop_value();
+        std::size_t args_start = g_vm->stack.size() - arg_count;
+        Value result = callable(std::span{g_vm->stack}.subspan(args_start, arg_count));
+        if (std::exchange(g_vm->native_signal, NativeSignal::None) == NativeSignal::Error) {
+            return false; // stacks are unwound already
         }
+
+        pop_values(arg_count + 1);
         push_value(result);
-        return true;
+        // run() returns once the running coroutine is suspended, see stopped()
+        return g_vm->native_signal == NativeSignal::None;
     }
 
     runtime_error("Can only call functions and classes.");
     return false;
 }
 
-auto invoke_from_class(ObjClass & cls, const std::string & name, Byte arg_count) -> bool
+auto invoke_from_class(ObjClass & cls, ObjString * name, Byte arg_count) -> bool
 {
     auto method = cls.get_method(name);
     if (!method.has_value()) {
-        runtime_error("Undefined property '{}'.", name);
+        runtime_error("Undefined property '{}'.", name->data());
         return false;
     }
 
     return call(*method->as_objclosure(), arg_count);
 }
 
-auto invoke(const std::string & name, Byte arg_count) -> bool
+auto invoke_list_method(ObjList & list, ObjString * name, Byte arg_count) -> bool;
+auto bind_list_method(ObjString * name) -> bool;
+auto push_list_method(ObjString * name) -> bool;
+
+auto invoke(ObjString * name, Byte arg_count) -> bool
 {
     Value receiver = peek_value(arg_count);
 
+    if (receiver.is_list()) {
+        return invoke_list_method(*receiver.as_objlist(), name, arg_count);
+    }
     if (!receiver.is_instance()) {
         runtime_error("Only instances have methods.");
         return false;
@@ -219,18 +390,18 @@ auto invoke(const std::string & name, Byte arg_count) -> bool
 
     auto field = instance->get_field(name);
     if (field.has_value()) {
-        g_vm.stack[g_vm.stack.size() - arg_count - 1] = field.value();
+        g_vm->stack[g_vm->stack.size() - arg_count - 1] = field.value();
         return call_value(field.value(), arg_count);
     }
 
     return invoke_from_class(*instance->get_class(), name, arg_count);
 }
 
-auto bind_method(ObjClass & cls, const std::string & name) -> bool
+auto bind_method(ObjClass & cls, ObjString * name) -> bool
 {
     auto method = cls.get_method(name);
     if (!method.has_value()) {
-        runtime_error("Undefined property '{}'.", name);
+        runtime_error("Undefined property '{}'.", name->data());
         return false;
     }
 
@@ -242,321 +413,812 @@ auto bind_method(ObjClass & cls, const std::string & name) -> bool
     return true;
 }
 
-auto capture_upvalue(Value * local) -> ObjUpvalue *
+// Methods called right away are not bound, the receiver is kept on the stack above the method
+// instead: [method, receiver]. Other callees have nil in place of the receiver.
+auto push_method(ObjClass & cls, ObjString * name) -> bool
 {
-    ObjUpvalue * prev = nullptr;
-    ObjUpvalue * upvalue = g_vm.open_upvalues;
-
-    // well this is a huge pile of ptr comparison bullshit idk
-    while (upvalue != nullptr && upvalue->location() > local) {
-        prev = upvalue;
-        upvalue = upvalue->next();
+    auto method = cls.get_method(name);
+    if (!method.has_value()) {
+        runtime_error("Undefined property '{}'.", name->data());
+        return false;
     }
 
-    if (upvalue != nullptr && upvalue->location() == local) {
-        return upvalue;
+    Value receiver = peek_value();
+    g_vm->stack.back() = method.value();
+    push_value(receiver);
+
+    return true;
+}
+
+// Drops the receiver slot pushed by push_method() and calls the callee as usual
+auto call_method(Byte arg_count) -> bool
+{
+    auto callee_slot = g_vm->stack.size() - arg_count - 2;
+    Value callee = g_vm->stack[callee_slot];
+    Value receiver = g_vm->stack[callee_slot + 1];
+    bool has_receiver = !receiver.is_nil();
+    // pushed by push_list_method(), the name of the method is in place of the receiver
+    bool is_list_method = has_receiver && callee.is_list();
+
+    // the receiver takes the callee slot, as it does for bound methods
+    auto dropped_slot = has_receiver && !is_list_method ? callee_slot : callee_slot + 1;
+    g_vm->stack.erase(&g_vm->stack[dropped_slot]);
+
+    if (is_list_method) {
+        return invoke_list_method(*callee.as_objlist(), receiver.as_objstring(), arg_count);
+    }
+    if (has_receiver) {
+        return call(*callee.as_objclosure(), arg_count);
     }
+    return call_value(callee, arg_count);
+}
 
-    auto * created_upvalue = ObjUpvalue::create(local);
-    created_upvalue->set_next(upvalue);
+auto stack_slot(const Value * value) -> std::size_t
+{
+    return static_cast<std::size_t>(std::distance<const Value *>(g_vm->stack.data(), value));
+}
 
-    if (prev == nullptr) {
-        g_vm.open_upvalues = created_upvalue;
+auto capture_upvalue(Value * local) -> ObjUpvalue *
+{
+    auto slot = stack_slot(local);
+    if (slot < g_vm->open_upvalues.size() && g_vm->open_upvalues[slot] != nullptr) {
+        return g_vm->open_upvalues[slot];
     }
-    else {
-        prev->set_next(created_upvalue);
+
+    auto * created_upvalue = ObjUpvalue::create(local);
+    created_upvalue->set_coroutine(g_vm->coroutine);
+    if (slot >= g_vm->open_upvalues.size()) {
+        g_vm->open_upvalues.resize(slot + 1, nullptr);
     }
+    g_vm->open_upvalues[slot] = created_upvalue;
+    g_vm->open_upvalue_count++;
 
     return created_upvalue;
 }
 
+// Closes upvalues of `last` and all slots above it
 auto close_upvalues(Value * last) -> void
 {
-    while (g_vm.open_upvalues != nullptr && g_vm.open_upvalues->location() >= last) {
-        auto * upvalue = g_vm.open_upvalues;
-        upvalue->close();
-        g_vm.open_upvalues = upvalue->next();
+    if (g_vm->open_upvalue_count == 0) {
+        return;
+    }
+
+    auto first = stack_slot(last);
+    for (auto slot = first; slot < g_vm->open_upvalues.size(); slot++) {
+        if (auto * upvalue = g_vm->open_upvalues[slot]; upvalue != nullptr) {
+            upvalue->close();
+            g_vm->open_upvalue_count--;
+        }
+    }
+    if (first < g_vm->open_upvalues.size()) {
+        g_vm->open_upvalues.resize(first);
     }
 }
 
-auto define_method(const std::string & name) -> void
+// Checks types for bytecode read from files, the verifier only checks its stack heights
+auto define_method(ObjString * name) -> bool
 {
     Value method = peek_value();
+    if (!peek_value(1).is_class() || !method.is_closure()) {
+        runtime_error("Methods can only be closures defined on classes.");
+        return false;
+    }
     auto * cls = peek_value(1).as_objclass();
 
     cls->add_method(name, method);
     pop_value(); // once! leave class in place for consequent methods
+    return true;
 }
 
-auto define_native(std::string_view name, Value::NativeFn callable) -> void
+// *** Operations ***
+// Shared by run() and entry points for compiled code. Return false if a runtime error was reported.
+
+auto define_global(ObjString * name) -> void
 {
-    // pushing and popping some GC bullsheesh
-    push_value(Value::string(std::string{name}));
-    push_value(Value::native(callable));
-    g_vm.globals.emplace(name, g_vm.stack.back());
-    pop_value();
+    g_vm->globals.insert_or_assign(name, peek_value());
     pop_value();
 }
 
-} // namespace
-
-// Yeah, sucks
-// NOLINTNEXTLINE(readability-function-cognitive-complexity)
-auto run() -> InterpretResult
+auto get_global(ObjString * name) -> bool
 {
-    using enum OpCode;
+    auto it = g_vm->globals.find(name);
+    if (it == g_vm->globals.end()) {
+        runtime_error("Undefined variable '{}'.", name->data());
+        return false;
+    }
+    push_value(it->second);
+    return true;
+}
 
-    for (;;) {
-        InterpretResult op_result = InterpretResult::Ok;
+auto set_global(ObjString * name) -> bool
+{
+    auto it = g_vm->globals.find(name);
+    if (it == g_vm->globals.end()) {
+        runtime_error("Undefined variable '{}'.", name->data());
+        return false;
+    }
+    it->second = peek_value();
+    return true;
+}
 
-        if constexpr (DEBUG_VM_EXECUTION) {
-            print_stack(g_vm.stack);
+auto get_property(ObjString * name) -> bool
+{
+    if (peek_value().is_list()) {
+        return bind_list_method(name);
+    }
+    if (!peek_value().is_instance()) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
 
-            const auto * chunk_start = current_chunk().code.data();
-            const auto offset
-                    = static_cast<std::size_t>(std::distance(chunk_start, current_frame().ip));
+    auto * instance = peek_value().as_objinstance();
 
-            disassemble_instruction(current_chunk(), offset);
-        }
+    auto property = instance->get_field(name);
+    if (property.has_value()) {
+        pop_value(); // instance object still on the stack
+        push_value(property.value());
+        return true;
+    }
 
-        switch (read_instruction()) {
-        // Values
-        case Constant: {
-            push_value(read_constant());
-            break;
-        }
-        case Nil: push_value(Value::nil()); break;
-        case True: push_value(Value::boolean(true)); break;
-        case False: push_value(Value::boolean(false)); break;
-        // Value manipulators
-        case Pop: pop_value(); break;
-        case DefineGlobal: {
-            const std::string & name = read_constant().as_string();
-            // FIXME: is there a way to get rid of copy on key insert? Key will surely live as long
-            // as VM lives
-            auto it = g_vm.globals.find(name);
-            if (it != g_vm.globals.end()) {
-                it->second = peek_value();
-            }
-            else {
-                g_vm.globals.emplace(name, peek_value());
-            }
-            pop_value();
-            break;
-        }
-        case GetGlobal: {
-            const std::string & name = read_constant().as_string();
-            auto it = g_vm.globals.find(name);
-            if (it == g_vm.globals.end()) {
-                runtime_error("Undefined variable '{}'.", name);
-                return InterpretResult::RuntimeError;
-            }
-            push_value(it->second);
-            break;
-        }
-        case GetLocal: {
-            Byte slot = read_byte();
-            push_value(current_frame().slots[slot]);
-            break;
-        }
-        case GetProperty: {
-            if (!peek_value().is_instance()) {
-                runtime_error("Only instances have properties.");
-                return InterpretResult::RuntimeError;
-            }
+    return bind_method(*instance->get_class(), name);
+}
 
-            auto * instance = peek_value().as_objinstance();
-            const std::string & name = read_constant().as_string();
+auto get_method(ObjString * name) -> bool
+{
+    if (peek_value().is_list()) {
+        return push_list_method(name);
+    }
+    if (!peek_value().is_instance()) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
 
-            auto property = instance->get_field(name);
-            if (property.has_value()) {
-                pop_value(); // instance object still on the stack
-                push_value(property.value());
-                break;
-            }
+    auto * instance = peek_value().as_objinstance();
 
-            if (!bind_method(*instance->get_class(), name)) {
-                return InterpretResult::RuntimeError;
-            }
-            break;
-        }
-        case GetSuper: {
-            const std::string & name = read_constant().as_string();
-            auto * super = pop_value().as_objclass();
+    auto property = instance->get_field(name);
+    if (property.has_value()) {
+        pop_value(); // instance object still on the stack
+        push_value(property.value());
+        push_value(Value::nil());
+        return true;
+    }
 
-            if (!bind_method(*super, name)) {
-                return InterpretResult::RuntimeError;
-            }
+    return push_method(*instance->get_class(), name);
+}
 
-            break;
-        }
-        case GetUpvalue: {
-            Byte slot = read_byte();
-            push_value(*current_frame().closure->upvalues()[slot]->location());
-            break;
-        }
-        case SetGlobal: {
-            const std::string & name = read_constant().as_string();
-            auto it = g_vm.globals.find(name);
-            if (it == g_vm.globals.end()) {
-                runtime_error("Undefined variable '{}'.", name);
-                return InterpretResult::RuntimeError;
-            }
-            it->second = peek_value();
-            break;
-        }
-        case SetLocal: {
-            Byte slot = read_byte();
-            current_frame().slots[slot] = peek_value();
-            break;
-        }
-        case SetProperty: {
-            if (!peek_value(1).is_instance()) {
-                runtime_error("Only instances have properties.");
-                return InterpretResult::RuntimeError;
-            }
+auto set_property(ObjString * name) -> bool
+{
+    if (!peek_value(1).is_instance()) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
 
-            auto * instance = peek_value(1).as_objinstance();
-            const std::string & name = read_constant().as_string();
+    auto * instance = peek_value(1).as_objinstance();
 
-            instance->set_field(name, peek_value());
+    instance->set_field(name, peek_value());
 
-            Value value = pop_value();
-            pop_value(); // instance
+    Value value = pop_value();
+    pop_value(); // instance
 
-            push_value(value);
-            break;
-        }
-        case SetUpvalue: {
-            Byte slot = read_byte();
-            *current_frame().closure->upvalues()[slot]->location() = peek_value();
-            break;
-        }
-        // Comparison ops
-        case Equal: {
-            Value rhs = pop_value();
-            Value lhs = pop_value();
-            push_value(Value::boolean(lhs == rhs));
-            break;
-        }
-        case Greater: op_result = binary_op<Greater>(); break;
-        case Less: op_result = binary_op<Less>(); break;
-        // Binary ops
-        case Add: {
-            if (peek_value(0).is_string() && peek_value(1).is_string()) {
-                const auto & rhs = peek_value(0).as_string();
-                const auto & lhs = peek_value(1).as_string();
-                auto value = Value::string(lhs + rhs);
-                pop_value();
-                pop_value();
-                push_value(value);
-            }
-            else if (peek_value(0).is_number() && peek_value(1).is_number()) {
-                double rhs = pop_value().as_number();
-                double lhs = pop_value().as_number();
-                push_value(Value::number(lhs + rhs));
-            }
-            else {
-                runtime_error("Operands must be two numbers or two strings.");
-                return InterpretResult::RuntimeError;
-            }
-            break;
-        }
-        case Substract: op_result = binary_op<Substract>(); break;
-        case Multiply: op_result = binary_op<Multiply>(); break;
-        case Divide: op_result = binary_op<Divide>(); break;
-        // Unary ops
-        case Not: push_value(Value::boolean(is_falsey(pop_value()))); break;
-        case Negate:
-            if (!peek_value().is_number()) {
-                runtime_error("Operand must be a number.");
-                return InterpretResult::RuntimeError;
-            }
-            push_value(Value::number(-pop_value().as_number()));
-            break;
-        // Aux
-        case Print: std::println("{}", pop_value()); break;
-        case Jump: {
-            DoubleByte offset = read_double_byte();
-            std::advance(current_frame().ip, offset);
-            break;
-        }
-        case JumpIfFalse: {
-            DoubleByte offset = read_double_byte();
-            if (is_falsey(peek_value())) {
-                std::advance(current_frame().ip, offset);
-            }
-            break;
-        }
-        case Loop: {
-            DoubleByte offset = read_double_byte();
-            std::advance(current_frame().ip, -static_cast<std::ptrdiff_t>(offset));
-            break;
-        }
-        case Call: {
-            Byte arg_count = read_byte();
-            if (!call_value(peek_value(arg_count), arg_count)) {
-                return InterpretResult::RuntimeError;
-            }
-            break;
-        }
-        case Invoke: {
-            const std::string & name = read_constant().as_string();
-            Byte arg_count = read_byte();
+    push_value(value);
+    return true;
+}
 
-            if (!invoke(name, arg_count)) {
+// Position of `index` among `length` elements, or right after them if `inclusive` (e.g. to insert
+// there). Reports a runtime error if there is none.
+auto list_position(Value index, std::size_t length, bool inclusive = false)
+        -> std::optional<std::size_t>
+{
+    if (!index.is_number() || index.as_number() != std::floor(index.as_number())) {
+        runtime_error("List index must be an integer.");
+        return std::nullopt;
+    }
+    auto limit = static_cast<double>(inclusive ? length + 1 : length);
+    if (index.as_number() < 0 || index.as_number() >= limit) {
+        runtime_error("List index {} out of bounds for length {}.", index.as_number(), length);
+        return std::nullopt;
+    }
+    return static_cast<std::size_t>(index.as_number());
+}
+
+auto make_list(std::size_t count) -> void
+{
+    // elements stay on the stack until the list holding them is allocated
+    auto * list = ObjList::create(std::span{g_vm->stack}.last(count));
+    pop_values(count);
+    push_value(Value::obj(list));
+}
+
+auto get_index() -> bool
+{
+    if (!peek_value(1).is_list()) {
+        runtime_error("Only lists can be indexed.");
+        return false;
+    }
+
+    const auto & elements = peek_value(1).as_objlist()->elements();
+    auto position = list_position(peek_value(), elements.size());
+    if (!position.has_value()) {
+        return false;
+    }
+
+    Value element = elements[position.value()];
+    pop_values(2);
+    push_value(element);
+    return true;
+}
+
+auto set_index() -> bool
+{
+    if (!peek_value(2).is_list()) {
+        runtime_error("Only lists can be indexed.");
+        return false;
+    }
+
+    auto & elements = peek_value(2).as_objlist()->elements();
+    auto position = list_position(peek_value(1), elements.size());
+    if (!position.has_value()) {
+        return false;
+    }
+
+    Value value = pop_value();
+    elements[position.value()] = value;
+    pop_values(2); // list and index
+
+    push_value(value);
+    return true;
+}
+
+// Methods of lists are natives called with the list, they can only be called right away (e.g.
+// `list.append(value)` or `(list.append)(value)`) as they are never bound. They return nothing once
+// they have reported a runtime error.
+using ListMethod = std::optional<Value> (*)(ObjList & list, std::span<const Value> args);
+
+auto list_append(ObjList & list, std::span<const Value> args) -> std::optional<Value>
+{
+    list.elements().push_back(args[0]);
+    return Value::nil();
+}
+
+auto list_pop(ObjList & list, std::span<const Value> /* args */) -> std::optional<Value>
+{
+    if (list.elements().empty()) {
+        runtime_error("Cannot pop from an empty list.");
+        return std::nullopt;
+    }
+    Value last = list.elements().back();
+    list.elements().pop_back();
+    return last;
+}
+
+auto list_length(ObjList & list, std::span<const Value> /* args */) -> std::optional<Value>
+{
+    return Value::number(static_cast<double>(list.elements().size()));
+}
+
+auto list_insert(ObjList & list, std::span<const Value> args) -> std::optional<Value>
+{
+    auto & elements = list.elements();
+    auto position = list_position(args[0], elements.size(), /* inclusive = */ true);
+    if (!position.has_value()) {
+        return std::nullopt;
+    }
+    elements.insert(std::next(elements.begin(), static_cast<std::ptrdiff_t>(*position)), args[1]);
+    return Value::nil();
+}
+
+// Elements from `start` up to but not including `end`, as a new list
+auto list_slice(ObjList & list, std::span<const Value> args) -> std::optional<Value>
+{
+    auto length = list.elements().size();
+    auto start = list_position(args[0], length, /* inclusive = */ true);
+    if (!start.has_value()) {
+        return std::nullopt;
+    }
+    auto end = list_position(args[1], length, /* inclusive = */ true);
+    if (!end.has_value()) {
+        return std::nullopt;
+    }
+    if (*end < *start) {
+        runtime_error("Slice end {} is before its start {}.", *end, *start);
+        return std::nullopt;
+    }
+    // the list is the receiver on the stack, it keeps the elements reachable
+    return Value::obj(ObjList::create(std::span{list.elements()}.subspan(*start, *end - *start)));
+}
+
+struct ListMethodEntry
+{
+    std::string_view name;
+    std::size_t arity;
+    ListMethod method;
+};
+
+constexpr const std::array LIST_METHODS = {
+        ListMethodEntry{.name = "append", .arity = 1, .method = list_append},
+        ListMethodEntry{.name = "pop", .arity = 0, .method = list_pop},
+        ListMethodEntry{.name = "length", .arity = 0, .method = list_length},
+        ListMethodEntry{.name = "insert", .arity = 2, .method = list_insert},
+        ListMethodEntry{.name = "slice", .arity = 2, .method = list_slice},
+};
+
+// Reports a runtime error if there is no such method
+auto find_list_method(ObjString * name) -> const ListMethodEntry *
+{
+    auto entry = std::ranges::find(LIST_METHODS, name->data(), &ListMethodEntry::name);
+    if (entry == LIST_METHODS.end()) {
+        runtime_error("Undefined property '{}'.", name->data());
+        return nullptr;
+    }
+    return std::to_address(entry);
+}
+
+// Arguments are on the stack above the list, the result takes their place
+auto invoke_list_method(ObjList & list, ObjString * name, Byte arg_count) -> bool
+{
+    const auto * entry = find_list_method(name);
+    if (entry == nullptr) {
+        return false;
+    }
+    if (arg_count != entry->arity) {
+        runtime_error("Expected {} arguments but got {}.", entry->arity, arg_count);
+        return false;
+    }
+
+    auto result = entry->method(list, std::span{g_vm->stack}.last(arg_count));
+    if (!result.has_value()) {
+        return false;
+    }
+    pop_values(arg_count + 1);
+    push_value(result.value());
+    return true;
+}
+
+// There are no natives bound to a receiver to hand out for `list.append` on its own
+auto bind_list_method(ObjString * name) -> bool
+{
+    if (find_list_method(name) != nullptr) {
+        runtime_error("List method '{}' must be called right away.", name->data());
+    }
+    return false;
+}
+
+// Like push_method(), but the name of the method takes the receiver slot above the list:
+// [list, name]. call_method() tells them apart, lists are not callable.
+auto push_list_method(ObjString * name) -> bool
+{
+    if (find_list_method(name) == nullptr) {
+        return false;
+    }
+    push_value(Value::obj(name));
+    return true;
+}
+
+// Compiled code always has a class there, bytecode loaded from a file may have anything
+auto pop_superclass() -> ObjClass *
+{
+    Value superclass = pop_value();
+    if (!superclass.is_class()) {
+        runtime_error("Superclass must be a class.");
+        return nullptr;
+    }
+    return superclass.as_objclass();
+}
+
+auto get_super(ObjString * name) -> bool
+{
+    auto * super = pop_superclass();
+    return super != nullptr && bind_method(*super, name);
+}
+
+auto get_super_method(ObjString * name) -> bool
+{
+    auto * super = pop_superclass();
+    return super != nullptr && push_method(*super, name);
+}
+
+auto super_invoke(ObjString * name, Byte arg_count) -> bool
+{
+    auto * super = pop_superclass();
+    return super != nullptr && invoke_from_class(*super, name, arg_count);
+}
+
+auto add() -> bool
+{
+    if (peek_value(0).is_string() && peek_value(1).is_string()) {
+        // operands stay on the stack until the result is allocated
+        Value lhs = peek_value(1);
+        Value rhs = peek_value(0);
+        Value value = Value::nil();
+        if (lhs.string_length() + rhs.string_length() < ROPE_MIN_LENGTH) {
+            std::array parts = {lhs.as_string(), rhs.as_string()};
+            value = Value::obj(ObjString::concatenate(parts));
+        }
+        else {
+            value = Value::obj(ObjRope::create(lhs, rhs));
+        }
+        pop_value();
+        pop_value();
+        push_value(value);
+    }
+    else if (peek_value(0).is_number() && peek_value(1).is_number()) {
+        double rhs = pop_value().as_number();
+        double lhs = pop_value().as_number();
+        push_value(Value::number(lhs + rhs));
+    }
+    else {
+        runtime_error("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+// Adds `count` operands at once, left to right, see Concat. Operands are either all strings or all
+// numbers, otherwise one of the additions would fail.
+auto concat(std::size_t count) -> bool
+{
+    auto operands = std::span{g_vm->stack}.last(count);
+    if (std::ranges::all_of(operands, [](const Value & value) { return value.is_string(); })) {
+        // a long left operand is most likely a string being built in a loop, appending to it
+        // must not copy it
+        Value lhs = operands.front();
+        bool append = lhs.string_length() >= ROPE_MIN_LENGTH;
+        auto tail_operands = operands.subspan(append ? 1 : 0);
+
+        std::array<std::string_view, BYTE_MAX> parts{};
+        for (std::size_t i = 0; i < tail_operands.size(); i++) {
+            parts.at(i) = tail_operands[i].as_string();
+        }
+        auto * tail = ObjString::concatenate(std::span{parts}.first(tail_operands.size()));
+
+        Value value = Value::obj(tail);
+        if (append) {
+            // the tail takes the slot of an operand copied into it, to stay reachable for GC
+            operands[1] = value;
+            value = Value::obj(ObjRope::create(lhs, value));
+        }
+        pop_values(count);
+        push_value(value);
+    }
+    else if (std::ranges::all_of(operands, [](const Value & value) { return value.is_number(); })) {
+        double sum = operands.front().as_number();
+        for (const auto & operand : operands.subspan(1)) {
+            sum += operand.as_number();
+        }
+        pop_values(count);
+        push_value(Value::number(sum));
+    }
+    else {
+        runtime_error("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+auto negate() -> bool
+{
+    if (!peek_value().is_number()) {
+        runtime_error("Operand must be a number.");
+        return false;
+    }
+    push_value(Value::number(-pop_value().as_number()));
+    return true;
+}
+
+// `upvalues` holds (is_local, index) operand pairs of the Closure instruction
+auto make_closure(ObjFunction & function, std::span<const Byte> upvalues) -> void
+{
+    // Closures without upvalues only differ by identity, all of them are one shared object
+    if (function.upvalue_count() == 0) {
+        if (function.get_shared_closure() == nullptr) {
+            function.set_shared_closure(ObjClosure::create(&function));
+        }
+        push_value(Value::obj(function.get_shared_closure()));
+        return;
+    }
+
+    auto * closure = ObjClosure::create(&function);
+    push_value(Value::obj(closure));
+
+    for (auto i : std::views::iota(0UZ, function.upvalue_count())) {
+        bool is_local = upvalues[2 * i] == 1;
+        Byte index = upvalues[(2 * i) + 1];
+        if (is_local) {
+            closure->set_upvalue(i, capture_upvalue(&current_frame().slots[index]));
+        }
+        else {
+            closure->set_upvalue(i, current_frame().closure->upvalues()[index]);
+        }
+    }
+}
+
+// Returns true if the outermost frame (i.e. script or function called by the host) has returned,
+// its result is left on the stack
+auto return_from_call() -> bool
+{
+    Value result = pop_value();
+    auto * old_slots = g_vm->frames.back().slots;
+    if (g_vm->frames.back().closure->get_function()->captures_locals()) {
+        close_upvalues(old_slots);
+    }
+
+    g_vm->frames.pop_back();
+
+    pop_values(g_vm->stack.size() - stack_slot(old_slots));
+    push_value(result);
+    return g_vm->frames.empty();
+}
+
+// Result of run() once a call has failed: either a runtime error or the running coroutine has been
+// suspended by a native
+auto stopped() -> InterpretResult
+{
+    auto signal = std::exchange(g_vm->native_signal, NativeSignal::None);
+    if (signal == NativeSignal::Suspend) {
+        return InterpretResult::Ok;
+    }
+    return g_vm->compile_failed ? InterpretResult::CompileError : InterpretResult::RuntimeError;
+}
+
+auto inherit() -> bool
+{
+    Value superclass_val = peek_value(1);
+    if (!superclass_val.is_class()) {
+        runtime_error("Superclass must be a class.");
+        return false;
+    }
+
+    // the class being declared, unless the bytecode was crafted
+    if (!peek_value(0).is_class()) {
+        runtime_error("Only classes can inherit.");
+        return false;
+    }
+
+    auto * superclass = superclass_val.as_objclass();
+    auto * subclass = peek_value(0).as_objclass();
+
+    for (const auto & [name, method] : superclass->all_methods()) {
+        subclass->add_method(name, method);
+    }
+
+    pop_value(); // subclass
+    return true;
+}
+
+} // namespace
+
+// A call makes room for everything its frame pushes (see ObjFunction::max_stack()), values pushed
+// outside of frames need this too
+auto reserve_stack(std::size_t count) -> void
+{
+    if (g_vm->stack.capacity() - g_vm->stack.size() < count) {
+        grow_stack(g_vm->stack.size() + count);
+    }
+}
+
+// Yeah, sucks
+// NOLINTNEXTLINE(readability-function-cognitive-complexity)
+auto run() -> InterpretResult
+{
+    using enum OpCode;
+
+    for (;;) {
+        if (auto compiled = current_frame().compiled; compiled != nullptr) {
+            switch (compiled(*current_frame().closure->get_function(), current_frame().ip)) {
+            case RunStatus::Next:
+            case RunStatus::Branch:
+            case RunStatus::Switch: continue; // frame has changed, pick up the new one
+            case RunStatus::Error: return stopped();
+            case RunStatus::Halt: return InterpretResult::Ok;
+            }
+        }
+
+        InterpretResult op_result = InterpretResult::Ok;
+
+        if constexpr (DEBUG_VM_EXECUTION) {
+            print_stack(g_vm->stack);
+
+            const auto * chunk_start = current_chunk().code.data();
+            const auto offset
+                    = static_cast<std::size_t>(std::distance(chunk_start, current_frame().ip));
+
+            disassemble_instruction(current_chunk(), offset);
+        }
+
+        switch (read_instruction()) {
+        // Values
+        case Constant: {
+            push_value(read_constant());
+            break;
+        }
+        case Nil: push_value(Value::nil()); break;
+        case True: push_value(Value::boolean(true)); break;
+        case False: push_value(Value::boolean(false)); break;
+        case List: make_list(read_byte()); break;
+        // Value manipulators
+        case Pop: pop_value(); break;
+        case DefineGlobal: define_global(read_constant().as_objstring()); break;
+        case GetGlobal: {
+            if (!get_global(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case GetIndex: {
+            if (!get_index()) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case GetLocal: {
+            Byte slot = read_byte();
+            push_value(current_frame().slots[slot]);
+            break;
+        }
+        case GetProperty: {
+            if (!get_property(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case GetMethod: {
+            if (!get_method(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case GetSuper: {
+            if (!get_super(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case GetSuperMethod: {
+            if (!get_super_method(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case GetUpvalue: {
+            Byte slot = read_byte();
+            push_value(*current_frame().closure->upvalues()[slot]->location());
+            break;
+        }
+        case SetGlobal: {
+            if (!set_global(read_constant().as_objstring())) {
                 return InterpretResult::RuntimeError;
             }
             break;
         }
+        case SetIndex: {
+            if (!set_index()) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case SetLocal: {
+            Byte slot = read_byte();
+            current_frame().slots[slot] = peek_value();
+            break;
+        }
+        case SetProperty: {
+            if (!set_property(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case SetUpvalue: {
+            Byte slot = read_byte();
+            *current_frame().closure->upvalues()[slot]->location() = peek_value();
+            break;
+        }
+        // Comparison ops
+        case Equal: {
+            Value rhs = pop_value();
+            Value lhs = pop_value();
+            push_value(Value::boolean(lhs == rhs));
+            break;
+        }
+        case Greater: op_result = binary_op<Greater>(); break;
+        case Less: op_result = binary_op<Less>(); break;
+        // Binary ops
+        case Add: {
+            if (!add()) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case Concat: {
+            if (!concat(read_byte())) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        case Substract: op_result = binary_op<Substract>(); break;
+        case Multiply: op_result = binary_op<Multiply>(); break;
+        case Divide: op_result = binary_op<Divide>(); break;
+        // Unary ops
+        case Not: push_value(Value::boolean(is_falsey(pop_value()))); break;
+        case Negate: {
+            if (!negate()) {
+                return InterpretResult::RuntimeError;
+            }
+            break;
+        }
+        // Aux
+        case Print: std::println("{}", pop_value()); break;
+        case Jump: {
+            DoubleByte offset = read_double_byte();
+            std::advance(current_frame().ip, offset);
+            break;
+        }
+        case JumpIfFalse: {
+            DoubleByte offset = read_double_byte();
+            if (is_falsey(peek_value())) {
+                std::advance(current_frame().ip, offset);
+            }
+            break;
+        }
+        case Loop: {
+            DoubleByte offset = read_double_byte();
+            std::advance(current_frame().ip, -static_cast<std::ptrdiff_t>(offset));
+            break;
+        }
+        case Call: {
+            Byte arg_count = read_byte();
+            if (!call_value(peek_value(arg_count), arg_count)) {
+                return stopped();
+            }
+            break;
+        }
+        case TailCall: {
+            Byte arg_count = read_byte();
+            if (!call_value(peek_value(arg_count), arg_count, /* tail = */ true)) {
+                return stopped();
+            }
+            break;
+        }
+        case CallMethod: {
+            if (!call_method(read_byte())) {
+                return stopped();
+            }
+            break;
+        }
+        case Invoke: {
+            auto * name = read_constant().as_objstring();
+            Byte arg_count = read_byte();
+
+            if (!invoke(name, arg_count)) {
+                return stopped();
+            }
+            break;
+        }
         case SuperInvoke: {
-            const std::string & name = read_constant().as_string();
+            auto * name = read_constant().as_objstring();
             Byte arg_count = read_byte();
-            auto * super = pop_value().as_objclass();
 
-            if (!invoke_from_class(*super, name, arg_count)) {
-                return InterpretResult::RuntimeError;
+            if (!super_invoke(name, arg_count)) {
+                return stopped();
             }
             break;
         }
         case Closure: {
             auto * function = read_constant().as_objfunction();
-            auto * closure = ObjClosure::create(function);
-            push_value(Value::obj(closure));
-
-            for (auto _ : std::views::iota(0UZ, function->upvalue_count())) {
-                bool is_local = read_byte() == 1;
-                Byte index = read_byte();
-                if (is_local) {
-                    closure->add_upvalue(capture_upvalue(&current_frame().slots[index]));
-                }
-                else {
-                    closure->add_upvalue(current_frame().closure->upvalues()[index]);
-                }
-            }
+            auto upvalues_size = 2 * function->upvalue_count();
+
+            make_closure(*function, std::span{current_frame().ip, upvalues_size});
+            std::advance(current_frame().ip, upvalues_size);
             break;
         }
         case CloseUpvalue: {
-            close_upvalues(&g_vm.stack.back());
+            close_upvalues(&g_vm->stack.back());
             pop_value();
             break;
         }
         case Return: {
-            Value result = pop_value();
-            auto * old_slots = g_vm.frames.back().slots;
-            close_upvalues(old_slots);
-
-            g_vm.frames.pop_back();
-            if (g_vm.frames.empty()) {
-                pop_value();
+            if (return_from_call()) {
                 return InterpretResult::Ok;
             }
-
-            // FIXME: yeah, dirt. Should be solved if we actually use array for stack
-            while (&*g_vm.stack.end() != old_slots) {
-                pop_value();
-            }
-            push_value(result);
             break;
         }
         case Class: {
@@ -565,25 +1227,15 @@ auto run() -> InterpretResult
             break;
         }
         case Inherit: {
-            Value superclass_val = peek_value(1);
-            if (!superclass_val.is_class()) {
-                runtime_error("Superclass must be a class.");
+            if (!inherit()) {
                 return InterpretResult::RuntimeError;
             }
-
-            auto * superclass = superclass_val.as_objclass();
-            auto * subclass = peek_value(0).as_objclass();
-
-            for (const auto & [name, method] : superclass->all_methods()) {
-                subclass->add_method(name, method);
-            }
-
-            pop_value(); // subclass
-
             break;
         }
         case Method: {
-            define_method(read_constant().as_string());
+            if (!define_method(read_constant().as_objstring())) {
+                return InterpretResult::RuntimeError;
+            }
             break;
         }
         }
@@ -594,9 +1246,25 @@ auto run() -> InterpretResult
     }
 }
 
-auto init_vm() -> void
+auto define_native(std::string_view name, Value::NativeFn callable) -> void
+{
+    // pushing and popping some GC bullsheesh
+    reserve_stack(2);
+    push_value(Value::string(name));
+    push_value(Value::native(callable));
+    g_vm->globals.insert_or_assign(peek_value(1).as_objstring(), peek_value());
+    pop_value();
+    pop_value();
+}
+
+auto init_vm(VmOptions options) -> void
 {
-    g_vm.stack.clear();
+    assert(g_vm == nullptr && "free_vm() was not called");
+    g_vm = new VirtualMachine{}; // NOLINT(cppcoreguidelines-owning-memory)
+    g_vm->jit_threshold = options.jit_threshold;
+    g_vm->huge_pages = options.huge_pages;
+    g_vm->lazy_compile = options.lazy_compile;
+    g_vm->max_frames = options.max_frames;
 
     define_native("clock", [](std::span<const Value> /* args */) {
         using namespace std::chrono;
@@ -610,34 +1278,605 @@ auto init_vm() -> void
                 / MS_IN_SECS
         );
     });
+    define_coroutine_natives();
+    define_event_natives();
+    define_worker_natives();
 }
 
 auto free_vm() -> void
 {
-    for (auto * obj : g_vm.objects) {
+    for (auto * obj : g_vm->objects) {
         release_object(obj);
     }
-    g_vm.objects.clear();
+    g_vm->objects.clear();
+    g_vm->code_arenas.clear(); // after functions placed in them
+
+    delete g_vm; // NOLINT(cppcoreguidelines-owning-memory)
+    g_vm = nullptr;
+}
+
+auto options_of(const VirtualMachine & vm) -> VmOptions
+{
+    return {
+            .jit_threshold = vm.jit_threshold,
+            .huge_pages = vm.huge_pages,
+            .lazy_compile = vm.lazy_compile,
+            .max_frames = vm.max_frames,
+    };
 }
 
-auto interpret(std::string_view source) -> InterpretResult
+auto interpret(std::string_view source, std::shared_ptr<const void> owner) -> InterpretResult
 {
-    auto * function = compile(source);
+    auto * function = compile(source, g_vm->lazy_compile, std::move(owner));
     if (function == nullptr) {
         return InterpretResult::CompileError;
     }
+    return interpret(*function);
+}
+
+auto interpret(ObjFunction & script) -> InterpretResult
+{
+    freeze_script(script);
+    auto result = run_script(script);
+    if (result != InterpretResult::Ok) {
+        return result;
+    }
+    return run_event_loop() ? InterpretResult::Ok : InterpretResult::RuntimeError;
+}
+
+auto freeze_script(ObjFunction & script) -> void { freeze_functions(collect_functions(script)); }
+
+auto freeze_functions(std::span<ObjFunction * const> functions) -> void
+{
+    // lazy functions are not compiled yet, their chunks stay on the heap once they are
+    auto compiled = functions | std::views::filter([](const ObjFunction * function) {
+                        return function->get_lazy() == nullptr;
+                    });
+
+    std::size_t size = 0;
+    for (const auto * function : compiled) {
+        size += function->relocated_size();
+    }
+    if (size < ARENA_MIN_SIZE) {
+        return;
+    }
+
+    auto arena = CodeArena::create(size, g_vm->huge_pages);
+    if (arena == nullptr) {
+        return; // not fatal, code stays where it is
+    }
 
-    // FIXME: hack. Should use arrays inside VM object instead.
-    g_vm.frames.reserve(FRAMES_MAX);
-    g_vm.stack.reserve(STACK_MAX);
+    for (auto * function : compiled) {
+        function->relocate(arena->resource());
+    }
+    arena->protect();
+
+    g_vm->code_arenas.push_back(std::move(arena));
+}
+
+auto run_script(ObjFunction & script) -> InterpretResult
+{
+    g_vm->frames.reserve(INITIAL_FRAMES);
 
-    push_value(Value::obj(function));
-    auto * closure = ObjClosure::create(function);
+    reserve_stack(1);
+    push_value(Value::obj(&script));
+    auto * closure = ObjClosure::create(&script);
     pop_value();
     push_value(Value::obj(closure));
     call(*closure, 0);
 
-    return run();
+    auto result = run();
+    if (result == InterpretResult::Ok) {
+        pop_value(); // nil returned by the script
+    }
+    g_vm->compile_failed = false;
+    return result;
+}
+
+auto call_global(std::string_view name, std::span<const Value> args) -> std::optional<Value>
+{
+    auto it = g_vm->globals.find(name);
+    if (it == g_vm->globals.end()) {
+        runtime_error("Undefined variable '{}'.", name);
+        return std::nullopt;
+    }
+    return call_function(it->second, args);
+}
+
+auto call_function(Value callee, std::span<const Value> args) -> std::optional<Value>
+{
+    assert(g_vm->frames.empty() && "Lox code is running");
+
+    if (args.size() > BYTE_MAX) {
+        runtime_error("Cannot have more than 255 arguments.");
+        return std::nullopt;
+    }
+
+    g_vm->frames.reserve(INITIAL_FRAMES);
+    reserve_stack(args.size() + 1);
+    push_value(callee);
+    for (auto arg : args) {
+        push_value(arg);
+    }
+
+    // natives and classes without initializers return right away, without a frame
+    auto ok = call_value(peek_value(args.size()), static_cast<Byte>(args.size()))
+              && (g_vm->frames.empty() || run() == InterpretResult::Ok);
+    g_vm->compile_failed = false;
+    if (!ok) {
+        return std::nullopt;
+    }
+    return pop_value();
+}
+
+namespace {
+
+// Exchanges the stacks of the VM with the ones of the coroutine. Frames and upvalues point into the
+// buffers of the stacks, which are moved as they are.
+auto swap_stacks(ObjCoroutine & coroutine) -> void
+{
+    std::swap(g_vm->frames, coroutine.frames());
+    std::swap(g_vm->stack, coroutine.stack());
+    std::swap(g_vm->open_upvalues, coroutine.open_upvalues());
+    std::swap(g_vm->open_upvalue_count, coroutine.open_upvalue_count());
+}
+
+} // namespace
+
+auto resume_coroutine(ObjCoroutine & coroutine, Value value) -> std::optional<Value>
+{
+    using enum ObjCoroutine::State;
+
+    if (coroutine.get_state() == Done) {
+        return Value::nil();
+    }
+    if (coroutine.get_state() == Running) {
+        runtime_error("Cannot resume a running coroutine.");
+        return std::nullopt;
+    }
+
+    auto state = coroutine.get_state();
+    swap_stacks(coroutine);
+    coroutine.set_resumer(std::exchange(g_vm->coroutine, &coroutine));
+    coroutine.set_state(Running);
+
+    // every resume runs the coroutine in a run() of its own, which returns once it yields
+    auto result = InterpretResult::Ok;
+    if (state == Suspended) {
+        // result of the yield() call it is suspended in
+        reserve_stack(1);
+        push_value(value);
+        result = run();
+    }
+    else if (!call_value(g_vm->stack.front(), static_cast<Byte>(g_vm->stack.size() - 1))) {
+        result = stopped();
+    }
+    else if (!g_vm->frames.empty()) { // natives and classes without initializers have returned
+        result = run();
+    }
+
+    std::optional<Value> yielded;
+    if (result == InterpretResult::Ok) {
+        yielded = pop_value();
+    }
+    auto done = g_vm->frames.empty();
+
+    swap_stacks(coroutine);
+    g_vm->coroutine = coroutine.get_resumer();
+    coroutine.set_resumer(nullptr);
+    coroutine.set_state(done ? Done : Suspended);
+    if (done) {
+        coroutine.frames() = {};
+        coroutine.stack() = ValueStack{};
+        coroutine.open_upvalues() = {};
+    }
+    return yielded;
+}
+
+auto suspend_coroutine() -> bool
+{
+    if (g_vm->coroutine == nullptr) {
+        return false;
+    }
+    g_vm->native_signal = NativeSignal::Suspend;
+    return true;
+}
+
+// *** Entry points for compiled code ***
+
+namespace {
+
+// Moves frame's ip past the instruction at `ip`, as if run() has read it, and returns the
+// instruction's bytes
+template <std::size_t Size> auto enter_instruction(const Byte * ip) -> std::span<const Byte, Size>
+{
+    current_frame().ip = std::next(ip, static_cast<std::ptrdiff_t>(Size));
+    return std::span<const Byte, Size>{ip, Size};
+}
+
+auto status_of(bool ok) -> RunStatus { return ok ? RunStatus::Next : RunStatus::Error; }
+
+auto status_of(InterpretResult result) -> RunStatus
+{
+    return status_of(result == InterpretResult::Ok);
+}
+
+// Calls leave compiled code once a new frame is pushed, so that run() picks it up
+auto call_status_of(bool ok, std::size_t frame_count) -> RunStatus
+{
+    if (!ok) {
+        return RunStatus::Error;
+    }
+    return g_vm->frames.size() == frame_count ? RunStatus::Next : RunStatus::Switch;
+}
+
+} // namespace
+
+auto runtime::op_constant(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    push_value(constant_at(instruction[1]));
+    return RunStatus::Next;
+}
+
+auto runtime::op_nil(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    push_value(Value::nil());
+    return RunStatus::Next;
+}
+
+auto runtime::op_true(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    push_value(Value::boolean(true));
+    return RunStatus::Next;
+}
+
+auto runtime::op_false(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    push_value(Value::boolean(false));
+    return RunStatus::Next;
+}
+
+auto runtime::op_list(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    make_list(instruction[1]);
+    return RunStatus::Next;
+}
+
+auto runtime::op_pop(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    pop_value();
+    return RunStatus::Next;
+}
+
+auto runtime::op_define_global(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    define_global(constant_at(instruction[1]).as_objstring());
+    return RunStatus::Next;
+}
+
+auto runtime::op_get_global(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(get_global(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_get_index(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(get_index());
+}
+
+auto runtime::op_get_local(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    push_value(current_frame().slots[instruction[1]]);
+    return RunStatus::Next;
+}
+
+auto runtime::op_get_property(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(get_property(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_get_method(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(get_method(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_get_super(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(get_super(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_get_super_method(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(get_super_method(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_get_upvalue(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    push_value(*current_frame().closure->upvalues()[instruction[1]]->location());
+    return RunStatus::Next;
+}
+
+auto runtime::op_set_global(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(set_global(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_set_index(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(set_index());
+}
+
+auto runtime::op_set_local(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    current_frame().slots[instruction[1]] = peek_value();
+    return RunStatus::Next;
+}
+
+auto runtime::op_set_property(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(set_property(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::op_set_upvalue(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    *current_frame().closure->upvalues()[instruction[1]]->location() = peek_value();
+    return RunStatus::Next;
+}
+
+auto runtime::op_equal(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    Value rhs = pop_value();
+    Value lhs = pop_value();
+    push_value(Value::boolean(lhs == rhs));
+    return RunStatus::Next;
+}
+
+auto runtime::op_greater(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(binary_op<OpCode::Greater>());
+}
+
+auto runtime::op_less(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(binary_op<OpCode::Less>());
+}
+
+auto runtime::op_add(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(add());
+}
+
+auto runtime::op_concat(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(concat(instruction[1]));
+}
+
+auto runtime::op_substract(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(binary_op<OpCode::Substract>());
+}
+
+auto runtime::op_multiply(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(binary_op<OpCode::Multiply>());
+}
+
+auto runtime::op_divide(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(binary_op<OpCode::Divide>());
+}
+
+auto runtime::op_not(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    push_value(Value::boolean(is_falsey(pop_value())));
+    return RunStatus::Next;
+}
+
+auto runtime::op_negate(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(negate());
+}
+
+auto runtime::op_print(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    std::println("{}", pop_value());
+    return RunStatus::Next;
+}
+
+auto runtime::op_call(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    Byte arg_count = instruction[1];
+
+    auto frame_count = g_vm->frames.size();
+    return call_status_of(call_value(peek_value(arg_count), arg_count), frame_count);
+}
+
+auto runtime::op_call_method(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    Byte arg_count = instruction[1];
+
+    auto frame_count = g_vm->frames.size();
+    return call_status_of(call_method(arg_count), frame_count);
+}
+
+auto runtime::op_tail_call(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    Byte arg_count = instruction[1];
+
+    // the frame count stays the same, a replaced frame is told by its elided count
+    auto elided = current_frame().elided;
+    if (!call_value(peek_value(arg_count), arg_count, /* tail = */ true)) {
+        return RunStatus::Error;
+    }
+    return current_frame().elided == elided ? RunStatus::Next : RunStatus::Switch;
+}
+
+auto runtime::op_invoke(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<3>(ip);
+    auto * name = constant_at(instruction[1]).as_objstring();
+    Byte arg_count = instruction[2];
+
+    auto frame_count = g_vm->frames.size();
+    return call_status_of(invoke(name, arg_count), frame_count);
+}
+
+auto runtime::op_super_invoke(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<3>(ip);
+    auto * name = constant_at(instruction[1]).as_objstring();
+    Byte arg_count = instruction[2];
+
+    auto frame_count = g_vm->frames.size();
+    return call_status_of(super_invoke(name, arg_count), frame_count);
+}
+
+auto runtime::op_closure(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    auto * function = constant_at(instruction[1]).as_objfunction();
+    auto upvalues_size = 2 * function->upvalue_count();
+
+    make_closure(*function, std::span{current_frame().ip, upvalues_size});
+    std::advance(current_frame().ip, upvalues_size);
+    return RunStatus::Next;
+}
+
+auto runtime::op_close_upvalue(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    close_upvalues(&g_vm->stack.back());
+    pop_value();
+    return RunStatus::Next;
+}
+
+auto runtime::op_return(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return return_from_call() ? RunStatus::Halt : RunStatus::Switch;
+}
+
+auto runtime::op_class(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    push_value(Value::cls(constant_at(instruction[1]).as_objstring()));
+    return RunStatus::Next;
+}
+
+auto runtime::op_inherit(const Byte * ip) -> RunStatus
+{
+    enter_instruction<1>(ip);
+    return status_of(inherit());
+}
+
+auto runtime::op_method(const Byte * ip) -> RunStatus
+{
+    auto instruction = enter_instruction<2>(ip);
+    return status_of(define_method(constant_at(instruction[1]).as_objstring()));
+}
+
+auto runtime::code_start(const ObjFunction & function) -> const Byte *
+{
+    return function.get_chunk().code.data();
+}
+
+auto runtime::branch_if_false(const Byte * /* ip */) -> RunStatus
+{
+    return is_falsey(peek_value()) ? RunStatus::Branch : RunStatus::Next;
+}
+
+auto runtime_entry(OpCode op) -> std::optional<RuntimeEntry>
+{
+    using enum OpCode;
+
+    switch (op) {
+    // Values
+    case Constant: return RuntimeEntry{runtime::op_constant, "op_constant"};
+    case Nil: return RuntimeEntry{runtime::op_nil, "op_nil"};
+    case True: return RuntimeEntry{runtime::op_true, "op_true"};
+    case False: return RuntimeEntry{runtime::op_false, "op_false"};
+    case List: return RuntimeEntry{runtime::op_list, "op_list"};
+    // Value manipulators
+    case Pop: return RuntimeEntry{runtime::op_pop, "op_pop"};
+    case DefineGlobal: return RuntimeEntry{runtime::op_define_global, "op_define_global"};
+    case GetGlobal: return RuntimeEntry{runtime::op_get_global, "op_get_global"};
+    case GetIndex: return RuntimeEntry{runtime::op_get_index, "op_get_index"};
+    case GetLocal: return RuntimeEntry{runtime::op_get_local, "op_get_local"};
+    case GetProperty: return RuntimeEntry{runtime::op_get_property, "op_get_property"};
+    case GetMethod: return RuntimeEntry{runtime::op_get_method, "op_get_method"};
+    case GetSuper: return RuntimeEntry{runtime::op_get_super, "op_get_super"};
+    case GetSuperMethod: return RuntimeEntry{runtime::op_get_super_method, "op_get_super_method"};
+    case GetUpvalue: return RuntimeEntry{runtime::op_get_upvalue, "op_get_upvalue"};
+    case SetGlobal: return RuntimeEntry{runtime::op_set_global, "op_set_global"};
+    case SetIndex: return RuntimeEntry{runtime::op_set_index, "op_set_index"};
+    case SetLocal: return RuntimeEntry{runtime::op_set_local, "op_set_local"};
+    case SetProperty: return RuntimeEntry{runtime::op_set_property, "op_set_property"};
+    case SetUpvalue: return RuntimeEntry{runtime::op_set_upvalue, "op_set_upvalue"};
+    // Comparison ops
+    case Equal: return RuntimeEntry{runtime::op_equal, "op_equal"};
+    case Greater: return RuntimeEntry{runtime::op_greater, "op_greater"};
+    case Less: return RuntimeEntry{runtime::op_less, "op_less"};
+    // Binary ops
+    case Add: return RuntimeEntry{runtime::op_add, "op_add"};
+    case Concat: return RuntimeEntry{runtime::op_concat, "op_concat"};
+    case Substract: return RuntimeEntry{runtime::op_substract, "op_substract"};
+    case Multiply: return RuntimeEntry{runtime::op_multiply, "op_multiply"};
+    case Divide: return RuntimeEntry{runtime::op_divide, "op_divide"};
+    // Unary ops
+    case Not: return RuntimeEntry{runtime::op_not, "op_not"};
+    case Negate: return RuntimeEntry{runtime::op_negate, "op_negate"};
+    // Aux
+    case Print: return RuntimeEntry{runtime::op_print, "op_print"};
+    case Jump:
+    case JumpIfFalse:
+    case Loop: return std::nullopt;
+    case Call: return RuntimeEntry{runtime::op_call, "op_call"};
+    case CallMethod: return RuntimeEntry{runtime::op_call_method, "op_call_method"};
+    case TailCall: return RuntimeEntry{runtime::op_tail_call, "op_tail_call"};
+    case Invoke: return RuntimeEntry{runtime::op_invoke, "op_invoke"};
+    case SuperInvoke: return RuntimeEntry{runtime::op_super_invoke, "op_super_invoke"};
+    case Closure: return RuntimeEntry{runtime::op_closure, "op_closure"};
+    case CloseUpvalue: return RuntimeEntry{runtime::op_close_upvalue, "op_close_upvalue"};
+    case Return: return RuntimeEntry{runtime::op_return, "op_return"};
+    case Class: return RuntimeEntry{runtime::op_class, "op_class"};
+    case Inherit: return RuntimeEntry{runtime::op_inherit, "op_inherit"};
+    case Method: return RuntimeEntry{runtime::op_method, "op_method"};
+    }
+    std::unreachable();
 }
 
 } // namespace cpplox
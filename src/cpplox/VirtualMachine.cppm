@@ -3,29 +3,66 @@ export module cpplox:VirtualMachine;
 import std;
 
 import :Chunk;
+import :CodeArena;
+import :Events;
+import :Obj;
+import :Object;
+import :Runtime;
 import :Value;
+import :ValueStack;
 
 namespace cpplox {
 
-export struct CallFrame
+// Both stacks grow as needed, the limit only catches runaway recursion
+export constexpr const std::size_t DEFAULT_MAX_FRAMES = 1'000'000;
+
+export struct VmOptions
 {
-    ObjClosure * closure;
-    const Byte * ip;
-    Value * slots; // TODO: std::span? or store offset?
+    // Functions are JIT-compiled after being called this many times. Disabled if empty.
+    std::optional<std::size_t> jit_threshold;
+    // Back code arenas of large scripts with huge pages
+    bool huge_pages = false;
+    // Compile function bodies on their first call, compile errors in them are reported then
+    bool lazy_compile = false;
+    // Calls nested deeper than this fail with "Stack overflow."
+    std::size_t max_frames = DEFAULT_MAX_FRAMES;
+};
+
+// Set by a native to leave run() once it returns, see call_value()
+enum class NativeSignal : std::uint8_t {
+    None,
+    Suspend, // yield() suspends the running coroutine
+    Error,   // a runtime error was reported and has unwound the stacks
 };
 
 export struct VirtualMachine
 {
     std::vector<CallFrame> frames;
-    std::vector<Value> stack;
+    ValueStack stack;
     std::vector<Obj *> objects;
-    std::unordered_map<std::string, Value> globals;
-    // TODO: intrusive list used to guarantee sorted order. Could be an std::set or std::list?
-    ObjUpvalue * open_upvalues = nullptr; // intrusive list
+    StringMap<Value> globals;
+    // Indexed by stack slot, null for slots which are not captured. Holds no slots above the
+    // highest open upvalue, so closing scans at most the slots of returning frame.
+    std::vector<ObjUpvalue *> open_upvalues;
+    std::size_t open_upvalue_count = 0;
 
     std::unordered_set<Obj *> gray_objects; // gray-marked
     std::size_t bytes_allocated = 0;
     std::size_t next_gc = 1024 * 1024;
+
+    std::optional<std::size_t> jit_threshold;
+    bool huge_pages = false;
+    bool lazy_compile = false;
+    std::size_t max_frames = DEFAULT_MAX_FRAMES;
+
+    std::vector<std::unique_ptr<CodeArena>> code_arenas; // one per script with enough code
+    std::unordered_multiset<Obj *> host_roots;           // objects held by the embedder, see Root
+
+    ObjCoroutine * coroutine = nullptr; // running one, null outside of coroutines
+    NativeSignal native_signal = NativeSignal::None;
+    bool compile_failed = false; // a lazy function body did not compile, see stopped()
+
+    EventLoop events; // I/O and timers started by the script
 };
 
 // TODO: make this store error only, and use std::expected<std::monostate, InterpretError> for this
@@ -35,13 +72,72 @@ export enum class [[nodiscard]] InterpretResult : std::uint8_t {
     RuntimeError,
 };
 
-// FIXME: get rid of singleton instance
-VirtualMachine g_vm; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// VM of the current thread, between `init_vm()` and `free_vm()`. Each thread runs its own VM, they
+// share no objects. A pointer rather than an object: thread-locals with constructors are reached
+// through an initialization check on every access from other translation units.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+constinit thread_local VirtualMachine * g_vm = nullptr;
 
-// FIXME: Should be done by constructor/desctructor, but should get rid of global object first
-export auto init_vm() -> void;
+// Creates and destroys the VM of the current thread
+export auto init_vm(VmOptions options = {}) -> void;
 export auto free_vm() -> void;
 
-export auto interpret(std::string_view source) -> InterpretResult;
+// Makes room for pushing `count` values onto the stack of the VM. Pushes do not check for it.
+auto reserve_stack(std::size_t count) -> void;
+
+// Options the VM was created with
+auto options_of(const VirtualMachine & vm) -> VmOptions;
+
+// `owner` keeps `source` alive for functions compiled lazily, see compile()
+export auto interpret(std::string_view source, std::shared_ptr<const void> owner = nullptr)
+        -> InterpretResult;
+auto interpret(ObjFunction & script) -> InterpretResult;
+
+// `interpret()` in two steps, for scripts which are run more than once
+auto freeze_script(ObjFunction & script) -> void;
+auto run_script(ObjFunction & script) -> InterpretResult;
+
+// Moves code of the functions next to each other into a read-only arena, in the given order. Code
+// of a few functions (e.g. of a REPL line) stays on the heap.
+auto freeze_functions(std::span<ObjFunction * const> functions) -> void;
+
+// Call a global or a value from outside of running code. Return empty result if a runtime error
+// was reported.
+auto call_global(std::string_view name, std::span<const Value> args) -> std::optional<Value>;
+auto call_function(Value callee, std::span<const Value> args) -> std::optional<Value>;
+
+auto define_native(std::string_view name, Value::NativeFn callable) -> void;
+
+// Runs the coroutine until it yields or returns, and returns the value it has yielded or returned.
+// Nil if it is done already. Empty result if it has failed with a runtime error, which has been
+// reported and has unwound its resumers as well: natives calling this must return right away with
+// `NativeSignal::Error` then.
+auto resume_coroutine(ObjCoroutine & coroutine, Value value) -> std::optional<Value>;
+
+// Suspends the running coroutine once the native calling this has returned, resume_coroutine()
+// returns the result of the native. Returns false outside of coroutines.
+auto suspend_coroutine() -> bool;
+
+// Makes the VM current on this thread for the lifetime of the guard, e.g. to allocate objects in a
+// VM other than the one running
+class CurrentVm
+{
+public:
+    explicit CurrentVm(VirtualMachine * vm)
+        : m_previous(std::exchange(g_vm, vm))
+    {
+    }
+    ~CurrentVm() { g_vm = m_previous; }
+
+    CurrentVm(const CurrentVm &) = delete;
+    CurrentVm(CurrentVm &&) = delete;
+    auto operator=(const CurrentVm &) -> CurrentVm & = delete;
+    auto operator=(CurrentVm &&) -> CurrentVm & = delete;
+
+    [[nodiscard]] auto previous() const -> VirtualMachine * { return m_previous; }
+
+private:
+    VirtualMachine * m_previous;
+};
 
 } // namespace cpplox
@@ -0,0 +1,412 @@
+module cpplox;
+
+import std;
+
+import :Events;
+import :Object;
+import :Snapshot;
+import :Value;
+import :VirtualMachine;
+import :Workers;
+
+namespace cpplox {
+
+namespace {
+
+// Value copied out of a VM into a heap of its own, so that it can be copied into a VM running on
+// another thread. Values without objects are kept as they are.
+class Message
+{
+public:
+    explicit Message(Value value)
+        : m_value(value)
+    {
+        if (!value.is_obj()) {
+            return;
+        }
+        CurrentVm current{new VirtualMachine{}}; // NOLINT(cppcoreguidelines-owning-memory)
+        m_heap = g_vm;
+        m_value = copy_values(*current.previous(), std::span{&value, 1}).front();
+    }
+
+    ~Message()
+    {
+        if (m_heap != nullptr) {
+            CurrentVm current{m_heap};
+            free_vm();
+        }
+    }
+
+    Message(const Message &) = delete;
+    Message(Message && other) noexcept
+        : m_heap(std::exchange(other.m_heap, nullptr))
+        , m_value(other.m_value)
+    {
+    }
+    auto operator=(const Message &) -> Message & = delete;
+    auto operator=(Message &&) -> Message & = delete;
+
+    // Copy of the value in the current VM, not rooted
+    [[nodiscard]] auto unpack() const -> Value
+    {
+        if (m_heap == nullptr) {
+            return m_value;
+        }
+        return copy_values(*m_heap, std::span{&m_value, 1}).front();
+    }
+
+private:
+    VirtualMachine * m_heap = nullptr;
+    Value m_value;
+};
+
+struct Task
+{
+    Task() = default;
+    ~Task()
+    {
+        if (vm != nullptr) { // never run
+            CurrentVm current{vm};
+            free_vm();
+        }
+    }
+
+    Task(const Task &) = delete;
+    Task(Task &&) = delete;
+    auto operator=(const Task &) -> Task & = delete;
+    auto operator=(Task &&) -> Task & = delete;
+
+    VirtualMachine * vm = nullptr; // freed once the call has returned
+    std::vector<Value> call;       // callee followed by arguments, objects are in `vm`
+    std::optional<Message> result; // set before `done`
+    std::atomic<bool> done = false;
+};
+
+struct Channel
+{
+    std::mutex mutex;
+    std::deque<Message> messages;
+};
+
+// Objects shared between VMs are referred to by numeric ids, Lox values of other VMs cannot point
+// to them
+template <class T> class Handles
+{
+public:
+    auto add(std::shared_ptr<T> object) -> Value
+    {
+        std::scoped_lock lock{m_mutex};
+        auto id = m_next_id++;
+        m_objects.emplace(id, std::move(object));
+        return Value::number(static_cast<double>(id));
+    }
+
+    auto find(Value id) -> std::shared_ptr<T>
+    {
+        std::scoped_lock lock{m_mutex};
+        auto it = m_objects.find(key_of(id));
+        return it != m_objects.end() ? it->second : nullptr;
+    }
+
+    auto remove(Value id) -> std::shared_ptr<T>
+    {
+        std::scoped_lock lock{m_mutex};
+        auto node = m_objects.extract(key_of(id));
+        return node.empty() ? nullptr : std::move(node.mapped());
+    }
+
+private:
+    // Values other than ids map to 0, which is never used
+    static auto key_of(Value id) -> std::uint64_t
+    {
+        if (!id.is_number() || id.as_number() < 1 || id.as_number() >= 0x1p53
+            || id.as_number() != std::floor(id.as_number())) {
+            return 0;
+        }
+        return static_cast<std::uint64_t>(id.as_number());
+    }
+
+    std::mutex m_mutex;
+    std::unordered_map<std::uint64_t, std::shared_ptr<T>> m_objects;
+    std::uint64_t m_next_id = 1;
+};
+
+constexpr const std::size_t NO_QUEUE = std::numeric_limits<std::size_t>::max();
+
+// Queue owned by the pool thread running on this thread
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+constinit thread_local std::size_t t_own_queue = NO_QUEUE;
+
+auto run_task(Task & task) -> void
+{
+    {
+        CurrentVm current{task.vm};
+        auto result = call_function(task.call.front(), std::span{task.call}.subspan(1));
+        task.result.emplace(result.value_or(Value::nil()));
+        // operations started by the task complete before it is done, a failing callback fails it
+        if (result.has_value() && !run_event_loop()) {
+            task.result.emplace(Value::nil());
+        }
+        free_vm();
+    }
+    task.vm = nullptr;
+    task.done = true;
+}
+
+// Work stealing: every pool thread takes tasks from the back of its own queue, idle threads steal
+// from the front of the other queues. Tasks spawned on a pool thread go to its own queue, so that
+// related work stays on one core, others are spread round-robin.
+class Scheduler
+{
+public:
+    static auto instance() -> Scheduler &
+    {
+        static Scheduler scheduler{std::max(1U, std::thread::hardware_concurrency())};
+        return scheduler;
+    }
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler(Scheduler &&) = delete;
+    auto operator=(const Scheduler &) -> Scheduler & = delete;
+    auto operator=(Scheduler &&) -> Scheduler & = delete;
+
+    ~Scheduler()
+    {
+        {
+            std::scoped_lock lock{m_mutex};
+            m_stopping = true;
+            m_events++;
+        }
+        m_changed.notify_all();
+        m_threads.clear(); // joins them, before the queues are gone
+    }
+
+    auto submit(std::shared_ptr<Task> task) -> void
+    {
+        auto index = t_own_queue != NO_QUEUE ? t_own_queue : m_next_queue++ % m_queues.size();
+        {
+            std::scoped_lock lock{m_queues[index].mutex};
+            m_queues[index].tasks.push_back(std::move(task));
+        }
+        notify();
+    }
+
+    // Wakes up threads waiting for something to change, e.g. a task being done
+    auto notify() -> void
+    {
+        {
+            std::scoped_lock lock{m_mutex};
+            m_events++;
+        }
+        m_changed.notify_all();
+    }
+
+    // Runs queued tasks until `done` returns true. Waiting threads would otherwise starve the pool
+    // if the tasks they wait for are queued behind them. Returns false once the pool is stopping,
+    // what is waited for may never happen then and the pool threads have to be joined.
+    template <std::predicate Done> auto wait_until(Done done) -> bool
+    {
+        for (;;) {
+            auto seen = events();
+            if (done()) {
+                return true;
+            }
+            if (stopping()) {
+                return false;
+            }
+            if (!run_one()) {
+                wait_for_event(seen);
+            }
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<Task>> tasks;
+    };
+
+    explicit Scheduler(std::size_t thread_count)
+        : m_queues(thread_count)
+    {
+        for (std::size_t index = 0; index < thread_count; index++) {
+            m_threads.emplace_back([this, index] { work(index); });
+        }
+    }
+
+    auto work(std::size_t index) -> void
+    {
+        t_own_queue = index;
+        for (;;) {
+            auto seen = events();
+            if (stopping()) {
+                return;
+            }
+            if (!run_one()) {
+                wait_for_event(seen);
+            }
+        }
+    }
+
+    auto run_one() -> bool
+    {
+        auto task = take();
+        if (task == nullptr) {
+            return false;
+        }
+        run_task(*task);
+        notify();
+        return true;
+    }
+
+    auto take() -> std::shared_ptr<Task>
+    {
+        if (t_own_queue != NO_QUEUE) {
+            auto & own = m_queues[t_own_queue];
+            std::scoped_lock lock{own.mutex};
+            if (!own.tasks.empty()) {
+                auto task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+
+        auto start = t_own_queue != NO_QUEUE ? t_own_queue + 1 : 0;
+        for (std::size_t i = 0; i < m_queues.size(); i++) {
+            auto & other = m_queues[(start + i) % m_queues.size()];
+            std::scoped_lock lock{other.mutex};
+            if (!other.tasks.empty()) {
+                auto task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    auto events() -> std::uint64_t
+    {
+        std::scoped_lock lock{m_mutex};
+        return m_events;
+    }
+
+    auto stopping() -> bool
+    {
+        std::scoped_lock lock{m_mutex};
+        return m_stopping;
+    }
+
+    auto wait_for_event(std::uint64_t seen) -> void
+    {
+        std::unique_lock lock{m_mutex};
+        m_changed.wait(lock, [this, seen] { return m_events != seen || m_stopping; });
+    }
+
+    std::vector<Queue> m_queues;
+    std::atomic<std::size_t> m_next_queue = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::uint64_t m_events = 0; // guarded by m_mutex, counts everything waiters may wait for
+    bool m_stopping = false;    // guarded by m_mutex
+
+    std::vector<std::jthread> m_threads; // last, they use everything above
+};
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+Handles<Task> g_tasks;
+Handles<Channel> g_channels;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+auto is_callable(Value value) -> bool
+{
+    return value.is_closure() || value.is_native() || value.is_class() || value.is_bound_method();
+}
+
+auto spawn(std::span<const Value> args) -> Value
+{
+    if (args.empty() || !is_callable(args.front())) {
+        return Value::nil();
+    }
+
+    // The whole heap reachable from the globals is copied, whatever the callee uses of it: spawning
+    // costs as much as the program has allocated and is kept alive by its globals
+    auto task = std::make_shared<Task>();
+    {
+        CurrentVm current{nullptr};
+        init_vm(options_of(*current.previous()));
+        task->vm = g_vm;
+        task->call = copy_globals(*current.previous(), args);
+    }
+
+    auto id = g_tasks.add(task);
+    Scheduler::instance().submit(std::move(task));
+    return id;
+}
+
+auto join(std::span<const Value> args) -> Value
+{
+    auto task = args.empty() ? nullptr : g_tasks.remove(args.front());
+    if (task == nullptr) {
+        return Value::nil();
+    }
+    if (!Scheduler::instance().wait_until([&task] { return task->done.load(); })) {
+        return Value::nil();
+    }
+    return task->result->unpack();
+}
+
+auto channel(std::span<const Value> /* args */) -> Value
+{
+    return g_channels.add(std::make_shared<Channel>());
+}
+
+auto send(std::span<const Value> args) -> Value
+{
+    auto channel = args.empty() ? nullptr : g_channels.find(args.front());
+    if (channel == nullptr) {
+        return Value::boolean(false);
+    }
+
+    Message message{args.size() > 1 ? args[1] : Value::nil()};
+    {
+        std::scoped_lock lock{channel->mutex};
+        channel->messages.push_back(std::move(message));
+    }
+    Scheduler::instance().notify();
+    return Value::boolean(true);
+}
+
+auto receive(std::span<const Value> args) -> Value
+{
+    auto channel = args.empty() ? nullptr : g_channels.find(args.front());
+    if (channel == nullptr) {
+        return Value::nil();
+    }
+
+    std::optional<Message> message;
+    auto received = Scheduler::instance().wait_until([&channel, &message] {
+        std::scoped_lock lock{channel->mutex};
+        if (channel->messages.empty()) {
+            return false;
+        }
+        message.emplace(std::move(channel->messages.front()));
+        channel->messages.pop_front();
+        return true;
+    });
+    return received ? message->unpack() : Value::nil();
+}
+
+} // namespace
+
+auto define_worker_natives() -> void
+{
+    define_native("spawn", spawn);
+    define_native("join", join);
+    define_native("channel", channel);
+    define_native("send", send);
+    define_native("receive", receive);
+}
+
+} // namespace cpplox
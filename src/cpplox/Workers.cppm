@@ -0,0 +1,20 @@
+export module cpplox:Workers;
+
+namespace cpplox {
+
+// Natives running functions on a thread pool, each call in a VM of its own:
+//   spawn(function, args...)  queues the call, returns id of the task (nil if not callable)
+//   join(task)                waits for the task, returns its result (nil after a runtime error)
+//   channel()                 returns id of a new channel
+//   send(channel, value)      queues the value, returns false for unknown channels
+//   receive(channel)          waits for a value and returns it (nil for unknown channels)
+//
+// A task starts with a copy of the globals of the VM spawning it, arguments, results and sent
+// values are copied too, so VMs share no objects. The copy takes everything reachable from the
+// globals, spawning from a program with large global data is as slow as copying that data. Ids
+// are numbers, they can be passed to tasks. Threads waiting in join() or receive() run queued
+// tasks meanwhile. Tasks still queued when the program exits are dropped, join() and receive()
+// waiting in tasks at that point return nil.
+auto define_worker_natives() -> void;
+
+} // namespace cpplox
@@ -3,9 +3,34 @@ import cpplox;
 
 namespace {
 
-auto repl() -> void
+constexpr const std::size_t DEFAULT_JIT_THRESHOLD = 1000;
+constexpr const std::string_view BYTECODE_EXTENSION = ".loxc";
+
+[[noreturn]] auto usage_error() -> void
 {
-    cpplox::init_vm();
+    std::println(
+            std::cerr,
+            "Usage: cpplox [--jit | --jit-threshold=<calls>] [--huge-pages] [--lazy] "
+            "[--max-frames=<depth>] [--cache=<cache.loxc>] [path]"
+    );
+    std::println(std::cerr, "       cpplox --compile-only=<output.loxc> path");
+    std::println(std::cerr, "       cpplox --emit-cpp=<output.cpp> path");
+    cpplox::exit_program(cpplox::ExitCode::IncorrectUsage);
+}
+
+auto parse_count(std::string_view str) -> std::optional<std::size_t>
+{
+    std::size_t value = 0;
+    auto result = std::from_chars(str.begin(), str.end(), value);
+    if (result.ec != std::errc{} || result.ptr != str.end()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+auto repl(cpplox::VmOptions options) -> void
+{
+    cpplox::init_vm(options);
     for (std::string line; std::print("> "), std::getline(std::cin, line);) {
         [[maybe_unused]] auto result = cpplox::interpret(line);
     }
@@ -13,7 +38,7 @@ auto repl() -> void
     cpplox::free_vm();
 }
 
-auto run_file(const std::filesystem::path & filename) -> void
+auto read_file(const std::filesystem::path & filename) -> std::string
 {
     std::ifstream script(filename);
     if (!script.is_open()) {
@@ -23,10 +48,68 @@ auto run_file(const std::filesystem::path & filename) -> void
 
     std::stringstream buffer;
     buffer << script.rdbuf();
-    script.close();
+    return buffer.str();
+}
+
+// Script source mapped into memory, so that it is not copied on the way to the scanner: tokens
+// point right into the mapping. Files which cannot be mapped (e.g. pipes) are read instead.
+class SourceFile
+{
+public:
+    explicit SourceFile(const std::filesystem::path & filename)
+    {
+        if (auto mapped = cpplox::MappedFile::open(filename); mapped.has_value()) {
+            auto file = std::make_shared<const cpplox::MappedFile>(std::move(mapped.value()));
+            m_text = file->text();
+            m_owner = std::move(file);
+        }
+        else {
+            auto buffer = std::make_shared<const std::string>(read_file(filename));
+            m_text = *buffer;
+            m_owner = std::move(buffer);
+        }
+    }
+
+    [[nodiscard]] auto text() const -> std::string_view { return m_text; }
+
+    // Keeps the text alive, functions compiled lazily hold on to it instead of a copy
+    [[nodiscard]] auto owner() const -> const std::shared_ptr<const void> & { return m_owner; }
+
+private:
+    std::shared_ptr<const void> m_owner;
+    std::string_view m_text;
+};
+
+auto run_file(
+        const std::filesystem::path & filename,
+        cpplox::VmOptions options,
+        std::optional<std::string_view> cache
+) -> void
+{
+    std::optional<cpplox::InterpretResult> result;
+
+    if (filename.extension() == BYTECODE_EXTENSION) {
+        cpplox::init_vm(options);
+        result = cpplox::interpret_bytecode(filename);
+        if (!result.has_value()) {
+            std::println("Failed to load bytecode from {}", filename.native());
+            cpplox::exit_program(cpplox::ExitCode::IncorrectInput);
+        }
+    }
+    else {
+        SourceFile file{filename};
+        auto source = file.text();
+
+        cpplox::init_vm(options);
+        // Bytecode written by --compile-only is used only if asked for and up to date
+        if (cache.has_value()) {
+            result = cpplox::interpret_bytecode(cache.value(), source);
+        }
+        if (!result.has_value()) {
+            result = cpplox::interpret(source, file.owner());
+        }
+    }
 
-    cpplox::init_vm();
-    auto result = cpplox::interpret(buffer.str());
     cpplox::free_vm();
 
     if (result == cpplox::InterpretResult::CompileError) {
@@ -37,6 +120,30 @@ auto run_file(const std::filesystem::path & filename) -> void
     }
 }
 
+// Compiles the script and writes the result with `writer` (e.g. C++ source or bytecode)
+auto compile_file(
+        const std::filesystem::path & filename,
+        const std::filesystem::path & output,
+        bool (*writer)(std::string_view source, std::ostream & out)
+) -> void
+{
+    SourceFile file{filename};
+
+    std::ofstream out(output, std::ios::binary);
+    if (!out.is_open()) {
+        std::println("Failed to open {}", output.native());
+        cpplox::exit_program(cpplox::ExitCode::IOError);
+    }
+
+    cpplox::init_vm();
+    auto compiled = writer(file.text(), out);
+    cpplox::free_vm();
+
+    if (!compiled) {
+        cpplox::exit_program(cpplox::ExitCode::IncorrectInput);
+    }
+}
+
 } // namespace
 
 auto main(int argc, char ** argv) -> int
@@ -46,14 +153,70 @@ auto main(int argc, char ** argv) -> int
             | std::views::transform([](char const * arg) { return std::string_view{arg}; })
             | std::ranges::to<std::vector>();
 
-    if (args.size() == 0) {
-        repl();
+    cpplox::VmOptions options;
+    std::optional<std::string_view> compile_only_output;
+    std::optional<std::string_view> emit_cpp_output;
+    std::optional<std::string_view> cache;
+    std::vector<std::string_view> paths;
+
+    for (auto arg : args) {
+        if (arg == "--jit") {
+            options.jit_threshold = DEFAULT_JIT_THRESHOLD;
+        }
+        else if (constexpr std::string_view opt = "--jit-threshold="; arg.starts_with(opt)) {
+            options.jit_threshold = parse_count(arg.substr(opt.size()));
+            if (!options.jit_threshold.has_value()) {
+                usage_error();
+            }
+        }
+        else if (arg == "--huge-pages") {
+            options.huge_pages = true;
+        }
+        else if (arg == "--lazy") {
+            options.lazy_compile = true;
+        }
+        else if (constexpr std::string_view opt = "--max-frames="; arg.starts_with(opt)) {
+            auto max_frames = parse_count(arg.substr(opt.size()));
+            if (!max_frames.has_value() || max_frames.value() == 0) {
+                usage_error();
+            }
+            options.max_frames = max_frames.value();
+        }
+        else if (constexpr std::string_view opt = "--compile-only="; arg.starts_with(opt)) {
+            compile_only_output = arg.substr(opt.size());
+        }
+        else if (constexpr std::string_view opt = "--emit-cpp="; arg.starts_with(opt)) {
+            emit_cpp_output = arg.substr(opt.size());
+        }
+        else if (constexpr std::string_view opt = "--cache="; arg.starts_with(opt)) {
+            cache = arg.substr(opt.size());
+        }
+        else if (arg.starts_with("--")) {
+            usage_error();
+        }
+        else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (compile_only_output.has_value() || emit_cpp_output.has_value()) {
+        if (paths.size() != 1 || (compile_only_output.has_value() && emit_cpp_output.has_value())) {
+            usage_error();
+        }
+        if (compile_only_output.has_value()) {
+            compile_file(paths[0], compile_only_output.value(), cpplox::write_bytecode);
+        }
+        else {
+            compile_file(paths[0], emit_cpp_output.value(), cpplox::emit_cpp);
+        }
+    }
+    else if (paths.empty() && !cache.has_value()) {
+        repl(options);
     }
-    else if (args.size() == 1) {
-        run_file(args[0]);
+    else if (paths.size() == 1) {
+        run_file(paths[0], options, cache);
     }
     else {
-        std::println(std::cerr, "Usage: cpplox [path]");
-        cpplox::exit_program(cpplox::ExitCode::IncorrectUsage);
+        usage_error();
     }
 }
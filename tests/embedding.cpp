@@ -0,0 +1,221 @@
+// Checks the embedding API (see cpplox::Vm) from the host side
+
+import std;
+import cpplox;
+
+namespace {
+
+constexpr std::string_view RULES = R"(
+var calls = 0;
+
+fun score(base, weight) {
+  calls = calls + 1;
+  return base * weight + bonus;
+}
+
+fun greet(name) {
+  return "hello " + name;
+}
+
+fun garbage(n) {
+  var s = "";
+  for (var i = 0; i < n; i = i + 1) s = s + "garbage ";
+  return s;
+}
+
+class Point {
+  init(x, y) {
+    this.x = x;
+    this.y = y;
+  }
+}
+
+fun make_counter() {
+  var n = 0;
+  fun next() {
+    n = n + 1;
+    return n;
+  }
+  return next;
+}
+
+var counter = make_counter();
+var origin = Point(3, 4);
+var banner = garbage(20);
+
+fun origin_x() {
+  return origin.x;
+}
+
+fun ticks() {
+  for (var i = 1; i <= 3; i = i + 1) yield(i);
+}
+
+var ticker = coroutine(ticks);
+var fresh_ticker = coroutine(ticks);
+
+var items = [1, [2, 3]];
+
+fun item_count() {
+  return items.length() + items[1].length();
+}
+)";
+
+constexpr std::string_view IO = R"(
+var contents;
+
+fun got(data) {
+  contents = data;
+}
+
+fun written(ok) {
+  if (ok) read_file(path, got);
+}
+
+write_file(path, "written by lox", written);
+)";
+
+constexpr std::string_view FAILING_IO = R"(
+fun fail(data) {
+  return data - 1;
+}
+
+for (var i = 0; i < 4; i = i + 1) read_file(path, fail);
+)";
+
+std::size_t g_failures = 0; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+auto check(
+        bool ok, std::string_view what, std::source_location loc = std::source_location::current()
+) -> void
+{
+    if (!ok) {
+        std::println(std::cerr, "{}:{}: check failed: {}", loc.file_name(), loc.line(), what);
+        g_failures++;
+    }
+}
+
+auto is_number(std::optional<cpplox::Value> value, double expected) -> bool
+{
+    return value.has_value() && value->is_number() && value->as_number() == expected;
+}
+
+auto is_string(std::optional<cpplox::Value> value, std::string_view expected) -> bool
+{
+    return value.has_value() && value->is_string() && value->as_string() == expected;
+}
+
+} // namespace
+
+auto main() -> int
+{
+    cpplox::Vm vm;
+    auto script = vm.compile(RULES);
+    check(script.has_value(), "script compiles");
+    check(vm.run(*script) == cpplox::InterpretResult::Ok, "script runs");
+
+    vm.set_global("bonus", 1);
+    check(is_number(vm.call("score", 2, 3.5), 8), "score(2, 3.5)");
+    vm.set_global("bonus", 10);
+    for (int i = 0; i < 1000; i++) {
+        check(is_number(vm.call("score", i, 1), i + 10), "score(i, 1)");
+    }
+    check(is_number(vm.get_global("calls"), 1001), "calls counted");
+
+    check(is_string(vm.call("greet", "host"), "hello host"), "greet(\"host\")");
+
+    // Strings built piece by piece are ropes inside the VM, the host gets them flattened
+    std::string banner;
+    for (int i = 0; i < 20; i++) {
+        banner += "garbage ";
+    }
+    check(is_string(vm.call("garbage", 20), banner), "long string returned");
+    check(is_string(vm.get_global("banner"), banner), "long string global");
+    auto now = vm.call("clock");
+    check(now.has_value() && now->is_number(), "natives are called without a frame");
+
+    auto point = vm.call("Point", 1, 2);
+    check(point.has_value() && point->is_instance(), "classes are constructed");
+
+    // Rooted values survive collections triggered by later calls, unlike unrooted ones
+    auto greeting = vm.root(vm.call("greet", "root").value());
+    for (int i = 0; i < 100; i++) {
+        check(vm.call("garbage", 1000).has_value(), "garbage(1000)");
+    }
+    check(is_string(greeting.value(), "hello root"), "rooted string");
+
+    // Runtime errors are reported and leave the VM usable
+    check(!vm.call("missing").has_value(), "undefined function");
+    check(!vm.call("score", 1).has_value(), "wrong arity");
+    check(!vm.call("score", "a", 1).has_value(), "runtime error in callee");
+    check(is_number(vm.call("score", 1, 1), 11), "call after errors");
+
+    // Scripts run again, and VMs are independent of each other
+    check(vm.run(*script) == cpplox::InterpretResult::Ok, "script runs again");
+    check(is_number(vm.get_global("calls"), 0), "globals redefined");
+
+    // Coroutines are resumed by the host as well, between calls
+    auto ticker = vm.get_global("ticker").value();
+    check(is_number(vm.call("resume", ticker), 1), "resume(ticker)");
+    check(is_number(vm.call("score", 1, 1), 11), "call between resumes");
+    check(is_number(vm.call("resume", ticker), 2), "resume(ticker) again");
+
+    // VMs started from a snapshot get a copy of everything, shared with nothing
+    check(is_number(vm.call("counter"), 1), "counter()");
+    auto snapshot = vm.snapshot();
+    cpplox::Vm warm{snapshot};
+    check(is_number(warm.call("counter"), 2), "closure state copied");
+    check(is_number(vm.call("counter"), 2), "closure state not shared");
+    check(is_number(warm.call("origin_x"), 3), "instances copied");
+    check(is_number(warm.call("item_count"), 4), "lists copied");
+    check(is_number(warm.call("score", 2, 1), 12), "functions copied");
+    check(is_string(warm.get_global("banner"), banner), "ropes copied as strings");
+    auto is_done = [](cpplox::Vm & in, std::string_view name) {
+        auto done = in.call("done", in.get_global(name).value());
+        return done.has_value() && done->is_boolean() && done->as_boolean();
+    };
+    check(is_done(warm, "ticker"), "started coroutines copied as done");
+    check(!is_done(warm, "fresh_ticker"), "coroutines not started copied as they are");
+    auto fresh_ticker = warm.get_global("fresh_ticker").value();
+    check(is_number(warm.call("resume", fresh_ticker), 1), "copied coroutine runs");
+    warm.set_global("bonus", 0);
+    check(is_number(vm.call("score", 2, 1), 12), "globals not shared");
+    cpplox::Vm warm_again{snapshot};
+    check(is_number(warm_again.call("counter"), 2), "snapshot unchanged by its VMs");
+
+    // Callbacks of I/O started by a script run before run() returns
+    cpplox::Vm io;
+    auto path = std::filesystem::temp_directory_path()
+                / std::format("cpplox-embedding-{}", std::random_device{}());
+    auto path_name = path.string();
+    io.set_global("path", std::string_view{path_name});
+    auto io_script = io.compile(IO);
+    check(io_script.has_value(), "I/O script compiles");
+    check(io.run(*io_script) == cpplox::InterpretResult::Ok, "I/O script runs");
+    check(is_string(io.get_global("contents"), "written by lox"), "file written and read back");
+
+    // A failing callback drops the I/O still pending, the next run does not wait for it
+    auto failing_script = io.compile(FAILING_IO);
+    check(failing_script.has_value(), "failing I/O script compiles");
+    check(io.run(*failing_script) == cpplox::InterpretResult::RuntimeError, "callback fails");
+    auto next_script = io.compile("var done = true;");
+    check(next_script.has_value() && io.run(*next_script) == cpplox::InterpretResult::Ok,
+          "run after failed callback");
+    std::filesystem::remove(path);
+
+    cpplox::Vm other;
+    check(!other.get_global("calls").has_value(), "other VM has no globals of the first");
+    check(!other.compile("fun broken( {}").has_value(), "compile errors");
+
+    // Errors in lazily compiled bodies fail the call, the host keeps running
+    cpplox::Vm lazy{{.lazy_compile = true}};
+    auto lazy_script = lazy.compile("fun broken() { return 1 +; } fun fine() { return 2; }");
+    check(lazy_script.has_value(), "lazy script compiles");
+    check(lazy.run(*lazy_script) == cpplox::InterpretResult::Ok, "lazy script runs");
+    check(!lazy.call("broken").has_value(), "compile error in lazy body");
+    check(!lazy.call("broken").has_value(), "compile error in lazy body reported again");
+    check(is_number(lazy.call("fine"), 2), "call after compile error");
+
+    std::println(std::cerr, "{} failures", g_failures);
+    return g_failures == 0 ? 0 : static_cast<int>(cpplox::ExitCode::SoftwareError);
+}
@@ -0,0 +1,110 @@
+// Checks that the scanner gives the same tokens with and without SIMD, see set_scanner_simd().
+// Arguments are scripts to compare the tokens of, generated sources put every kind of run across
+// block boundaries.
+
+import std;
+import cpplox;
+
+namespace {
+
+// Longest SIMD block, runs are shifted across every offset within it
+constexpr const std::size_t MAX_BLOCK_SIZE = 32;
+
+std::size_t g_failures = 0; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+auto scan_all(std::string_view source, bool simd) -> std::vector<cpplox::Token>
+{
+    cpplox::set_scanner_simd(simd);
+    cpplox::init_scanner(source);
+    std::vector<cpplox::Token> tokens;
+    do {
+        tokens.push_back(cpplox::scan_token());
+    } while (tokens.back().type != cpplox::TokenType::EndOfFile);
+    cpplox::set_scanner_simd(true);
+    return tokens;
+}
+
+// Lexemes of error tokens are messages, the others have to point to the same characters
+auto same(const cpplox::Token & lhs, const cpplox::Token & rhs) -> bool
+{
+    auto same_lexeme = lhs.type == cpplox::TokenType::Error
+                               ? lhs.lexeme == rhs.lexeme
+                               : lhs.lexeme.data() == rhs.lexeme.data()
+                                         && lhs.lexeme.size() == rhs.lexeme.size();
+    return lhs.type == rhs.type && same_lexeme && lhs.sloc == rhs.sloc;
+}
+
+auto compare(std::string_view source, std::string_view name) -> void
+{
+    auto blocks = scan_all(source, /* simd = */ true);
+    auto chars = scan_all(source, /* simd = */ false);
+    auto [block, chr] = std::ranges::mismatch(blocks, chars, same);
+    if (block == blocks.end() && chr == chars.end()) {
+        return;
+    }
+
+    std::print(std::cerr, "{}: tokens differ", name);
+    if (block != blocks.end() && chr != chars.end()) {
+        std::print(
+                std::cerr,
+                " at {}:{}, {} '{}' with SIMD, {} '{}' without",
+                chr->sloc.line,
+                chr->sloc.column,
+                block->type,
+                block->lexeme,
+                chr->type,
+                chr->lexeme
+        );
+    }
+    std::println(std::cerr);
+    g_failures++;
+}
+
+// Runs of every kind, with non-ASCII bytes (UTF-8 and stray ones) inside and right after them
+auto generated_sources() -> std::vector<std::string>
+{
+    const std::array runs = {
+            std::string(MAX_BLOCK_SIZE + 3, 'a'),
+            std::string{"_identifier_with_digits_0123456789_and_CAPITALS"},
+            std::string(MAX_BLOCK_SIZE * 2, ' ') + "\t\r\n\t x",
+            "// comment r\xC3\xA9sum\xC3\xA9 \xFF\x80 " + std::string(MAX_BLOCK_SIZE, '/') + "\n",
+            "\"string \xE2\x82\xAC \xFF\x80 " + std::string(MAX_BLOCK_SIZE, '.') + "\"",
+            "\"multi\nline\n" + std::string(MAX_BLOCK_SIZE, '"') + "\"",
+            std::string{"caf\xC3\xA9 na\xEF\xBF\xBDve \x7F\x80"},
+            std::string{"\"unterminated string " + std::string(MAX_BLOCK_SIZE, 'z')},
+    };
+
+    std::vector<std::string> sources;
+    for (std::size_t shift = 0; shift <= MAX_BLOCK_SIZE; shift++) {
+        for (const auto & run : runs) {
+            auto prefix = std::string(shift, ' ');
+            sources.push_back(prefix + run);
+            sources.push_back(prefix + run + " + " + run + ";");
+            // ends right where the run does, the tail is shorter than a block
+            sources.push_back(prefix + run.substr(0, run.size() - shift % run.size()));
+        }
+    }
+    return sources;
+}
+
+auto read_file(const std::filesystem::path & path) -> std::string
+{
+    std::ifstream file{path, std::ios::binary};
+    return {std::istreambuf_iterator<char>{file}, {}};
+}
+
+} // namespace
+
+auto main(int argc, char ** argv) -> int
+{
+    for (const auto & source : generated_sources()) {
+        compare(source, std::format("{:?}", source));
+    }
+    auto paths = std::span(argv, static_cast<std::size_t>(argc)) | std::views::drop(1);
+    for (const char * path : paths) {
+        compare(read_file(path), path);
+    }
+
+    std::println(std::cerr, "{} failures", g_failures);
+    return g_failures == 0 ? 0 : static_cast<int>(cpplox::ExitCode::SoftwareError);
+}
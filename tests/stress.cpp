@@ -0,0 +1,141 @@
+// Runs every script on several threads at once, each thread with a VM of its own. Meant to be
+// built with -DENABLE_THREAD_SANITIZER=ON, where it catches state shared between VMs; without it
+// only checks that all threads agree on the result.
+//
+//   ./build/tests/cpplox-stress [--threads=<count>] path...
+
+import std;
+import cpplox;
+
+namespace {
+
+constexpr const std::size_t DEFAULT_THREADS = 8;
+// Enough for the deepest test, and keeps the runaway recursion tests from taking gigabytes on
+// every thread
+constexpr const std::size_t MAX_FRAMES = 20'000;
+
+auto read_file(const std::filesystem::path & path) -> std::optional<std::string>
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return std::nullopt;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+// Same rule as tests/CMakeLists.txt: compile errors are the ones reported with "Error"
+auto expected_result(const std::filesystem::path & path) -> cpplox::InterpretResult
+{
+    std::ifstream err(std::filesystem::path{path} += ".err");
+    std::string first_line;
+    if (!err.is_open() || !std::getline(err, first_line)) {
+        return cpplox::InterpretResult::Ok;
+    }
+    static const std::regex compile_error{R"(^\[[0-9]+:[0-9]+\] Error)"};
+    return std::regex_search(first_line, compile_error) ? cpplox::InterpretResult::CompileError
+                                                        : cpplox::InterpretResult::RuntimeError;
+}
+
+auto result_name(cpplox::InterpretResult result) -> std::string_view
+{
+    switch (result) {
+    case cpplox::InterpretResult::Ok: return "ok";
+    case cpplox::InterpretResult::CompileError: return "compile error";
+    case cpplox::InterpretResult::RuntimeError: return "runtime error";
+    }
+    std::unreachable();
+}
+
+// Odd threads JIT-compile every function, so code arenas are written to concurrently as well
+auto run_on_threads(std::string_view source, std::size_t thread_count)
+        -> std::vector<cpplox::InterpretResult>
+{
+    std::vector<cpplox::InterpretResult> results(thread_count, cpplox::InterpretResult::Ok);
+    {
+        std::vector<std::jthread> threads;
+        for (std::size_t i = 0; i < thread_count; i++) {
+            threads.emplace_back([&results, source, i] {
+                cpplox::init_vm({
+                        .jit_threshold = i % 2 == 1 ? std::optional<std::size_t>{0} : std::nullopt,
+                        .max_frames = MAX_FRAMES,
+                });
+                results[i] = cpplox::interpret(source);
+                cpplox::free_vm();
+            });
+        }
+    }
+    return results;
+}
+
+auto parse_threads(std::string_view arg) -> std::optional<std::size_t>
+{
+    constexpr std::string_view PREFIX = "--threads=";
+    if (!arg.starts_with(PREFIX)) {
+        return std::nullopt;
+    }
+    arg.remove_prefix(PREFIX.size());
+    std::size_t value = 0;
+    auto result = std::from_chars(arg.begin(), arg.end(), value);
+    if (result.ec != std::errc{} || result.ptr != arg.end() || value == 0) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+} // namespace
+
+auto main(int argc, const char * argv[]) -> int
+{
+    std::size_t thread_count = DEFAULT_THREADS;
+    std::vector<std::filesystem::path> paths;
+    for (std::string_view arg : std::span(argv, static_cast<std::size_t>(argc)).subspan(1)) {
+        if (arg.starts_with("--")) {
+            auto count = parse_threads(arg);
+            if (!count.has_value()) {
+                std::println(std::cerr, "Usage: cpplox-stress [--threads=<count>] path...");
+                return static_cast<int>(cpplox::ExitCode::IncorrectUsage);
+            }
+            thread_count = count.value();
+        }
+        else {
+            paths.emplace_back(arg);
+        }
+    }
+
+    // Output of the scripts is checked by the regular tests, here it only interleaves
+    if (std::freopen("/dev/null", "w", stdout) == nullptr) {
+        return static_cast<int>(cpplox::ExitCode::IOError);
+    }
+
+    std::size_t failures = 0;
+    for (const auto & path : paths) {
+        auto source = read_file(path);
+        if (!source.has_value()) {
+            std::println(std::cerr, "Failed to open {}", path.native());
+            return static_cast<int>(cpplox::ExitCode::IOError);
+        }
+
+        auto expected = expected_result(path);
+        auto results = run_on_threads(source.value(), thread_count);
+        for (const auto [thread, result] : std::views::enumerate(results)) {
+            if (result != expected) {
+                std::println(
+                        std::cerr,
+                        "{}: thread {} finished with {}, expected {}",
+                        path.native(),
+                        thread,
+                        result_name(result),
+                        result_name(expected)
+                );
+                failures++;
+            }
+        }
+    }
+
+    std::println(
+            std::cerr, "{} scripts on {} threads, {} failures", paths.size(), thread_count, failures
+    );
+    return failures == 0 ? 0 : static_cast<int>(cpplox::ExitCode::SoftwareError);
+}
@@ -2,7 +2,7 @@
 cmake_policy(SET CMP0140 NEW)
 
 if(NOT DEFINED CPPLOX_EXE OR NOT DEFINED TEST_FILE)
-    message(FATAL_ERROR "Usage: cmake -DCPPLOX_EXE=<exe> -DTEST_FILE=<file> -P testrunner.cmake")
+    message(FATAL_ERROR "Usage: cmake -DCPPLOX_EXE=<exe> -DTEST_FILE=<file> [-DCPPLOX_ARGS=<args>] [-DBYTECODE_FILE=<file>] [-DCACHE_FILE=<file>] -P testrunner.cmake")
 endif()
 
 cmake_path(GET TEST_FILE STEM LAST_ONLY file_stem)
@@ -10,12 +10,23 @@ cmake_path(GET TEST_FILE PARENT_PATH file_parent)
 set(FILE_OUT "${TEST_FILE}.out")
 set(FILE_ERR "${TEST_FILE}.err")
 
-# Run the cpplox command and capture stdout and stderr
-execute_process(
-    COMMAND "${CPPLOX_EXE}" "${TEST_FILE}"
-    OUTPUT_VARIABLE STDOUT
-    ERROR_VARIABLE STDERR
-)
+function(compile_bytecode source output)
+    execute_process(
+        COMMAND "${CPPLOX_EXE}" "--compile-only=${output}" "${source}"
+        RESULT_VARIABLE COMPILE_RESULT
+        ERROR_VARIABLE COMPILE_STDERR
+    )
+    if(NOT COMPILE_RESULT EQUAL 0)
+        message(FATAL_ERROR "${source}: failed to compile into bytecode:\n${COMPILE_STDERR}")
+    endif()
+endfunction()
+
+# Compile the script into bytecode first and run that instead
+set(RUN_FILE "${TEST_FILE}")
+if(DEFINED BYTECODE_FILE)
+    compile_bytecode("${TEST_FILE}" "${BYTECODE_FILE}")
+    set(RUN_FILE "${BYTECODE_FILE}")
+endif()
 
 function(get_file_contents filename outvar)
     if(EXISTS "${filename}")
@@ -45,13 +56,35 @@ function(assert_equal expected actual assert_msg)
     endif()
 endfunction()
 
-# Compare stdout with <file>.out
 get_file_contents("${FILE_OUT}" EXPECTED_STDOUT)
-assert_equal("${EXPECTED_STDOUT}" "${STDOUT}" "Mismatch in stdout for ${TEST_FILE}")
-
-# Compare stderr with <file>.err
 get_file_contents("${FILE_ERR}" EXPECTED_STDERR)
-assert_equal("${EXPECTED_STDERR}" "${STDERR}" "Mismatch in stderr for ${TEST_FILE}")
+
+# Run the cpplox command and compare stdout with <file>.out and stderr with <file>.err
+function(check_run description)
+    execute_process(
+        COMMAND "${CPPLOX_EXE}" ${CPPLOX_ARGS} ${ARGN} "${RUN_FILE}"
+        OUTPUT_VARIABLE STDOUT
+        ERROR_VARIABLE STDERR
+    )
+    set(run "${TEST_FILE}${description}")
+    assert_equal("${EXPECTED_STDOUT}" "${STDOUT}" "Mismatch in stdout for ${run}")
+    assert_equal("${EXPECTED_STDERR}" "${STDERR}" "Mismatch in stderr for ${run}")
+    return(PROPAGATE has_errors)
+endfunction()
+
+if(DEFINED CACHE_FILE)
+    # Bytecode of the script itself is used, bytecode of another script is rejected as stale and
+    # the script is compiled instead. Both runs print what the script does.
+    compile_bytecode("${TEST_FILE}" "${CACHE_FILE}")
+    check_run(" with an up to date cache" "--cache=${CACHE_FILE}")
+
+    set(stale_file "${CACHE_FILE}.lox")
+    file(WRITE "${stale_file}" "print \"stale cache used\";\n")
+    compile_bytecode("${stale_file}" "${CACHE_FILE}")
+    check_run(" with a stale cache" "--cache=${CACHE_FILE}")
+else()
+    check_run("")
+endif()
 
 if(has_errors)
     message(FATAL_ERROR "${TEST_FILE}: test failed")